@@ -22,12 +22,15 @@
 class CannulaInterpolator : public UnstructuredPointInterpolator
 {
 public:
-	CannulaInterpolator() : hasRead_(false) { }
+	CannulaInterpolator() : hasRead_(false) 
+	{
+		minSearchRadius() = 1e-4;
+		maxSearchRadius() = 1e-3;
+		nearestNeighborFallback() = false;
+	}
 
 	virtual void readData(std::string fileName)
 	{
-		std::string	cacheFileName = fileName.substr(0, fileName.find_last_of('.')) + ".dat";
-
 		std::cout << "  Reading data from " << fileName << std::endl;
 		vtkSmartPointer<vtkEnSightGoldBinaryReader> reader = vtkSmartPointer<vtkEnSightGoldBinaryReader>::New();
 		reader->SetCaseFileName(fileName.c_str());
@@ -41,19 +44,29 @@ public:
 		datasetMerger->Update();*/
 		this->ds_ = vtkhelpers::getBlockByName(reader->GetOutput(), "Cannula");
 
-		velocity_ = vtkFloatArray::SafeDownCast(ds_->GetPointData()->GetArray("Velocity"));
-		shearXX_  = vtkFloatArray::SafeDownCast(ds_->GetPointData()->GetArray("shearRateii"));
-		shearXY_  = vtkFloatArray::SafeDownCast(ds_->GetPointData()->GetArray("shearRateij"));
-		shearXZ_  = vtkFloatArray::SafeDownCast(ds_->GetPointData()->GetArray("shearRateik"));
-		shearYY_  = vtkFloatArray::SafeDownCast(ds_->GetPointData()->GetArray("shearRatejj"));
-		shearYZ_  = vtkFloatArray::SafeDownCast(ds_->GetPointData()->GetArray("shearRatejk"));
-		shearZZ_  = vtkFloatArray::SafeDownCast(ds_->GetPointData()->GetArray("shearRatekk"));
+		vtkFloatArray * velocity = vtkFloatArray::SafeDownCast(ds_->GetPointData()->GetArray("Velocity"));
+		vtkFloatArray * shearXX  = vtkFloatArray::SafeDownCast(ds_->GetPointData()->GetArray("shearRateii"));
+		vtkFloatArray * shearXY  = vtkFloatArray::SafeDownCast(ds_->GetPointData()->GetArray("shearRateij"));
+		vtkFloatArray * shearXZ  = vtkFloatArray::SafeDownCast(ds_->GetPointData()->GetArray("shearRateik"));
+		vtkFloatArray * shearYY  = vtkFloatArray::SafeDownCast(ds_->GetPointData()->GetArray("shearRatejj"));
+		vtkFloatArray * shearYZ  = vtkFloatArray::SafeDownCast(ds_->GetPointData()->GetArray("shearRatejk"));
+		vtkFloatArray * shearZZ  = vtkFloatArray::SafeDownCast(ds_->GetPointData()->GetArray("shearRatekk"));
+
+		// The point data is stored in search tree order, build the tree first
+		std::cout << "   Building search tree" << std::endl;
+		this->buildSearchTree(ds_->GetPoints());
+
+		// Pack the point data
+		resizePointData(ds_->GetNumberOfPoints());
+		double velTuple[3];
+		for(vtkIdType i = 0; i < ds_->GetNumberOfPoints(); ++i) {
+			velocity->GetTuple(i, velTuple);
+			SymmetricTensor shear;
+			shear << shearXX->GetValue(i), shearXY->GetValue(i), shearXZ->GetValue(i), 
+				shearYY->GetValue(i), shearYZ->GetValue(i), shearZZ->GetValue(i);
+			setPointData(i, Vector(velTuple[0], velTuple[1], velTuple[2]), shear);
+		}
 
-		// Check for search tree, build if not present
-		//if( ! this->hasSearchTree()) {
-			std::cout << "   Building search tree" << std::endl;
-			this->buildSearchTree(ds_->GetPoints());			
-		//}
 		hasRead_ = true;
 	}
 
@@ -67,55 +80,8 @@ public:
 		return hasRead_;
 	}
 
-	virtual bool interpolate(const Vector & position, Vector & velocity, Matrix & shear)
-	{
-		// Get interpolation weights
-		scalar searchRadiusGuess = 1e-4;
-		scalar maxSearchRadius = 1e-3;
-		std::vector<InterpolationWeight> weights;
-		if(this->getInterpolationWeights(position, searchRadiusGuess, maxSearchRadius, weights)) {
-			velocity.setZero();
-			shear.setZero();
-	
-			scalar weightSum = 0;
-			for(auto weight : weights) {
-				// Velocity
-				double * velTuple = velocity_->GetTuple(weight.pointId);
-				for(int i=0; i < 3; ++i)
-					velocity[i] += weight.weight * velTuple[i];
-
-				// Shear rate
-				shear(0, 0) += weight.weight * shearXX_->GetTuple1(weight.pointId);
-				shear(0, 1) += weight.weight * shearXY_->GetTuple1(weight.pointId);
-				shear(0, 2) += weight.weight * shearXZ_->GetTuple1(weight.pointId);
-				shear(1, 1) += weight.weight * shearYY_->GetTuple1(weight.pointId);
-				shear(1, 2) += weight.weight * shearYZ_->GetTuple1(weight.pointId);
-				shear(2, 2) += weight.weight * shearZZ_->GetTuple1(weight.pointId);
-				weightSum += weight.weight;
-			}
-			shear(1, 0) = shear(0, 1);
-			shear(2, 0) = shear(0, 2);
-			shear(2, 1) = shear(1, 2);
-
-			shear /= weightSum;
-			velocity /= weightSum;
-			
-			return true;
-		} else {
-			std::cerr << "Interpolation failed" << std::endl;
-			return false;
-		}
-	}
-
 private:
 	bool hasRead_;
-	vtkFloatArray * velocity_;
-	vtkFloatArray * shearXX_;
-	vtkFloatArray * shearXY_;
-	vtkFloatArray * shearXZ_;
-	vtkFloatArray * shearYY_;
-	vtkFloatArray * shearYZ_;
-	vtkFloatArray * shearZZ_;
 	vtkSmartPointer<vtkUnstructuredGrid> ds_;
 };
 
@@ -99,6 +99,7 @@ int main(int argc, char * argv[])
 
 	// Create model
 	Model model;
+	auto interpolator = new CannulaInterpolator();
 
 	// Read parameters
 	{
@@ -112,10 +113,11 @@ int main(int argc, char * argv[])
 
 		// Parse parameters
 		model.fromJSON(j);
+		if(j.count("interpolation"))
+			interpolator->fromJSON(j.at("interpolation"));
 	}
 
-	// Create interpolator
-	model.setInterpolator(new CannulaInterpolator());
+	model.setInterpolator(interpolator);
 
 	model.run();
 }
@@ -3,6 +3,10 @@
 #include <ostream>
 #include "typedefs.h"
 #include "DynamicFactory.hh"
+#include "SimdMath.h"
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
 
 // Explicit template instantiation of the factory
 template class DynamicFactory<ActivationModel>;
@@ -13,13 +17,58 @@ ActivationModelFactory & activationModelFactory()
 	return activationModelFactory;
 }
 
+void ActivationModel::evaluate(float dt, const float * tau, const unsigned char * alive, float * dose, float * pas, size_t n)
+{
+	for(size_t i = 0; i < n; ++i)
+		if(alive[i])
+			evaluate(dt, tau[i], dose[i], pas[i]);
+}
+
 // NobiliActivationModel
 const int NobiliActivationModel::typeId = registerActivationModelTypeToFactory<NobiliActivationModel>("Nobili");
 
 void NobiliActivationModel::evaluate(float dt, float tau, float & dose, float & pas)
 {
-	pas += c_ * a_ * dt * std::pow(dose, a_-1) * std::pow(tau, b_/a_);
-	dose += dt * std::pow(tau, b_/a_);
+	// Without stress the state is unchanged, and the dose term may be infinite
+	if( ! (tau > 0))
+		return;
+	const float stressTerm = std::pow(tau, b_/a_);
+	pas += c_ * a_ * dt * std::pow(dose, a_-1) * stressTerm;
+	dose += dt * stressTerm;
+}
+
+// Four particles at a time, the stress term is computed once per particle with the SSE exp and log.
+// With a = 1 the dose term is one and is skipped. Particles without stress are not changed.
+void NobiliActivationModel::evaluate(float dt, const float * tau, const unsigned char * alive, float * dose, float * pas, size_t n)
+{
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 dtVector = _mm_set1_ps(dt);
+	const __m128 stressExponent = _mm_set1_ps(b_/a_);
+	const __m128 doseExponent = _mm_set1_ps(a_-1);
+	const __m128 pasFactor = _mm_set1_ps(c_ * a_ * dt);
+	const __m128 zeroDoseTerm = _mm_set1_ps(std::pow(0.f, a_-1));
+	const bool isLinearInDose = a_ == 1;
+
+	size_t i = 0;
+	for(; i + 4 <= n; i += 4) {
+		const __m128 tauVector = _mm_loadu_ps(tau + i);
+		const __m128 isStressed = _mm_and_ps(simd::mask4(alive + i), _mm_cmpgt_ps(tauVector, zero));
+		if( ! _mm_movemask_ps(isStressed))
+			continue;
+
+		const __m128 doseVector = _mm_loadu_ps(dose + i);
+		const __m128 stressTerm = _mm_and_ps(isStressed, simd::pow4(tauVector, stressExponent));
+		__m128 pasIncrement = _mm_mul_ps(pasFactor, stressTerm);
+		if( ! isLinearInDose) {
+			const __m128 doseTerm = simd::select4(_mm_cmpgt_ps(doseVector, zero), simd::pow4(doseVector, doseExponent), zeroDoseTerm);
+			pasIncrement = _mm_and_ps(isStressed, _mm_mul_ps(pasIncrement, doseTerm));
+		}
+		_mm_storeu_ps(pas + i, _mm_add_ps(_mm_loadu_ps(pas + i), pasIncrement));
+		_mm_storeu_ps(dose + i, _mm_add_ps(doseVector, _mm_mul_ps(dtVector, stressTerm)));
+	}
+	for(; i < n; ++i)
+		if(alive[i])
+			evaluate(dt, tau[i], dose[i], pas[i]);
 }
 
 void NobiliActivationModel::fromJSON(const json & jsonObject) 
@@ -29,3 +78,238 @@ void NobiliActivationModel::fromJSON(const json & jsonObject)
 	c_ = jsonObject.at("c");
 }
 
+
+// PowerLawActivationModel
+void PowerLawActivationModel::fromJSON(const json & jsonObject)
+{
+	C_ = jsonGetOrDefault<float>(jsonObject, "C", C_);
+	alpha_ = jsonGetOrDefault<float>(jsonObject, "alpha", alpha_);
+	beta_ = jsonGetOrDefault<float>(jsonObject, "beta", beta_);
+	if( ! (C_ > 0) || ! (alpha_ > 0) || ! (beta_ > 0))
+		throw std::runtime_error("The power law activation model parameters C, alpha and beta must be positive");
+}
+
+// GiersiepenActivationModel
+const int GiersiepenActivationModel::typeId = registerActivationModelTypeToFactory<GiersiepenActivationModel>("Giersiepen");
+
+void GiersiepenActivationModel::evaluate(float dt, float tau, float & dose, float & pas)
+{
+	const float exposureTime = dose + dt;
+	pas += C_ * std::pow(tau, alpha_) * (std::pow(exposureTime, beta_) - std::pow(dose, beta_));
+	dose = exposureTime;
+}
+
+void GiersiepenActivationModel::evaluate(float dt, const float * tau, const unsigned char * alive, float * dose, float * pas, size_t n)
+{
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 dtVector = _mm_set1_ps(dt);
+	const __m128 alphaVector = _mm_set1_ps(alpha_);
+	const __m128 betaVector = _mm_set1_ps(beta_);
+	const __m128 CVector = _mm_set1_ps(C_);
+
+	size_t i = 0;
+	for(; i + 4 <= n; i += 4) {
+		// The exposure time of the alive particles increases also without stress
+		const __m128 isAlive = simd::mask4(alive + i);
+		if( ! _mm_movemask_ps(isAlive))
+			continue;
+		const __m128 tauVector = _mm_loadu_ps(tau + i);
+		const __m128 isStressed = _mm_and_ps(isAlive, _mm_cmpgt_ps(tauVector, zero));
+
+		// The exposure time starts at zero, where t^beta is zero
+		const __m128 time = _mm_loadu_ps(dose + i);
+		const __m128 nextTime = _mm_add_ps(time, dtVector);
+		const __m128 timeTerm = _mm_sub_ps(simd::pow4(nextTime, betaVector), 
+			_mm_and_ps(_mm_cmpgt_ps(time, zero), simd::pow4(time, betaVector)));
+		const __m128 increment = _mm_and_ps(isStressed, _mm_mul_ps(_mm_mul_ps(CVector, simd::pow4(tauVector, alphaVector)), timeTerm));
+		_mm_storeu_ps(pas + i, _mm_add_ps(_mm_loadu_ps(pas + i), increment));
+		_mm_storeu_ps(dose + i, simd::select4(isAlive, nextTime, time));
+	}
+	for(; i < n; ++i)
+		if(alive[i])
+			evaluate(dt, tau[i], dose[i], pas[i]);
+}
+
+// HeuserOpitzActivationModel
+const int HeuserOpitzActivationModel::typeId = registerActivationModelTypeToFactory<HeuserOpitzActivationModel>("HeuserOpitz");
+
+void HeuserOpitzActivationModel::evaluate(float dt, float tau, float & dose, float & pas)
+{
+	dose += dt * std::pow(tau, alpha_ / beta_);
+	pas = C_ * std::pow(dose, beta_);
+}
+
+void HeuserOpitzActivationModel::evaluate(float dt, const float * tau, const unsigned char * alive, float * dose, float * pas, size_t n)
+{
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 dtVector = _mm_set1_ps(dt);
+	const __m128 stressExponent = _mm_set1_ps(alpha_ / beta_);
+	const __m128 betaVector = _mm_set1_ps(beta_);
+	const __m128 CVector = _mm_set1_ps(C_);
+
+	size_t i = 0;
+	for(; i + 4 <= n; i += 4) {
+		const __m128 tauVector = _mm_loadu_ps(tau + i);
+		const __m128 isStressed = _mm_and_ps(simd::mask4(alive + i), _mm_cmpgt_ps(tauVector, zero));
+		if( ! _mm_movemask_ps(isStressed))
+			continue;
+
+		// The dose of a stressed particle is positive
+		const __m128 doseVector = _mm_add_ps(_mm_loadu_ps(dose + i), 
+			_mm_and_ps(isStressed, _mm_mul_ps(dtVector, simd::pow4(tauVector, stressExponent))));
+		const __m128 pasVector = _mm_mul_ps(CVector, simd::pow4(doseVector, betaVector));
+		_mm_storeu_ps(dose + i, doseVector);
+		_mm_storeu_ps(pas + i, simd::select4(isStressed, pasVector, _mm_loadu_ps(pas + i)));
+	}
+	for(; i < n; ++i)
+		if(alive[i])
+			evaluate(dt, tau[i], dose[i], pas[i]);
+}
+
+// GrigioniActivationModel
+const int GrigioniActivationModel::typeId = registerActivationModelTypeToFactory<GrigioniActivationModel>("Grigioni");
+
+void GrigioniActivationModel::evaluate(float dt, float tau, float & dose, float & pas)
+{
+	// Without stress there is no damage, but the exposure time increases
+	dose += dt;
+	if( ! (tau > 0))
+		return;
+	const float rate = C_ * std::pow(tau, alpha_);
+	const float equivalentTime = pas > 0 ? std::pow(pas / rate, 1 / beta_) : 0;
+	pas = rate * std::pow(equivalentTime + dt, beta_);
+}
+
+// In logarithms, log(pas) = log(C tau^alpha) + beta log(t_eq + dt), with log(t_eq) = (log(pas) - log(C tau^alpha)) / beta
+void GrigioniActivationModel::evaluate(float dt, const float * tau, const unsigned char * alive, float * dose, float * pas, size_t n)
+{
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 dtVector = _mm_set1_ps(dt);
+	const __m128 logC = _mm_set1_ps(std::log(C_));
+	const __m128 alphaVector = _mm_set1_ps(alpha_);
+	const __m128 betaVector = _mm_set1_ps(beta_);
+	const __m128 inverseBeta = _mm_set1_ps(1 / beta_);
+
+	size_t i = 0;
+	for(; i + 4 <= n; i += 4) {
+		const __m128 isAlive = simd::mask4(alive + i);
+		if( ! _mm_movemask_ps(isAlive))
+			continue;
+		const __m128 tauVector = _mm_loadu_ps(tau + i);
+		const __m128 isStressed = _mm_and_ps(isAlive, _mm_cmpgt_ps(tauVector, zero));
+
+		const __m128 pasVector = _mm_loadu_ps(pas + i);
+		const __m128 logRate = _mm_add_ps(logC, _mm_mul_ps(alphaVector, simd::log4(tauVector)));
+		const __m128 equivalentTime = _mm_and_ps(_mm_cmpgt_ps(pasVector, zero), 
+			simd::exp4(_mm_mul_ps(_mm_sub_ps(simd::log4(pasVector), logRate), inverseBeta)));
+		const __m128 nextPas = simd::exp4(_mm_add_ps(logRate, _mm_mul_ps(betaVector, simd::log4(_mm_add_ps(equivalentTime, dtVector)))));
+		_mm_storeu_ps(pas + i, simd::select4(isStressed, nextPas, pasVector));
+		_mm_storeu_ps(dose + i, _mm_add_ps(_mm_loadu_ps(dose + i), _mm_and_ps(isAlive, dtVector)));
+	}
+	for(; i < n; ++i)
+		if(alive[i])
+			evaluate(dt, tau[i], dose[i], pas[i]);
+}
+
+// LinearDamageActivationModel
+const int LinearDamageActivationModel::typeId = registerActivationModelTypeToFactory<LinearDamageActivationModel>("LinearDamage");
+
+void LinearDamageActivationModel::fromJSON(const json & jsonObject)
+{
+	PowerLawActivationModel::fromJSON(jsonObject);
+	threshold_ = jsonGetOrDefault<float>(jsonObject, "threshold", threshold_);
+	if(threshold_ < 0)
+		throw std::runtime_error("The stress threshold of the linear damage model must be non-negative");
+}
+
+void LinearDamageActivationModel::evaluate(float dt, float tau, float & dose, float & pas)
+{
+	if(tau <= threshold_)
+		return;
+	dose += dt * std::pow(tau - threshold_, alpha_ / beta_);
+	pas = std::pow(C_, 1 / beta_) * dose;
+}
+
+void LinearDamageActivationModel::evaluate(float dt, const float * tau, const unsigned char * alive, float * dose, float * pas, size_t n)
+{
+	const __m128 thresholdVector = _mm_set1_ps(threshold_);
+	const __m128 dtVector = _mm_set1_ps(dt);
+	const __m128 stressExponent = _mm_set1_ps(alpha_ / beta_);
+	const __m128 pasFactor = _mm_set1_ps(std::pow(C_, 1 / beta_));
+
+	size_t i = 0;
+	for(; i + 4 <= n; i += 4) {
+		const __m128 excessStress = _mm_sub_ps(_mm_loadu_ps(tau + i), thresholdVector);
+		const __m128 isDamaging = _mm_and_ps(simd::mask4(alive + i), _mm_cmpgt_ps(excessStress, _mm_setzero_ps()));
+		if( ! _mm_movemask_ps(isDamaging))
+			continue;
+
+		const __m128 doseVector = _mm_add_ps(_mm_loadu_ps(dose + i), 
+			_mm_and_ps(isDamaging, _mm_mul_ps(dtVector, simd::pow4(excessStress, stressExponent))));
+		_mm_storeu_ps(dose + i, doseVector);
+		_mm_storeu_ps(pas + i, simd::select4(isDamaging, _mm_mul_ps(pasFactor, doseVector), _mm_loadu_ps(pas + i)));
+	}
+	for(; i < n; ++i)
+		if(alive[i])
+			evaluate(dt, tau[i], dose[i], pas[i]);
+}
+
+// SoaresActivationModel
+const int SoaresActivationModel::typeId = registerActivationModelTypeToFactory<SoaresActivationModel>("Soares");
+
+void SoaresActivationModel::fromJSON(const json & jsonObject)
+{
+	PowerLawActivationModel::fromJSON(jsonObject);
+	sensitization_ = jsonGetOrDefault<float>(jsonObject, "sensitization", sensitization_);
+	if(sensitization_ < 0)
+		throw std::runtime_error("The sensitization of the Soares model must be non-negative");
+}
+
+void SoaresActivationModel::evaluate(float dt, float tau, float & dose, float & pas)
+{
+	// The power law damage gives d(pas^(1/beta))/dt = C^(1/beta) tau^(alpha/beta)
+	const float damagedPas = std::pow(std::pow(pas, 1 / beta_) + dt * std::pow(C_, 1 / beta_) * std::pow(tau, alpha_ / beta_), beta_);
+	pas += (1 - pas) * (sensitization_ * dose * pas * dt + (damagedPas - pas));
+	pas = std::min(1.f, std::max(0.f, pas));
+	dose += dt * tau;
+}
+
+// MultiActivationModel
+const int MultiActivationModel::typeId = registerActivationModelTypeToFactory<MultiActivationModel>("Multi");
+
+void MultiActivationModel::evaluate(float dt, float tau, float & dose, float & pas)
+{
+	models_[0]->evaluate(dt, tau, dose, pas);
+}
+
+void MultiActivationModel::evaluate(float dt, const float * tau, const unsigned char * alive, float * dose, float * pas, size_t n)
+{
+	models_[0]->evaluate(dt, tau, alive, dose, pas, n);
+}
+
+// The models are evaluated one after the other over the same particles, which are
+// few enough (see particleBlockSize in Model.cpp) for the stresses to stay in the cache
+void MultiActivationModel::evaluateModels(float dt, const float * tau, const unsigned char * alive, float * const * dose, float * const * pas, size_t n)
+{
+	for(size_t m = 0; m < models_.size(); ++m)
+		models_[m]->evaluate(dt, tau, alive, dose[m], pas[m], n);
+}
+
+void MultiActivationModel::fromJSON(const json & jsonObject)
+{
+	models_.clear();
+	names_.clear();
+	for(const json & modelObject : jsonObject.at("models")) {
+		std::unique_ptr<ActivationModel> model = activationModelFactory().createFromJSON(modelObject);
+		if(model->numberOfModels() != 1)
+			throw std::runtime_error("Multi activation models cannot be nested");
+
+		// Unnamed models are named by their type and index
+		std::string name = jsonGetOrDefault<std::string>(modelObject, "name", 
+			modelObject.at("type").get<std::string>() + std::to_string(models_.size()));
+		models_.push_back(std::move(model));
+		names_.push_back(name);
+	}
+	if(models_.empty())
+		throw std::runtime_error("A multi activation model needs at least one model");
+}
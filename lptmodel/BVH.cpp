@@ -1,14 +1,16 @@
 #include <algorithm>
+#include <limits>
 #include "BVH.h"
+#include "Triangle.h"
 #include "Log.h"
 #include "Stopwatch.h"
 
 //! Node for storing state information during traversal.
 struct BVHTraversal {
-  uint32_t i; // Node
+  uint32_t i; // Node, or leaf with leafBit set
   float mint; // Minimum hit time for this node.
   BVHTraversal() { }
-  BVHTraversal(int _i, float _mint) : i(_i), mint(_mint) { }
+  BVHTraversal(uint32_t _i, float _mint) : i(_i), mint(_mint) { }
 };
 
 //! - Compute the nearest intersection of all objects within the tree.
@@ -16,11 +18,22 @@ struct BVHTraversal {
 //! - In the case where we want to find out of there is _ANY_ intersection at all,
 //!   set occlusion == true, in which case we exit on the first hit, rather
 //!   than find the closest.
-bool BVH::getIntersection(const Ray& ray, IntersectionInfo* intersection, bool occlusion) const {
-  intersection->t = 999999999.f;
+//! - The four children of a node are tested with one SSE slab test, and the hit
+//!   children are visited in order of increasing entry distance.
+//! - Only intersections closer than maxDistance are found, which prunes the traversal of short rays.
+bool BVH::getIntersection(const Ray& ray, IntersectionInfo* intersection, bool occlusion, float maxDistance) const {
+  intersection->t = maxDistance;
   intersection->object = NULL;
-  float bbhits[4];
-  int32_t closer, other;
+  if(nWideNodes == 0)
+    return false;
+
+  // Ray data broadcast to all lanes
+  const __m128 origin[3] = { _mm_set1_ps(ray.o.x), _mm_set1_ps(ray.o.y), _mm_set1_ps(ray.o.z) };
+  const __m128 invDir[3] = { _mm_set1_ps(ray.inv_d.x), _mm_set1_ps(ray.inv_d.y), _mm_set1_ps(ray.inv_d.z) };
+  const __m128 plusInf = _mm_set1_ps(std::numeric_limits<float>::infinity());
+  const __m128 minusInf = _mm_set1_ps(-std::numeric_limits<float>::infinity());
+  const __m128 zero = _mm_setzero_ps();
+  float __attribute__((aligned(16))) tnear[4];
 
   // Working set
   BVHTraversal todo[256];
@@ -32,106 +45,633 @@ bool BVH::getIntersection(const Ray& ray, IntersectionInfo* intersection, bool o
 
   while(stackptr>=0) {
     // Pop off the next node to work on.
-    int ni = todo[stackptr].i;
+    uint32_t ni = todo[stackptr].i;
     float near = todo[stackptr].mint;
     stackptr--;
-    const BVHFlatNode &node(flatTree[ ni ]);
 
     // If this node is further than the closest found intersection, continue
     if(near > intersection->t)
       continue;
 
     // Is leaf -> Intersect
-    if( node.rightOffset == 0 ) {
-      for(uint32_t o=0;o<node.nPrims;++o) {
+    if(ni & leafBit) {
+      const BVH4Leaf &leaf(leaves[ni & ~leafBit]);
+      if(normals) {
+        if(intersectTriangles(ray, leaf, intersection, occlusion) && occlusion)
+          return true;
+        continue;
+      }
+
+      for(uint32_t o=0;o<leaf.nPrims;++o) {
         IntersectionInfo current;
 
-        const Object* obj = (*build_prims)[node.start+o];
+        const Object* obj = (*build_prims)[leaf.start+o];
         bool hit = obj->getIntersection(ray, &current);
 
-        if (hit) {
+        if (hit && current.t < intersection->t) {
           // If we're only looking for occlusion, then any hit is good enough
           if(occlusion) {
             return true;
           }
 
           // Otherwise, keep the closest intersection only
-          if (current.t < intersection->t) {
-            *intersection = current;
-          }
+          *intersection = current;
+          intersection->primitive = leaf.start+o;
         }
       }
+      continue;
+    }
 
-    } else { // Not a leaf
-
-      bool hitc0 = flatTree[ni+1].bbox.intersect(ray, bbhits, bbhits+1);
-      bool hitc1 = flatTree[ni+node.rightOffset].bbox.intersect(ray, bbhits+2, bbhits+3);
+    // Slab test of the four child boxes, see BBox::intersect. The min/max order
+    // filters out the NaNs of 0 * inf when the ray lies in a slab plane.
+    const BVH4Node &node(nodes[ni]);
+    __m128 boxNear = minusInf, boxFar = plusInf;
+    for(int d = 0; d < 3; ++d) {
+      const __m128 l1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bboxMin[d]), origin[d]), invDir[d]);
+      const __m128 l2 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bboxMax[d]), origin[d]), invDir[d]);
+      const __m128 lmax = _mm_max_ps(_mm_min_ps(l1, plusInf), _mm_min_ps(l2, plusInf));
+      const __m128 lmin = _mm_min_ps(_mm_max_ps(l1, minusInf), _mm_max_ps(l2, minusInf));
+      boxFar = _mm_min_ps(boxFar, lmax);
+      boxNear = _mm_max_ps(boxNear, lmin);
+    }
+    const __m128 hits = _mm_and_ps(_mm_cmpge_ps(boxFar, zero), 
+      _mm_and_ps(_mm_cmpge_ps(boxFar, boxNear), _mm_cmple_ps(boxNear, _mm_set1_ps(intersection->t))));
+    int mask = _mm_movemask_ps(hits) & ((1 << node.nChildren) - 1);
+    if(!mask)
+      continue;
+    _mm_store_ps(tnear, boxNear);
+
+    // Sort the hit children by decreasing entry distance, and push them so that the closest is visited first
+    BVHTraversal hitChildren[4];
+    int nHits = 0;
+    for(int c = 0; c < 4; ++c) {
+      if(!(mask & (1 << c)))
+        continue;
+      int k = nHits++;
+      for(; k > 0 && hitChildren[k-1].mint < tnear[c]; --k)
+        hitChildren[k] = hitChildren[k-1];
+      hitChildren[k] = BVHTraversal(node.children[c], tnear[c]);
+    }
+    for(int k = 0; k < nHits; ++k)
+      todo[++stackptr] = hitChildren[k];
+  }
 
-      // Did we hit both nodes?
-      if(hitc0 && hitc1) {
+  // If we hit something,
+  if(intersection->object != NULL) {
+    intersection->hit = ray.o + ray.d * intersection->t;
+    if(!normals)
+      intersection->normal = intersection->object->getNormal(*intersection);
+  }
 
-        // We assume that the left child is a closer hit...
-        closer = ni+1;
-        other = ni+node.rightOffset;
+  return intersection->object != NULL;
+}
 
-        // ... If the right child was actually closer, swap the relavent values.
-        if(bbhits[2] < bbhits[0]) {
-          std::swap(bbhits[0], bbhits[2]);
-          std::swap(bbhits[1], bbhits[3]);
-          std::swap(closer,other);
-        }
+//! Closest point of the triangle abc to p, see Ericson (2005) Real-Time Collision Detection, section 5.1.5
+static Vector3 closestPointOnTriangle(const Vector3& p, const Vector3& a, const Vector3& b, const Vector3& c) {
+  const Vector3 ab = b - a, ac = c - a, ap = p - a;
+  const float d1 = ab * ap, d2 = ac * ap;
+  if(d1 <= 0.f && d2 <= 0.f)
+    return a;
+
+  const Vector3 bp = p - b;
+  const float d3 = ab * bp, d4 = ac * bp;
+  if(d3 >= 0.f && d4 <= d3)
+    return b;
+
+  const float vc = d1*d4 - d3*d2;
+  if(vc <= 0.f && d1 >= 0.f && d3 <= 0.f)
+    return a + ab * (d1 / (d1 - d3));
+
+  const Vector3 cp = p - c;
+  const float d5 = ab * cp, d6 = ac * cp;
+  if(d6 >= 0.f && d5 <= d6)
+    return c;
+
+  const float vb = d5*d2 - d1*d6;
+  if(vb <= 0.f && d2 >= 0.f && d6 <= 0.f)
+    return a + ac * (d2 / (d2 - d6));
+
+  const float va = d3*d6 - d5*d4;
+  if(va <= 0.f && (d4 - d3) >= 0.f && (d5 - d6) >= 0.f)
+    return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+
+  // Inside the face
+  const float denom = 1.f / (va + vb + vc);
+  return a + ab * (vb * denom) + ac * (vc * denom);
+}
 
-        // It's possible that the nearest object is still in the other side, but we'll
-        // check the further-awar node later...
+//! - Depth first search, the children are visited in order of increasing distance to
+//!   their boxes, and subtrees farther away than the closest point found so far are pruned.
+bool BVH::getClosestPoint(const Vector3& p, ClosestPointInfo* info, float maxDistance) const {
+  info->distance = maxDistance;
+  if(nWideNodes == 0 || !normals)
+    return false;
 
-        // Push the farther first
-        todo[++stackptr] = BVHTraversal(other, bbhits[2]);
+  const __m128 position[3] = { _mm_set1_ps(p.x), _mm_set1_ps(p.y), _mm_set1_ps(p.z) };
+  const __m128 zero = _mm_setzero_ps();
+  float __attribute__((aligned(16))) boxDistances[4];
+  float bestSquared = maxDistance * maxDistance;
+  bool found = false;
 
-        // And now the closer (with overlap test)
-        todo[++stackptr] = BVHTraversal(closer, bbhits[0]);
-      }
+  // Working set, mint is the squared distance to the node box
+  BVHTraversal todo[256];
+  int32_t stackptr = 0;
+  todo[stackptr] = BVHTraversal(0, 0.f);
 
-      else if (hitc0) {
-        todo[++stackptr] = BVHTraversal(ni+1, bbhits[0]);
-      }
+  while(stackptr>=0) {
+    const uint32_t ni = todo[stackptr].i;
+    const float near = todo[stackptr].mint;
+    stackptr--;
+    if(near >= bestSquared)
+      continue;
 
-      else if(hitc1) {
-        todo[++stackptr] = BVHTraversal(ni + node.rightOffset, bbhits[2]);
+    if(ni & leafBit) {
+      const BVH4Leaf &leaf(leaves[ni & ~leafBit]);
+      for(uint32_t o = 0; o < leaf.nPrims; ++o) {
+        const Triangle* tri = static_cast<const Triangle*>((*build_prims)[leaf.start+o]);
+        const Vector3 closest = closestPointOnTriangle(p, tri->v0, tri->v1, tri->v2);
+        const Vector3 delta = closest - p;
+        const float squaredDistance = delta * delta;
+        if(squaredDistance < bestSquared) {
+          bestSquared = squaredDistance;
+          info->point = closest;
+          info->primitive = leaf.start+o;
+          found = true;
+        }
       }
+      continue;
+    }
 
+    // Squared distance from p to the four child boxes
+    const BVH4Node &node(nodes[ni]);
+    __m128 squaredDistance = zero;
+    for(int d = 0; d < 3; ++d) {
+      const __m128 below = _mm_sub_ps(_mm_load_ps(node.bboxMin[d]), position[d]);
+      const __m128 above = _mm_sub_ps(position[d], _mm_load_ps(node.bboxMax[d]));
+      const __m128 delta = _mm_max_ps(_mm_max_ps(below, above), zero);
+      squaredDistance = _mm_add_ps(squaredDistance, _mm_mul_ps(delta, delta));
     }
+    int mask = _mm_movemask_ps(_mm_cmplt_ps(squaredDistance, _mm_set1_ps(bestSquared))) & ((1 << node.nChildren) - 1);
+    if(!mask)
+      continue;
+    _mm_store_ps(boxDistances, squaredDistance);
+
+    // Push the closest child last, so that it is visited first
+    BVHTraversal closeChildren[4];
+    int nClose = 0;
+    for(int c = 0; c < 4; ++c) {
+      if(!(mask & (1 << c)))
+        continue;
+      int k = nClose++;
+      for(; k > 0 && closeChildren[k-1].mint < boxDistances[c]; --k)
+        closeChildren[k] = closeChildren[k-1];
+      closeChildren[k] = BVHTraversal(node.children[c], boxDistances[c]);
+    }
+    for(int k = 0; k < nClose; ++k)
+      todo[++stackptr] = closeChildren[k];
   }
 
-  // If we hit something,
-  if(intersection->object != NULL)
-    intersection->hit = ray.o + ray.d * intersection->t;
-
-  return intersection->object != NULL;
+  if(found)
+    info->distance = std::sqrt(bestSquared);
+  return found;
 }
 
 BVH::~BVH() {
   delete[] flatTree;
 }
 
+static BVHBuildParameters leafSizeParameters(uint32_t leafSize) {
+  BVHBuildParameters parameters;
+  parameters.leafSize = leafSize;
+  return parameters;
+}
+
 BVH::BVH(std::vector<Object*>* objects, uint32_t leafSize)
-  : nNodes(0), nLeafs(0), leafSize(leafSize), build_prims(objects), flatTree(NULL) {
+  : BVH(objects, leafSizeParameters(leafSize)) { }
+
+BVH::BVH(std::vector<Object*>* objects, const BVHBuildParameters& parameters, bool)
+  : nNodes(0), nLeafs(0), depth(0), parameters(parameters), build_prims(objects), flatTree(NULL),
+    nodes(NULL), leaves(NULL), blocks(NULL), normals(NULL), nWideNodes(0), nWideLeaves(0), nBlocks(0) { }
+
+BVH::BVH(std::vector<Object*>* objects, const BVHBuildParameters& parameters)
+  : BVH(objects, parameters, false) {
     Stopwatch sw;
 
     // Build the tree based on the input object data set.
     build();
 
+    // Collapse to the 4-wide tree used for the traversal
+    wideTree.reserve(nNodes / 2 + 1);
+    wideLeaves.reserve(nLeafs);
+    if(nNodes > 0)
+      collapse(0);
+    packTriangles();
+    setArraysToOwnedStorage();
+
     // Output tree build time and statistics
     double constructionTime = sw.read();
-    LOG_STAT("Built BVH (%d nodes, with %d leafs) in %d ms", nNodes, nLeafs, (int)(1000*constructionTime));
+    LOG_STAT("Built BVH (%d nodes, with %d leafs, depth %d, SAH cost %.2f) in %d ms, %d 4-wide nodes", 
+      nNodes, nLeafs, depth, sahCost(), (int)(1000*constructionTime), (int)wideTree.size());
+
+    // The binary tree is no longer needed
+    delete[] flatTree;
+    flatTree = NULL;
+  }
+
+void BVH::setArraysToOwnedStorage() {
+  nodes = wideTree.data();
+  leaves = wideLeaves.data();
+  blocks = triangleBlocks.data();
+  normals = triangleNormals.empty() ? NULL : triangleNormals.data();
+  nWideNodes = wideTree.size();
+  nWideLeaves = wideLeaves.size();
+  nBlocks = triangleBlocks.size();
+}
+
+// Cache file section ids, the users of the BVH use ids from 16
+namespace {
+  const uint32_t bvhNodesSection = 1;
+  const uint32_t bvhLeavesSection = 2;
+  const uint32_t bvhBlocksSection = 3;
+  const uint32_t bvhNormalsSection = 4;
+}
+
+void BVH::addSections(CacheFileWriter& writer) const {
+  writer.addArray(bvhNodesSection, nodes, nWideNodes);
+  writer.addArray(bvhLeavesSection, leaves, nWideLeaves);
+  writer.addArray(bvhBlocksSection, blocks, nBlocks);
+  writer.addArray(bvhNormalsSection, normals, normals ? build_prims->size() : 0);
+}
+
+/*! Use the arrays of a cache file in place
+ *  - Only trees of packed triangles are cached, the leaves are checked against the
+ *    primitive and block counts so that a corrupt file cannot index out of bounds.
+ *  - collapse() stores the children after their parent, which is checked so that a
+ *    corrupt file cannot contain a cycle or overflow the traversal stacks.
+ */
+BVH* BVH::fromCache(std::vector<Object*>* objects, const BVHBuildParameters& parameters,
+    const std::shared_ptr<CacheFileReader>& reader) {
+  size_t numberOfNodes, numberOfLeaves, numberOfBlocks, numberOfNormals;
+  const BVH4Node* cachedNodes = reader->array<BVH4Node>(bvhNodesSection, numberOfNodes);
+  const BVH4Leaf* cachedLeaves = reader->array<BVH4Leaf>(bvhLeavesSection, numberOfLeaves);
+  const BVHTriangleBlock* cachedBlocks = reader->array<BVHTriangleBlock>(bvhBlocksSection, numberOfBlocks);
+  const Vector3* cachedNormals = reader->array<Vector3>(bvhNormalsSection, numberOfNormals);
+  if(numberOfNormals != objects->size() || (numberOfNodes == 0) != objects->empty())
+    return NULL;
+  for(size_t l = 0; l < numberOfLeaves; ++l) {
+    const BVH4Leaf &leaf(cachedLeaves[l]);
+    if((uint64_t) leaf.start + leaf.nPrims > objects->size() || (uint64_t) leaf.block + (leaf.nPrims + 3) / 4 > numberOfBlocks)
+      return NULL;
+  }
+  // The traversal stacks hold up to three siblings per level and the children of the current node,
+  // so the depth is limited as well. The depth of a child is known once its parents are checked.
+  const uint32_t maxTraversalDepth = 80;
+  std::vector<uint32_t> nodeDepth(numberOfNodes, 1);
+  for(size_t n = 0; n < numberOfNodes; ++n) {
+    if(cachedNodes[n].nChildren > 4 || nodeDepth[n] > maxTraversalDepth)
+      return NULL;
+    for(uint32_t c = 0; c < cachedNodes[n].nChildren; ++c) {
+      const uint32_t child = cachedNodes[n].children[c];
+      if((child & leafBit) ? (child & ~leafBit) >= numberOfLeaves : (child <= n || child >= numberOfNodes))
+        return NULL;
+      if( ! (child & leafBit))
+        nodeDepth[child] = std::max(nodeDepth[child], nodeDepth[n] + 1);
+    }
+  }
+
+  BVH* bvh = new BVH(objects, parameters, false);
+  bvh->cacheFile = reader;
+  bvh->nodes = cachedNodes;
+  bvh->leaves = cachedLeaves;
+  bvh->blocks = cachedBlocks;
+  bvh->normals = cachedNormals;
+  bvh->nWideNodes = numberOfNodes;
+  bvh->nWideLeaves = numberOfLeaves;
+  bvh->nBlocks = numberOfBlocks;
+  LOG_STAT("Read BVH from cache (%d 4-wide nodes, %d leafs)", (int)numberOfNodes, (int)numberOfLeaves);
+  return bvh;
+}
+
+/*! Collapse the binary subtree at binaryNode into 4-wide nodes
+ *  - The children of a 4-wide node are found by repeatedly replacing the inner
+ *    node with the largest surface area by its two children.
+ *  - Unused child slots have empty bounds and are masked out by nChildren.
+ */
+uint32_t BVH::collapse(uint32_t binaryNode) {
+  uint32_t gathered[4];
+  uint32_t nGathered = 0;
+  const BVHFlatNode &root(flatTree[binaryNode]);
+  if(root.rightOffset == 0) {
+    // A leaf root
+    gathered[nGathered++] = binaryNode;
+  } else {
+    gathered[nGathered++] = binaryNode + 1;
+    gathered[nGathered++] = binaryNode + root.rightOffset;
+    while(nGathered < 4) {
+      int largest = -1;
+      float largestArea = -1.f;
+      for(uint32_t k = 0; k < nGathered; ++k) {
+        const BVHFlatNode &node(flatTree[gathered[k]]);
+        if(node.rightOffset != 0 && node.bbox.surfaceArea() > largestArea) {
+          largest = k;
+          largestArea = node.bbox.surfaceArea();
+        }
+      }
+      if(largest < 0)
+        break;
+
+      const uint32_t opened = gathered[largest];
+      gathered[largest] = opened + 1;
+      gathered[nGathered++] = opened + flatTree[opened].rightOffset;
+    }
+  }
+
+  const uint32_t index = wideTree.size();
+  wideTree.push_back(BVH4Node());
+  const float inf = std::numeric_limits<float>::infinity();
+  for(uint32_t c = 0; c < 4; ++c) {
+    uint32_t child = 0;
+    if(c < nGathered) {
+      const BVHFlatNode &node(flatTree[gathered[c]]);
+      if(node.rightOffset == 0) {
+        BVH4Leaf leaf;
+        leaf.start = node.start;
+        leaf.nPrims = node.nPrims;
+        leaf.block = 0;
+        wideLeaves.push_back(leaf);
+        child = (wideLeaves.size() - 1) | leafBit;
+      } else {
+        child = collapse(gathered[c]);
+      }
+    }
+
+    // The recursion may have reallocated the tree
+    BVH4Node &wideNode(wideTree[index]);
+    for(int d = 0; d < 3; ++d) {
+      wideNode.bboxMin[d][c] = c < nGathered ? flatTree[gathered[c]].bbox.min[d] : inf;
+      wideNode.bboxMax[d][c] = c < nGathered ? flatTree[gathered[c]].bbox.max[d] : -inf;
+    }
+    wideNode.children[c] = child;
+  }
+  wideTree[index].nChildren = nGathered;
+  return index;
+}
+
+/*! Pack the triangles of each leaf into blocks of four
+ *  - The edges and unit normals are precomputed, the normals are indexed by primitive.
+ *  - Other primitive types are intersected through Object::getIntersection.
+ */
+void BVH::packTriangles() {
+  for(size_t i = 0; i < build_prims->size(); ++i)
+    if(dynamic_cast<const Triangle*>((*build_prims)[i]) == NULL)
+      return;
+
+  triangleNormals.resize(build_prims->size());
+  for(size_t i = 0; i < build_prims->size(); ++i) {
+    const Triangle* tri = static_cast<const Triangle*>((*build_prims)[i]);
+    const Vector3 normal = (tri->v1 - tri->v0) ^ (tri->v2 - tri->v0);
+    const float len = length(normal);
+    triangleNormals[i] = len > 0.f ? normal / len : Vector3(0.f, 0.f, 0.f);
+  }
+
+  for(size_t l = 0; l < wideLeaves.size(); ++l) {
+    BVH4Leaf &leaf(wideLeaves[l]);
+    leaf.block = triangleBlocks.size();
+    for(uint32_t first = 0; first < leaf.nPrims; first += 4) {
+      BVHTriangleBlock block;
+      for(uint32_t k = 0; k < 4; ++k) {
+        if(first + k < leaf.nPrims) {
+          const Triangle* tri = static_cast<const Triangle*>((*build_prims)[leaf.start + first + k]);
+          const Vector3 e1 = tri->v1 - tri->v0;
+          const Vector3 e2 = tri->v2 - tri->v0;
+          for(int d = 0; d < 3; ++d) {
+            block.v0[d][k] = tri->v0[d];
+            block.e1[d][k] = e1[d];
+            block.e2[d][k] = e2[d];
+          }
+        } else {
+          for(int d = 0; d < 3; ++d)
+            block.v0[d][k] = block.e1[d][k] = block.e2[d][k] = 0.f;
+        }
+      }
+      triangleBlocks.push_back(block);
+    }
   }
+}
+
+/*! Moller-Trumbore intersection of a ray with the four triangles of each block of a leaf
+ *  - The hits are computed in single precision. With parameters.doublePrecisionFallback,
+ *    the hits with a barycentric coordinate within edgeTolerance of the triangle edges
+ *    are recomputed with the double precision Triangle::getIntersection, so that rays
+ *    hitting an edge shared by two triangles are not lost.
+ */
+bool BVH::intersectTriangles(const Ray& ray, const BVH4Leaf& leaf, IntersectionInfo* intersection, bool occlusion) const {
+  const float edgeTolerance = 1e-5f;
+  const __m128 dir[3] = { _mm_set1_ps(ray.d.x), _mm_set1_ps(ray.d.y), _mm_set1_ps(ray.d.z) };
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 one = _mm_set1_ps(1.f);
+  float __attribute__((aligned(16))) tLanes[4];
+  bool found = false;
+
+  const uint32_t nBlocks = (leaf.nPrims + 3) / 4;
+  for(uint32_t b = 0; b < nBlocks; ++b) {
+    const BVHTriangleBlock &block(blocks[leaf.block + b]);
+    __m128 v0[3], e1[3], e2[3], s[3];
+    for(int d = 0; d < 3; ++d) {
+      v0[d] = _mm_load_ps(block.v0[d]);
+      e1[d] = _mm_load_ps(block.e1[d]);
+      e2[d] = _mm_load_ps(block.e2[d]);
+      s[d] = _mm_sub_ps(_mm_set1_ps(ray.o[d]), v0[d]);
+    }
+
+    // q = d x e2, a = e1 . q
+    const __m128 qx = _mm_sub_ps(_mm_mul_ps(dir[1], e2[2]), _mm_mul_ps(dir[2], e2[1]));
+    const __m128 qy = _mm_sub_ps(_mm_mul_ps(dir[2], e2[0]), _mm_mul_ps(dir[0], e2[2]));
+    const __m128 qz = _mm_sub_ps(_mm_mul_ps(dir[0], e2[1]), _mm_mul_ps(dir[1], e2[0]));
+    const __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1[0], qx), _mm_mul_ps(e1[1], qy)), _mm_mul_ps(e1[2], qz));
+    const __m128 f = _mm_div_ps(one, a);
+
+    // u = f s . q, r = s x e1, v = f d . r, t = f e2 . r
+    const __m128 u = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(s[0], qx), _mm_mul_ps(s[1], qy)), _mm_mul_ps(s[2], qz)));
+    const __m128 rx = _mm_sub_ps(_mm_mul_ps(s[1], e1[2]), _mm_mul_ps(s[2], e1[1]));
+    const __m128 ry = _mm_sub_ps(_mm_mul_ps(s[2], e1[0]), _mm_mul_ps(s[0], e1[2]));
+    const __m128 rz = _mm_sub_ps(_mm_mul_ps(s[0], e1[1]), _mm_mul_ps(s[1], e1[0]));
+    const __m128 v = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dir[0], rx), _mm_mul_ps(dir[1], ry)), _mm_mul_ps(dir[2], rz)));
+    const __m128 t = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2[0], rx), _mm_mul_ps(e2[1], ry)), _mm_mul_ps(e2[2], rz)));
+    const __m128 w = _mm_sub_ps(one, _mm_add_ps(u, v));
+
+    // Parallel rays and unused lanes have a == 0, and NaN coordinates that fail all comparisons
+    const __m128 closer = _mm_and_ps(_mm_cmpneq_ps(a, zero),
+      _mm_and_ps(_mm_cmpge_ps(t, zero), _mm_cmplt_ps(t, _mm_set1_ps(intersection->t))));
+    const __m128 inside = _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmpge_ps(w, zero)));
+    int mask = _mm_movemask_ps(_mm_and_ps(closer, inside));
+
+    int fallbackMask = 0;
+    if(parameters.doublePrecisionFallback) {
+      const __m128 tolerance = _mm_set1_ps(edgeTolerance);
+      const __m128 nearEdge = _mm_cmplt_ps(_mm_min_ps(u, _mm_min_ps(v, w)), tolerance);
+      const __m128 minusTolerance = _mm_set1_ps(-edgeTolerance);
+      const __m128 insideTolerance = _mm_and_ps(_mm_cmpge_ps(u, minusTolerance), 
+        _mm_and_ps(_mm_cmpge_ps(v, minusTolerance), _mm_cmpge_ps(w, minusTolerance)));
+      fallbackMask = _mm_movemask_ps(_mm_and_ps(nearEdge, insideTolerance)) & ((1 << std::min(4u, leaf.nPrims - 4*b)) - 1);
+      mask &= ~fallbackMask;
+    }
+    if(!mask && !fallbackMask)
+      continue;
+    if(occlusion && mask)
+      return true;
+
+    _mm_store_ps(tLanes, t);
+    while(mask) {
+      const int lane = __builtin_ctz(mask);
+      mask &= mask - 1;
+      if(tLanes[lane] < intersection->t) {
+        const uint32_t prim = leaf.start + 4*b + lane;
+        intersection->t = tLanes[lane];
+        intersection->object = (*build_prims)[prim];
+        intersection->primitive = prim;
+        intersection->normal = normals[prim];
+        found = true;
+      }
+    }
+    while(fallbackMask) {
+      const int lane = __builtin_ctz(fallbackMask);
+      fallbackMask &= fallbackMask - 1;
+      const uint32_t prim = leaf.start + 4*b + lane;
+      const Triangle* tri = static_cast<const Triangle*>((*build_prims)[prim]);
+      IntersectionInfo current;
+      if(tri->Triangle::getIntersection(ray, &current) && current.t < intersection->t) {
+        if(occlusion)
+          return true;
+        intersection->t = current.t;
+        intersection->object = tri;
+        intersection->primitive = prim;
+        intersection->normal = normals[prim];
+        found = true;
+      }
+    }
+  }
+  return found;
+}
 
 struct BVHBuildEntry {
   // If non-zero then this is the index of the parent. (used in offsets)
   uint32_t parent;
   // The range of objects in the object list covered by this node.
   uint32_t start, end;
+  // Depth of the node, the root has depth 1
+  uint32_t depth;
+};
+
+// Relative costs of the SAH
+static const float sahTraversalCost = 1.f;
+static const float sahIntersectionCost = 1.f;
+
+//! Bounds and number of primitives of a SAH bin
+struct BVHBin {
+  BBox bbox;
+  uint32_t count;
 };
 
+static BBox emptyBBox() {
+  const float inf = std::numeric_limits<float>::infinity();
+  return BBox(Vector3(inf, inf, inf), Vector3(-inf, -inf, -inf));
+}
+
+/*! Binned SAH split (Wald, "On fast construction of SAH-based bounding volume hierarchies", 2007)
+ *  - The centroids are binned along each axis, and the split between two bins with the lowest
+ *    cost C = Ct + Ci * (A_left * N_left + A_right * N_right) / A_node is used.
+ *  - The primitive bounds and centroids are swapped along with the primitives.
+ */
+uint32_t BVH::sahSplit(uint32_t start, uint32_t end, const BBox& centroidBounds, float nodeArea,
+    std::vector<BBox>& primBoxes, std::vector<Vector3>& centroids, std::vector<BVHBin>& bins, std::vector<float>& rightCost) {
+  const uint32_t nBins = bins.size();
+
+  float bestCost = std::numeric_limits<float>::infinity();
+  uint32_t bestDim = 0, bestBin = 0;
+  for(uint32_t dim = 0; dim < 3; ++dim) {
+    const float extent = centroidBounds.extent[dim];
+    if(!(extent > 0.f))
+      continue;
+    const float binScale = nBins / extent;
+
+    // Bin the centroids
+    for(BVHBin& bin : bins) {
+      bin.bbox = emptyBBox();
+      bin.count = 0;
+    }
+    for(uint32_t p = start; p < end; ++p) {
+      uint32_t b = std::min(nBins - 1, (uint32_t)(binScale * (centroids[p][dim] - centroidBounds.min[dim])));
+      bins[b].bbox.expandToInclude(primBoxes[p]);
+      bins[b].count++;
+    }
+
+    // Sweep from the right, rightCost[b] is the cost of the bins b..nBins-1
+    BBox bb = emptyBBox();
+    uint32_t count = 0;
+    for(uint32_t b = nBins - 1; b > 0; --b) {
+      bb.expandToInclude(bins[b].bbox);
+      count += bins[b].count;
+      rightCost[b] = count ? count * bb.surfaceArea() : 0.f;
+    }
+
+    // Sweep from the left, the split after bin b puts bins 0..b to the left
+    bb = emptyBBox();
+    count = 0;
+    for(uint32_t b = 0; b < nBins - 1; ++b) {
+      bb.expandToInclude(bins[b].bbox);
+      count += bins[b].count;
+      float leftCost = count ? count * bb.surfaceArea() : 0.f;
+      float cost = sahTraversalCost + sahIntersectionCost * (leftCost + rightCost[b+1]) / nodeArea;
+      if(count > 0 && count < end - start && cost < bestCost) {
+        bestCost = cost;
+        bestDim = dim;
+        bestBin = b;
+      }
+    }
+  }
+
+  // All centroids coincide
+  if(bestCost == std::numeric_limits<float>::infinity())
+    return start;
+
+  // Partition the list of objects on this split
+  const float binScale = nBins / centroidBounds.extent[bestDim];
+  uint32_t mid = start;
+  for(uint32_t i = start; i < end; ++i) {
+    uint32_t b = std::min(nBins - 1, (uint32_t)(binScale * (centroids[i][bestDim] - centroidBounds.min[bestDim])));
+    if(b <= bestBin) {
+      std::swap((*build_prims)[i], (*build_prims)[mid]);
+      std::swap(primBoxes[i], primBoxes[mid]);
+      std::swap(centroids[i], centroids[mid]);
+      ++mid;
+    }
+  }
+  return mid;
+}
+
+//! SAH cost of the tree, the sum of the node costs weighted by the probability
+//! that a node is hit given that the root is hit (the ratio of the surface areas)
+float BVH::sahCost() const {
+  if(nNodes == 0)
+    return 0.f;
+
+  const float rootArea = flatTree[0].bbox.surfaceArea();
+  if(!(rootArea > 0.f))
+    return 0.f;
+
+  float cost = 0.f;
+  for(uint32_t n = 0; n < nNodes; ++n) {
+    const BVHFlatNode& node = flatTree[n];
+    const float probability = node.bbox.surfaceArea() / rootArea;
+    if(node.rightOffset == 0)
+      cost += probability * sahIntersectionCost * node.nPrims;
+    else
+      cost += probability * sahTraversalCost;
+  }
+  return cost;
+}
+
 /*! Build the BVH, given an input data set
  *  - Handling our own stack is quite a bit faster than the recursive style.
  *  - Each build stack entry's parent field eventually stores the offset
@@ -151,8 +691,21 @@ void BVH::build()
   todo[stackptr].start = 0;
   todo[stackptr].end = build_prims->size();
   todo[stackptr].parent = 0xfffffffc;
+  todo[stackptr].depth = 1;
   stackptr++;
 
+  // Bounds and centroids of the primitives, kept in the order of build_prims
+  std::vector<BBox> primBoxes(build_prims->size());
+  std::vector<Vector3> centroids(build_prims->size());
+  for(uint32_t p = 0; p < build_prims->size(); ++p) {
+    primBoxes[p] = (*build_prims)[p]->getBBox();
+    centroids[p] = (*build_prims)[p]->getCentroid();
+  }
+
+  // Scratch space of the SAH splits, shared by all nodes
+  std::vector<BVHBin> bins(std::max(parameters.numberOfBins, 2u));
+  std::vector<float> rightCost(bins.size());
+
   BVHFlatNode node;
   std::vector<BVHFlatNode> buildnodes;
   buildnodes.reserve(build_prims->size()*2);
@@ -163,24 +716,26 @@ void BVH::build()
     uint32_t start = bnode.start;
     uint32_t end = bnode.end;
     uint32_t nPrims = end - start;
+    uint32_t nodeDepth = bnode.depth;
 
     nNodes++;
+    depth = std::max(depth, nodeDepth);
     node.start = start;
     node.nPrims = nPrims;
     node.rightOffset = Untouched;
 
     // Calculate the bounding box for this node
-    BBox bb( (*build_prims)[start]->getBBox());
-    BBox bc( (*build_prims)[start]->getCentroid());
+    BBox bb( primBoxes[start] );
+    BBox bc( centroids[start] );
     for(uint32_t p = start+1; p < end; ++p) {
-      bb.expandToInclude( (*build_prims)[p]->getBBox());
-      bc.expandToInclude( (*build_prims)[p]->getCentroid());
+      bb.expandToInclude( primBoxes[p] );
+      bc.expandToInclude( centroids[p] );
     }
     node.bbox = bb;
 
     // If the number of primitives at this point is less than the leaf
     // size, then this will become a leaf. (Signified by rightOffset == 0)
-    if(nPrims <= leafSize) {
+    if(nPrims <= parameters.leafSize) {
       node.rightOffset = 0;
       nLeafs++;
     }
@@ -203,18 +758,24 @@ void BVH::build()
     if(node.rightOffset == 0)
       continue;
 
-    // Set the split dimensions
-    uint32_t split_dim = bc.maxDimension();
-
-    // Split on the center of the longest axis
-    float split_coord = .5f * (bc.min[split_dim] + bc.max[split_dim]);
-
-    // Partition the list of objects on this split
     uint32_t mid = start;
-    for(uint32_t i=start;i<end;++i) {
-      if( (*build_prims)[i]->getCentroid()[split_dim] < split_coord ) {
-        std::swap( (*build_prims)[i], (*build_prims)[mid] );
-        ++mid;
+    if(parameters.splitMethod == BVHBuildParameters::SAH) {
+      mid = sahSplit(start, end, bc, bb.surfaceArea(), primBoxes, centroids, bins, rightCost);
+    } else {
+      // Set the split dimensions
+      uint32_t split_dim = bc.maxDimension();
+
+      // Split on the center of the longest axis
+      float split_coord = .5f * (bc.min[split_dim] + bc.max[split_dim]);
+
+      // Partition the list of objects on this split
+      for(uint32_t i=start;i<end;++i) {
+        if( centroids[i][split_dim] < split_coord ) {
+          std::swap( (*build_prims)[i], (*build_prims)[mid] );
+          std::swap( primBoxes[i], primBoxes[mid] );
+          std::swap( centroids[i], centroids[mid] );
+          ++mid;
+        }
       }
     }
 
@@ -227,12 +788,14 @@ void BVH::build()
     todo[stackptr].start = mid;
     todo[stackptr].end = end;
     todo[stackptr].parent = nNodes-1;
+    todo[stackptr].depth = nodeDepth + 1;
     stackptr++;
 
     // Push left child
     todo[stackptr].start = start;
     todo[stackptr].end = mid;
     todo[stackptr].parent = nNodes-1;
+    todo[stackptr].depth = nodeDepth + 1;
     stackptr++;
   }
 
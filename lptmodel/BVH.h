@@ -3,7 +3,9 @@
 
 #include "BBox.h"
 #include <vector>
+#include <memory>
 #include <stdint.h>
+#include "CacheFile.h"
 #include "Object.h"
 #include "IntersectionInfo.h"
 #include "Ray.h"
@@ -14,21 +16,123 @@ struct BVHFlatNode {
   uint32_t start, nPrims, rightOffset;
 };
 
+//! Node of the 4-wide tree used for the traversal. The child bounds are stored per axis
+//! (structure of arrays), so that the four child boxes are tested against a ray at once.
+struct alignas(16) BVH4Node {
+  float bboxMin[3][4];  //!< [axis][child]
+  float bboxMax[3][4];
+  uint32_t children[4]; //!< Node index, or leaf index with leafBit set
+  uint32_t nChildren;
+};
+
+//! Primitive range of a leaf of the 4-wide tree
+struct BVH4Leaf {
+  uint32_t start, nPrims;
+  uint32_t block; //!< First triangle block, when the primitives are packed
+};
+
+//! Four triangles of a leaf with the vertex and edges stored per axis (structure of
+//! arrays), so that the triangles are intersected with a ray at once.
+//! Unused lanes have zero edges, and are never hit.
+struct alignas(16) BVHTriangleBlock {
+  float v0[3][4]; //!< [axis][triangle]
+  float e1[3][4]; //!< v1 - v0
+  float e2[3][4]; //!< v2 - v0
+};
+
+//! Result of a closest point query
+struct ClosestPointInfo {
+  float distance;     //!< Distance to the closest point
+  Vector3 point;      //!< Closest point
+  uint32_t primitive; //!< Index of the primitive in the BVH primitive list
+};
+
+//! Parameters of the BVH construction
+struct BVHBuildParameters {
+  enum SplitMethod {
+    Midpoint,   //!< Split on the center of the longest centroid axis
+    SAH         //!< Binned surface area heuristic
+  };
+
+  uint32_t leafSize = 4;        //!< Nodes with at most this number of primitives become leaves
+  uint32_t numberOfBins = 16;   //!< Number of bins per axis evaluated by the SAH split
+  SplitMethod splitMethod = SAH;
+  bool doublePrecisionFallback = false; //!< Recompute triangle hits close to an edge in double precision
+};
+
+//! Bounds and number of primitives of a SAH bin, see BVH.cpp
+struct BVHBin;
+
 //! \author Brandon Pelfrey
 //! A Bounding Volume Hierarchy system for fast Ray-Object intersection tests
 class BVH {
-  uint32_t nNodes, nLeafs, leafSize;
+  uint32_t nNodes, nLeafs, depth;
+  BVHBuildParameters parameters;
   std::vector<Object*>* build_prims;
 
   //! Build the BVH tree out of build_prims
   void build();
 
-  // Fast Traversal System
+  //! Partition the primitives [start, end) with a binned SAH split, returns the first primitive of the right child
+  //! bins and rightCost are scratch space of the build, with one entry per bin
+  uint32_t sahSplit(uint32_t start, uint32_t end, const BBox& centroidBounds, float nodeArea,
+      std::vector<BBox>& primBoxes, std::vector<Vector3>& centroids, std::vector<BVHBin>& bins, std::vector<float>& rightCost);
+
+  //! Expected cost of a ray traversal, relative to the cost of a primitive intersection
+  float sahCost() const;
+
+  //! Collapse the binary tree into the 4-wide tree, returns the index of the 4-wide node
+  uint32_t collapse(uint32_t binaryNode);
+
+  //! Pack the leaf primitives into triangle blocks, if all primitives are triangles
+  void packTriangles();
+
+  //! Intersect the packed triangles of a leaf, updates the intersection if a closer hit is found
+  bool intersectTriangles(const Ray& ray, const BVH4Leaf& leaf, IntersectionInfo* intersection, bool occlusion) const;
+
+  // Binary tree, only used during the construction
   BVHFlatNode *flatTree;
 
+  //! Point the traversal arrays to the owned storage
+  void setArraysToOwnedStorage();
+
+  //! Empty tree, filled by readSections
+  BVH(std::vector<Object*>* objects, const BVHBuildParameters& parameters, bool);
+
+  // Fast Traversal System. The arrays are either owned by the tree, or used in place
+  // from a memory mapped cache file. normals is NULL when the primitives are not packed.
+  static const uint32_t leafBit = 0x80000000u;
+  const BVH4Node* nodes;
+  const BVH4Leaf* leaves;
+  const BVHTriangleBlock* blocks;
+  const Vector3* normals;
+  uint32_t nWideNodes, nWideLeaves, nBlocks;
+
+  // Storage when the tree is built in memory
+  std::vector<BVH4Node> wideTree;
+  std::vector<BVH4Leaf> wideLeaves;
+  std::vector<BVHTriangleBlock> triangleBlocks;
+  std::vector<Vector3> triangleNormals;
+
+  // Storage when the tree is read from a cache file
+  std::shared_ptr<CacheFileReader> cacheFile;
+
   public:
   BVH(std::vector<Object*>* objects, uint32_t leafSize=4);
-  bool getIntersection(const Ray& ray, IntersectionInfo *intersection, bool occlusion) const ;
+  BVH(std::vector<Object*>* objects, const BVHBuildParameters& parameters);
+
+  //! Cache file IO, see CacheFile.h. The cache stores the traversal arrays of the packed triangles, not the
+  //! primitive order, the objects must be in the order they had after the construction of the cached tree.
+  //! The tree keeps a reference to the cache file, as the arrays are used in place.
+  void addSections(CacheFileWriter& writer) const;
+  //! Returns NULL if the cache file does not hold a tree of the objects.
+  static BVH* fromCache(std::vector<Object*>* objects, const BVHBuildParameters& parameters,
+      const std::shared_ptr<CacheFileReader>& reader);
+
+  bool getIntersection(const Ray& ray, IntersectionInfo *intersection, bool occlusion, float maxDistance = 999999999.f) const ;
+
+  //! Closest point of the triangles to p, closer than maxDistance. Only supported for triangle primitives.
+  bool getClosestPoint(const Vector3& p, ClosestPointInfo *info, float maxDistance = 999999999.f) const;
 
   ~BVH();
 };
@@ -0,0 +1,153 @@
+#include "CacheFile.h"
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// MappedFile
+bool MappedFile::open(const std::string & fileName)
+{
+	close();
+
+	int fd = ::open(fileName.c_str(), O_RDONLY);
+	if(fd < 0)
+		return false;
+
+	struct stat fileStatus;
+	if(fstat(fd, &fileStatus) != 0 || fileStatus.st_size == 0) {
+		::close(fd);
+		return false;
+	}
+
+	void * address = mmap(nullptr, fileStatus.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);	// The mapping keeps the file open
+	if(address == MAP_FAILED)
+		return false;
+
+	data_ = static_cast<const char *>(address);
+	size_ = fileStatus.st_size;
+	return true;
+}
+
+void MappedFile::close()
+{
+	if(data_)
+		munmap(const_cast<char *>(data_), size_);
+	data_ = nullptr;
+	size_ = 0;
+}
+
+namespace detail {
+inline uint64_t alignSectionOffset(uint64_t offset)
+{
+	return (offset + cachefile::sectionAlignment - 1) / cachefile::sectionAlignment * cachefile::sectionAlignment;
+}
+}
+
+// CacheFileWriter
+void CacheFileWriter::addSection(uint32_t id, const void * data, size_t size)
+{
+	sections_.push_back(Section{id, data, size});
+}
+
+bool CacheFileWriter::write(const std::string & fileName) const
+{
+	// Header and section table
+	cachefile::Header header;
+	std::memcpy(header.magic, cachefile::magic, sizeof(header.magic));
+	header.version = cachefile::version;
+	header.numberOfSections = sections_.size();
+
+	std::vector<cachefile::SectionEntry> entries(sections_.size());
+	uint64_t offset = sizeof(cachefile::Header) + entries.size() * sizeof(cachefile::SectionEntry);
+	for(size_t i = 0; i < sections_.size(); ++i) {
+		offset = detail::alignSectionOffset(offset);
+		entries[i].id = sections_[i].id;
+		entries[i].padding = 0;
+		entries[i].offset = offset;
+		entries[i].size = sections_[i].size;
+		offset += sections_[i].size;
+	}
+
+	// Write to a file name that is unique to this process
+	std::string temporaryFileName = fileName + ".tmp" + std::to_string(getpid());
+	{
+		std::ofstream out(temporaryFileName.c_str(), std::ios::binary);
+		if( ! out.good())
+			return false;
+
+		out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+		out.write(reinterpret_cast<const char *>(entries.data()), entries.size() * sizeof(cachefile::SectionEntry));
+		uint64_t position = sizeof(cachefile::Header) + entries.size() * sizeof(cachefile::SectionEntry);
+		const char zeros[cachefile::sectionAlignment] = {0};
+		for(size_t i = 0; i < sections_.size(); ++i) {
+			out.write(zeros, entries[i].offset - position);
+			out.write(static_cast<const char *>(sections_[i].data), sections_[i].size);
+			position = entries[i].offset + entries[i].size;
+		}
+
+		if( ! out.good()) {
+			out.close();
+			std::remove(temporaryFileName.c_str());
+			return false;
+		}
+	}
+
+	if(std::rename(temporaryFileName.c_str(), fileName.c_str()) != 0) {
+		std::remove(temporaryFileName.c_str());
+		return false;
+	}
+	return true;
+}
+
+// CacheFileReader
+bool CacheFileReader::open(const std::string & fileName)
+{
+	sections_ = nullptr;
+	numberOfSections_ = 0;
+	if( ! file_.open(fileName))
+		return false;
+
+	// Validate the header and the section table
+	const size_t fileSize = file_.size();
+	if(fileSize < sizeof(cachefile::Header))
+		return false;
+
+	const cachefile::Header * header = reinterpret_cast<const cachefile::Header *>(file_.data());
+	if(std::memcmp(header->magic, cachefile::magic, sizeof(header->magic)) != 0 || header->version != cachefile::version)
+		return false;
+
+	const uint64_t tableSize = (uint64_t) header->numberOfSections * sizeof(cachefile::SectionEntry);
+	if(sizeof(cachefile::Header) + tableSize > fileSize)
+		return false;
+
+	const cachefile::SectionEntry * sections = reinterpret_cast<const cachefile::SectionEntry *>(file_.data() + sizeof(cachefile::Header));
+	for(uint32_t i = 0; i < header->numberOfSections; ++i)
+		if(sections[i].offset % cachefile::sectionAlignment != 0 || sections[i].offset > fileSize || sections[i].size > fileSize - sections[i].offset)
+			return false;
+
+	sections_ = sections;
+	numberOfSections_ = header->numberOfSections;
+	return true;
+}
+
+const cachefile::SectionEntry * CacheFileReader::findSection(uint32_t id) const
+{
+	for(uint32_t i = 0; i < numberOfSections_; ++i)
+		if(sections_[i].id == id)
+			return &sections_[i];
+	return nullptr;
+}
+
+const void * CacheFileReader::section(uint32_t id, size_t & size) const
+{
+	const cachefile::SectionEntry * entry = findSection(id);
+	if( ! entry)
+		throw std::runtime_error("Missing cache file section " + std::to_string(id));
+	size = entry->size;
+	return file_.data() + entry->offset;
+}
@@ -0,0 +1,108 @@
+#ifndef CACHEFILE_H_
+#define CACHEFILE_H_
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <stdexcept>
+
+// Read-only memory mapping of a file. Processes mapping the same file share the pages.
+class MappedFile {
+public:
+	MappedFile() = default;
+	~MappedFile() { close(); }
+
+	// Disallow copy construction and assignment
+	MappedFile(const MappedFile &) = delete;
+	MappedFile & operator=(const MappedFile &) = delete;
+
+	bool open(const std::string & fileName);
+	void close();
+
+	bool isOpen() const { return data_ != nullptr; }
+	const char * data() const { return data_; }
+	size_t size() const { return size_; }
+
+private:
+	const char * data_ = nullptr;
+	size_t size_ = 0;
+};
+
+/*
+ * Binary cache file made of sections that are used in place through a memory mapping.
+ * Layout:
+ *  header: magic, format version and number of sections
+ *  section table: id, byte offset and byte size of each section
+ *  section data, each section starting at a multiple of sectionAlignment bytes
+ * The section data is stored exactly as it is used in memory, so the files are not portable
+ * between machines with different endianness.
+ */
+namespace cachefile {
+	const char magic[8] = {'L', 'P', 'T', 'C', 'A', 'C', 'H', 'E'};
+	const uint32_t version = 2;
+	const size_t sectionAlignment = 64;
+
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		uint32_t numberOfSections;
+	};
+
+	struct SectionEntry {
+		uint32_t id;
+		uint32_t padding;
+		uint64_t offset;
+		uint64_t size;
+	};
+}
+
+class CacheFileWriter {
+public:
+	// The data is not copied, and must stay valid until the file has been written
+	void addSection(uint32_t id, const void * data, size_t size);
+
+	template<class T>
+	void addArray(uint32_t id, const T * data, size_t count) { addSection(id, data, count * sizeof(T)); }
+
+	// Write to a temporary file which is then renamed, so that a partially written file is never seen by a reader
+	bool write(const std::string & fileName) const;
+
+private:
+	struct Section {
+		uint32_t id;
+		const void * data;
+		size_t size;
+	};
+	std::vector<Section> sections_{};
+};
+
+class CacheFileReader {
+public:
+	// Returns false if the file does not exist or is not a valid cache file of the current version
+	bool open(const std::string & fileName);
+
+	bool hasSection(uint32_t id) const { return findSection(id) != nullptr; }
+
+	// Throws std::runtime_error if the section is missing or its size is not a multiple of sizeof(T)
+	template<class T>
+	const T * array(uint32_t id, size_t & count) const
+	{
+		size_t size;
+		const void * data = section(id, size);
+		if(size % sizeof(T) != 0)
+			throw std::runtime_error("Unexpected size of cache file section " + std::to_string(id));
+		count = size / sizeof(T);
+		return static_cast<const T *>(data);
+	}
+
+	const void * section(uint32_t id, size_t & size) const;
+
+private:
+	const cachefile::SectionEntry * findSection(uint32_t id) const;
+
+	MappedFile file_;
+	const cachefile::SectionEntry * sections_ = nullptr;
+	uint32_t numberOfSections_ = 0;
+};
+
+#endif /* CACHEFILE_H_ */
@@ -2,6 +2,61 @@
 #include "Quaternion.h"
 #include <iostream>
 #include "typedefs.h"
+#include <pmmintrin.h>
+
+namespace {
+// ret[k] = matrix * (pos[k] - before) + after
+void transformPositions(const Matrix & matrix, const Vector & before, const Vector & after, const Vector * pos, size_t n, Vector * ret)
+{
+	__m128 m[3][3];
+	for(int r = 0; r < 3; ++r)
+		for(int c = 0; c < 3; ++c)
+			m[r][c] = _mm_set1_ps(matrix(r, c));
+	const __m128 translation[3] = { _mm_set1_ps(after[0] - (matrix.row(0) * before)(0)), 
+		_mm_set1_ps(after[1] - (matrix.row(1) * before)(0)), _mm_set1_ps(after[2] - (matrix.row(2) * before)(0)) };
+
+	// Four positions are 12 consecutive floats, load them and shuffle to x, y and z lanes
+	size_t k = 0;
+	for(; k + 4 <= n; k += 4) {
+		const float * in = pos[k].data();
+		const __m128 a = _mm_loadu_ps(in);		// x0 y0 z0 x1
+		const __m128 b = _mm_loadu_ps(in + 4);	// y1 z1 x2 y2
+		const __m128 c = _mm_loadu_ps(in + 8);	// z2 x3 y3 z3
+		const __m128 bc = _mm_shuffle_ps(b, c, _MM_SHUFFLE(3, 1, 0, 2));
+		const __m128 x = _mm_shuffle_ps(a, bc, _MM_SHUFFLE(2, 0, 3, 0));
+		const __m128 y = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 0, 2, 1)), 
+			_mm_shuffle_ps(b, c, _MM_SHUFFLE(3, 2, 0, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+		const __m128 z = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 0, 2)), 
+			_mm_shuffle_ps(c, c, _MM_SHUFFLE(2, 3, 1, 0)), _MM_SHUFFLE(2, 0, 2, 0));
+
+		__m128 out[3];
+		for(int r = 0; r < 3; ++r)
+			out[r] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[r][0], x), _mm_mul_ps(m[r][1], y)), 
+				_mm_add_ps(_mm_mul_ps(m[r][2], z), translation[r]));
+
+		// Shuffle back to consecutive positions
+		float * dst = ret[k].data();
+		_mm_storeu_ps(dst, _mm_shuffle_ps(_mm_shuffle_ps(out[0], out[1], _MM_SHUFFLE(0, 0, 0, 0)), 
+			_mm_shuffle_ps(out[2], out[0], _MM_SHUFFLE(1, 1, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0)));
+		_mm_storeu_ps(dst + 4, _mm_shuffle_ps(_mm_shuffle_ps(out[1], out[2], _MM_SHUFFLE(1, 1, 1, 1)), 
+			_mm_shuffle_ps(out[0], out[1], _MM_SHUFFLE(2, 2, 2, 2)), _MM_SHUFFLE(2, 0, 2, 0)));
+		_mm_storeu_ps(dst + 8, _mm_shuffle_ps(_mm_shuffle_ps(out[2], out[0], _MM_SHUFFLE(3, 3, 2, 2)), 
+			_mm_shuffle_ps(out[1], out[2], _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0)));
+	}
+	for(; k < n; ++k)
+		ret[k] = matrix * (pos[k] - before) + after;
+}
+}
+
+void FrameTransform::positionsToWorldFrame(const Vector * pos, size_t n, Vector * ret) const
+{
+	transformPositions(rotation_, Vector::Zero(), offset_, pos, n, ret);
+}
+
+void FrameTransform::positionsToLocalFrame(const Vector * pos, size_t n, Vector * ret) const
+{
+	transformPositions(rotation_.transpose(), offset_, Vector::Zero(), pos, n, ret);
+}
 
 void CoordinateSystem::fromJSON(const json & j)
 {
@@ -40,6 +95,11 @@ Quaternion CoordinateSystem::getOrientation(scalar t) const
 	return orientation_;
 }
 
+FrameTransform CoordinateSystem::transformAt(scalar t) const
+{
+	return FrameTransform(getOrientation(t).to_rot_matrix(), offset_, angularVelocity_);
+}
+
 void CoordinateSystem::normalVectorToWorldFrame(scalar t, const Vector & normal, Vector & ret) const
 {
 	getOrientation(t).apply_rotation(normal, ret);
@@ -70,7 +130,6 @@ void CoordinateSystem::positionToWorldFrame(scalar t, const Vector & pos, Vector
 
 void CoordinateSystem::positionToLocalFrame(scalar t, const Vector & pos, Vector & ret) const
 {
-	ret = pos - offset_;
-	getOrientation(t).apply_inv_rotation(pos, ret);
+	getOrientation(t).apply_inv_rotation(pos - offset_, ret);
 }		
 
@@ -6,6 +6,43 @@
 #include "typedefs.h"
 #include "macros.h"
 
+/*
+ * Transform between the world frame and a local frame at a fixed time, with the rotation stored
+ * as a matrix. Computed once per time by CoordinateSystem::transformAt, so that transforming many
+ * positions does not recompute the orientation. The arguments are as in CoordinateSystem.
+ */
+class FrameTransform {
+public:
+	FrameTransform() = default;
+	FrameTransform(const Matrix & rotation, const Vector & offset, const Vector & angularVelocity)
+	: rotation_(rotation), offset_(offset), angularVelocity_(angularVelocity)
+	{ }
+
+	const Matrix & rotation() const { return rotation_; }
+
+	void normalVectorToWorldFrame(const Vector & normal, Vector & ret) const { ret.noalias() = rotation_ * normal; }
+	void normalVectorToLocalFrame(const Vector & normal, Vector & ret) const { ret.noalias() = rotation_.transpose() * normal; }
+	void velocityToWorldFrame(const Vector & pos, const Vector & velocity, Vector & ret) const
+	{
+		ret.noalias() = rotation_ * velocity + angularVelocity_.cross(pos - offset_);
+	}
+	void velocityToLocalFrame(const Vector & pos, const Vector & velocity, Vector & ret) const
+	{
+		ret.noalias() = rotation_.transpose() * (velocity - angularVelocity_.cross(pos - offset_));
+	}
+	void positionToWorldFrame(const Vector & pos, Vector & ret) const { ret.noalias() = rotation_ * pos + offset_; }
+	void positionToLocalFrame(const Vector & pos, Vector & ret) const { ret.noalias() = rotation_.transpose() * (pos - offset_); }
+
+	// Transform n positions, four at a time with SSE. ret may be the same array as pos.
+	void positionsToWorldFrame(const Vector * pos, size_t n, Vector * ret) const;
+	void positionsToLocalFrame(const Vector * pos, size_t n, Vector * ret) const;
+
+private:
+	Matrix rotation_ = Matrix::Identity();
+	Vector offset_{0, 0, 0};
+	Vector angularVelocity_{0, 0, 0};
+};
+
 class CoordinateSystem {
 public:
 	GETSET(Vector, offset)
@@ -16,6 +53,7 @@ public:
 	void fromJSON(const json &);
 
 	Quaternion getOrientation(scalar t) const;
+	FrameTransform transformAt(scalar t) const;
 	void normalVectorToWorldFrame(scalar t, const Vector & normal, Vector & ret) const;
 	void normalVectorToLocalFrame(scalar t, const Vector & normal, Vector & ret) const;
 
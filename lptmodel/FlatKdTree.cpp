@@ -0,0 +1,314 @@
+#include "FlatKdTree.h"
+#include <limits>
+#include <algorithm>
+#include <deque>
+#include <pmmintrin.h>
+
+// Cache file section ids
+namespace {
+	const uint32_t nodesSection = 1;
+	const uint32_t leavesSection = 2;
+	const uint32_t pointsSection = 3;
+	const uint32_t permutationSection = 4;
+	const uint32_t inversePermutationSection = 5;
+	const uint32_t blocksSection = 6;
+}
+
+void FlatKdTree::build(const std::vector<feature_vector<scalar, 3>> & points, int numberOfThreads)
+{
+	kd_tree<scalar, 3> tree;
+	tree.build(&(points[0]), points.size(), 32, numberOfThreads);
+	build(tree);
+}
+
+void FlatKdTree::build(const kd_tree<scalar, 3> & tree)
+{
+	cacheFile_.reset();
+	ownedNodes_.clear();
+	ownedLeaves_.clear();
+
+	const size_t numberOfPoints = tree.get_N();
+	ownedPoints_.resize(3 * numberOfPoints);
+	ownedPermutation_.resize(numberOfPoints);
+	ownedInversePermutation_.resize(numberOfPoints);
+	for(size_t i = 0; i < numberOfPoints; ++i) {
+		for(int d = 0; d < 3; ++d)
+			ownedPoints_[3*i + d] = tree.data[i][d];
+		ownedPermutation_[i] = tree.permutation[i];
+		ownedInversePermutation_[i] = tree.inverse_perm[i];
+	}
+
+	// Add the nodes in breadth first order, a node's index is known when it is queued
+	using kd_node = kd_tree<scalar, 3>::kd_node;
+	std::deque<const kd_node *> queue;
+	if(tree.root)
+		queue.push_back(tree.root);
+	uint32_t numberOfQueuedNodes = queue.size();
+	while( ! queue.empty()) {
+		const kd_node * node = queue.front();
+		queue.pop_front();
+
+		Node flatNode;
+		flatNode.split = node->split_value;
+		flatNode.axis = node->axis & kd_node::axis_mask;
+		if(node->is_leaf & kd_node::left_bit) {
+			flatNode.children[0] = addLeaf(node->left_leaf);
+		} else {
+			flatNode.children[0] = numberOfQueuedNodes++;
+			queue.push_back(node->left_branch);
+		}
+		if(node->is_leaf & kd_node::right_bit) {
+			flatNode.children[1] = addLeaf(node->right_leaf);
+		} else {
+			flatNode.children[1] = numberOfQueuedNodes++;
+			queue.push_back(node->right_branch);
+		}
+		ownedNodes_.push_back(flatNode);
+	}
+
+	buildBlocks();
+	setArraysToOwnedStorage();
+}
+
+uint32_t FlatKdTree::addLeaf(const kd_tree<scalar, 3>::kd_leaf * leaf)
+{
+	Leaf flatLeaf;
+	flatLeaf.first = leaf->first_index;
+	flatLeaf.count = leaf->num_elements;
+	flatLeaf.block = 0;
+	ownedLeaves_.push_back(flatLeaf);
+	return (ownedLeaves_.size() - 1) | leafBit;
+}
+
+// Copy the points of each leaf to its blocks. The blocks are stored in point order, so that
+// leaves that are close in space are close in memory. Unused lanes are zero.
+void FlatKdTree::buildBlocks()
+{
+	std::vector<uint32_t> leafOrder(ownedLeaves_.size());
+	for(size_t i = 0; i < leafOrder.size(); ++i)
+		leafOrder[i] = i;
+	std::sort(leafOrder.begin(), leafOrder.end(), 
+		[this](uint32_t a, uint32_t b) { return ownedLeaves_[a].first < ownedLeaves_[b].first; });
+
+	uint32_t numberOfBlocks = 0;
+	for(uint32_t leafIndex : leafOrder) {
+		ownedLeaves_[leafIndex].block = numberOfBlocks;
+		numberOfBlocks += (ownedLeaves_[leafIndex].count + blockWidth - 1) / blockWidth;
+	}
+
+	ownedBlocks_.assign((size_t) numberOfBlocks * blockSize, 0.f);
+	for(const Leaf & leaf : ownedLeaves_) {
+		for(uint32_t k = 0; k < leaf.count; ++k) {
+			float * block = &ownedBlocks_[(size_t) (leaf.block + k / blockWidth) * blockSize];
+			for(int d = 0; d < 3; ++d)
+				block[d * blockWidth + k % blockWidth] = ownedPoints_[3 * (leaf.first + k) + d];
+		}
+	}
+}
+
+void FlatKdTree::setArraysToOwnedStorage()
+{
+	nodes_ = ownedNodes_.data();
+	leaves_ = ownedLeaves_.data();
+	points_ = ownedPoints_.data();
+	blocks_ = ownedBlocks_.data();
+	numberOfBlocks_ = ownedBlocks_.size() / blockSize;
+	permutation_ = ownedPermutation_.data();
+	inversePermutation_ = ownedInversePermutation_.data();
+	numberOfNodes_ = ownedNodes_.size();
+	numberOfLeaves_ = ownedLeaves_.size();
+	numberOfPoints_ = ownedPermutation_.size();
+}
+
+void FlatKdTree::addSections(CacheFileWriter & writer) const
+{
+	writer.addArray(nodesSection, nodes_, numberOfNodes_);
+	writer.addArray(leavesSection, leaves_, numberOfLeaves_);
+	writer.addArray(pointsSection, points_, 3 * numberOfPoints_);
+	writer.addArray(blocksSection, blocks_, numberOfBlocks_ * blockSize);
+	writer.addArray(permutationSection, permutation_, numberOfPoints_);
+	writer.addArray(inversePermutationSection, inversePermutation_, numberOfPoints_);
+}
+
+bool FlatKdTree::readSections(const std::shared_ptr<CacheFileReader> & reader)
+{
+	size_t numberOfNodes, numberOfLeaves, numberOfCoordinates, numberOfBlockValues, numberOfPoints, numberOfInversePermutations;
+	const Node * nodes = reader->array<Node>(nodesSection, numberOfNodes);
+	const Leaf * leaves = reader->array<Leaf>(leavesSection, numberOfLeaves);
+	const scalar * points = reader->array<scalar>(pointsSection, numberOfCoordinates);
+	const float * blocks = reader->array<float>(blocksSection, numberOfBlockValues);
+	const uint32_t * permutation = reader->array<uint32_t>(permutationSection, numberOfPoints);
+	const uint32_t * inversePermutation = reader->array<uint32_t>(inversePermutationSection, numberOfInversePermutations);
+	// Every node has two children, so a tree has one more leaf than nodes
+	if((numberOfNodes > 0 && numberOfLeaves != numberOfNodes + 1) || numberOfCoordinates != 3 * numberOfPoints || numberOfInversePermutations != numberOfPoints 
+		|| numberOfBlockValues % blockSize != 0)
+		return false;
+
+	// Check the indices, so that a corrupt file cannot index out of bounds. The nodes are in breadth first
+	// order, so a child node comes after its parent, which also rules out cycles.
+	const size_t numberOfBlocks = numberOfBlockValues / blockSize;
+	for(size_t n = 0; n < numberOfNodes; ++n) {
+		if(nodes[n].axis >= 3)
+			return false;
+		for(uint32_t child : nodes[n].children)
+			if((child & leafBit) ? (child & ~leafBit) >= numberOfLeaves : (child <= n || child >= numberOfNodes))
+				return false;
+	}
+	for(size_t l = 0; l < numberOfLeaves; ++l) {
+		const Leaf & leaf = leaves[l];
+		if((uint64_t) leaf.first + leaf.count > numberOfPoints || (uint64_t) leaf.block + (leaf.count + blockWidth - 1) / blockWidth > numberOfBlocks)
+			return false;
+	}
+	// The permutations are inverses of each other, which makes both of them permutations of the points
+	for(size_t i = 0; i < numberOfPoints; ++i)
+		if(permutation[i] >= numberOfPoints || inversePermutation[permutation[i]] != i)
+			return false;
+
+	ownedNodes_.clear();
+	ownedLeaves_.clear();
+	ownedPoints_.clear();
+	ownedBlocks_.clear();
+	ownedPermutation_.clear();
+	ownedInversePermutation_.clear();
+
+	cacheFile_ = reader;
+	nodes_ = nodes;
+	leaves_ = leaves;
+	points_ = points;
+	blocks_ = blocks;
+	numberOfBlocks_ = numberOfBlockValues / blockSize;
+	permutation_ = permutation;
+	inversePermutation_ = inversePermutation;
+	numberOfNodes_ = numberOfNodes;
+	numberOfLeaves_ = numberOfLeaves;
+	numberOfPoints_ = numberOfPoints;
+	return true;
+}
+
+// Search
+struct FlatKdTree::SearchData {
+	scalar position[3];
+	scalar squaredBound;	// Squared distance beyond which points are not of interest
+};
+
+namespace {
+
+// Keeps the K nearest points found so far, sorted by increasing distance
+struct KNearestCollector {
+	std::vector<FlatKdTree::Neighbor> & neighbors;
+	unsigned int K;
+
+	void add(unsigned int index, scalar squaredDistance, scalar & squaredBound)
+	{
+		if(neighbors.size() < K) {
+			if(squaredDistance > squaredBound)
+				return;
+			neighbors.push_back(FlatKdTree::Neighbor(index, squaredDistance));
+		} else {
+			// Strictly closer than the current farthest neighbor
+			if( ! (squaredDistance < squaredBound))
+				return;
+			neighbors.back() = FlatKdTree::Neighbor(index, squaredDistance);
+		}
+
+		// Insertion sort, K is small
+		for(size_t j = neighbors.size() - 1; j > 0 && neighbors[j-1].squared_distance > neighbors[j].squared_distance; --j)
+			std::swap(neighbors[j-1], neighbors[j]);
+
+		if(neighbors.size() == K)
+			squaredBound = neighbors.back().squared_distance;
+	}
+};
+
+// Keeps all points within the bound
+struct RangeCollector {
+	std::vector<FlatKdTree::Neighbor> & neighbors;
+
+	void add(unsigned int index, scalar squaredDistance, scalar & squaredBound)
+	{
+		if(squaredDistance <= squaredBound)
+			neighbors.push_back(FlatKdTree::Neighbor(index, squaredDistance));
+	}
+};
+
+}
+
+// Visit the subtree, regionDistance is the squared distance from the position to the region of the subtree,
+// and offset the per-axis distance from the position to the region (incremental distance calculation)
+template<class Collector>
+void FlatKdTree::search(uint32_t child, scalar regionDistance, scalar * offset, SearchData & data, Collector & collector) const
+{
+	if(child & leafBit) {
+		// Test blockWidth points at a time, only the points within the bound are passed to the collector
+		const Leaf & leaf = leaves_[child & ~leafBit];
+		const __m128 x = _mm_set1_ps(data.position[0]);
+		const __m128 y = _mm_set1_ps(data.position[1]);
+		const __m128 z = _mm_set1_ps(data.position[2]);
+		const float * block = &blocks_[(size_t) leaf.block * blockSize];
+		alignas(16) float squaredDistances[blockWidth];
+		for(uint32_t k = 0; k < leaf.count; k += blockWidth, block += blockSize) {
+			const __m128 dx = _mm_sub_ps(_mm_load_ps(block), x);
+			const __m128 dy = _mm_sub_ps(_mm_load_ps(block + blockWidth), y);
+			const __m128 dz = _mm_sub_ps(_mm_load_ps(block + 2*blockWidth), z);
+			const __m128 squaredDistance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+			int mask = _mm_movemask_ps(_mm_cmple_ps(squaredDistance, _mm_set1_ps(data.squaredBound)));
+			if(leaf.count - k < (uint32_t) blockWidth)
+				mask &= (1 << (leaf.count - k)) - 1;
+			if( ! mask)
+				continue;
+
+			_mm_store_ps(squaredDistances, squaredDistance);
+			while(mask) {
+				const int lane = __builtin_ctz(mask);
+				mask &= mask - 1;
+				collector.add(leaf.first + k + lane, squaredDistances[lane], data.squaredBound);
+			}
+		}
+		return;
+	}
+
+	// Visit the side of the split containing the position first
+	const Node & node = nodes_[child];
+	const scalar difference = data.position[node.axis] - node.split;
+	const uint32_t nearChild = difference <= 0 ? node.children[0] : node.children[1];
+	const uint32_t farChild = difference <= 0 ? node.children[1] : node.children[0];
+	search(nearChild, regionDistance, offset, data, collector);
+
+	// Only visit the far side if its region is within the bound
+	const scalar previousOffset = offset[node.axis];
+	const scalar farRegionDistance = regionDistance - previousOffset * previousOffset + difference * difference;
+	if(farRegionDistance < data.squaredBound) {
+		offset[node.axis] = difference;
+		search(farChild, farRegionDistance, offset, data, collector);
+		offset[node.axis] = previousOffset;
+	}
+}
+
+void FlatKdTree::knn(const Vector & position, unsigned int K, std::vector<Neighbor> & output) const
+{
+	knnInRange(position, K, std::numeric_limits<scalar>::infinity(), output);
+}
+
+void FlatKdTree::knnInRange(const Vector & position, unsigned int K, scalar distance, std::vector<Neighbor> & output) const
+{
+	output.clear();
+	if(numberOfNodes_ == 0 || K == 0 || distance <= 0)
+		return;
+
+	SearchData data{{position[0], position[1], position[2]}, distance * distance};
+	scalar offset[3] = {0, 0, 0};
+	KNearestCollector collector{output, K};
+	search(0, 0, offset, data, collector);
+}
+
+void FlatKdTree::allInRange(const Vector & position, scalar distance, std::vector<Neighbor> & output) const
+{
+	output.clear();
+	if(numberOfNodes_ == 0 || distance <= 0)
+		return;
+
+	SearchData data{{position[0], position[1], position[2]}, distance * distance};
+	scalar offset[3] = {0, 0, 0};
+	RangeCollector collector{output};
+	search(0, 0, offset, data, collector);
+}
@@ -0,0 +1,99 @@
+#ifndef FLATKDTREE_H_
+#define FLATKDTREE_H_
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <Eigen/Dense>
+#include "typedefs.h"
+#include "kd-tree.h"
+#include "CacheFile.h"
+
+/*
+ * Kd-tree stored in flat arrays, with the nodes referring to each other by 32-bit indices.
+ * The nodes are stored in breadth-first order, so the top levels visited by every query share
+ * a few cache lines. The points are stored in tree order, so the points of a leaf are contiguous.
+ * The point indices used by the queries are tree order indices, use originalIndex/treeIndex to convert.
+ * The leaf points are in addition stored as blocks of 4 points with the coordinates in separate
+ * x, y and z lanes, so that the distances to the points of a leaf are computed with SIMD instructions.
+ * The arrays are either owned by the tree, or used in place from a memory mapped cache file.
+ */
+class FlatKdTree {
+public:
+	using Neighbor = vector_distance<scalar>;
+
+	struct Node {
+		scalar split;
+		uint32_t axis;
+		uint32_t children[2];	// Node index, or leaf index with leafBit set
+	};
+
+	struct Leaf {
+		uint32_t first;		// First point (tree order)
+		uint32_t count;
+		uint32_t block;		// First point block
+	};
+
+	static const uint32_t leafBit = 0x80000000U;
+
+	// Points per block, a block stores the x, y and z coordinates of its points in consecutive lanes
+	static const int blockWidth = 4;
+	static const int blockSize = 3 * blockWidth;
+
+	// Build from a list of points (in original order), with numberOfThreads OpenMP threads
+	void build(const std::vector<feature_vector<scalar, 3>> & points, int numberOfThreads = 1);
+
+	// Flatten a kche kd-tree
+	void build(const kd_tree<scalar, 3> & tree);
+
+	// Cache file IO. The tree keeps a reference to the cache file when its arrays are used in place.
+	void addSections(CacheFileWriter & writer) const;
+	bool readSections(const std::shared_ptr<CacheFileReader> & reader);
+
+	size_t size() const { return numberOfPoints_; }
+	Vector point(size_t i) const { return Vector(points_[3*i], points_[3*i+1], points_[3*i+2]); }
+	unsigned int originalIndex(size_t i) const { return permutation_[i]; }
+	unsigned int treeIndex(size_t originalIndex) const { return inversePermutation_[originalIndex]; }
+
+	// Queries, the output vector is overwritten
+	// K nearest points, sorted by increasing distance
+	void knn(const Vector & position, unsigned int K, std::vector<Neighbor> & output) const;
+	// K nearest points within distance, sorted by increasing distance
+	void knnInRange(const Vector & position, unsigned int K, scalar distance, std::vector<Neighbor> & output) const;
+	// All points within distance, not sorted
+	void allInRange(const Vector & position, scalar distance, std::vector<Neighbor> & output) const;
+
+private:
+	struct SearchData;
+
+	uint32_t addLeaf(const kd_tree<scalar, 3>::kd_leaf * leaf);
+	void buildBlocks();
+	void setArraysToOwnedStorage();
+
+	template<class Collector>
+	void search(uint32_t child, scalar regionDistance, scalar * offset, SearchData & data, Collector & collector) const;
+
+	// Views of the tree arrays
+	const Node * nodes_ = nullptr;
+	const Leaf * leaves_ = nullptr;
+	const scalar * points_ = nullptr;
+	const float * blocks_ = nullptr;
+	const uint32_t * permutation_ = nullptr;
+	const uint32_t * inversePermutation_ = nullptr;
+	size_t numberOfNodes_ = 0;
+	size_t numberOfLeaves_ = 0;
+	size_t numberOfBlocks_ = 0;
+	size_t numberOfPoints_ = 0;
+
+	// Storage when the tree is built in memory
+	std::vector<Node> ownedNodes_{};
+	std::vector<Leaf> ownedLeaves_{};
+	std::vector<scalar> ownedPoints_{};
+	std::vector<float, Eigen::aligned_allocator<float>> ownedBlocks_{};
+	std::vector<uint32_t> ownedPermutation_{};
+	std::vector<uint32_t> ownedInversePermutation_{};
+
+	// Storage when the tree is read from a cache file
+	std::shared_ptr<CacheFileReader> cacheFile_{};
+};
+
+#endif /* FLATKDTREE_H_ */
@@ -20,7 +20,14 @@ void Injector::fromJSON(const json & jsonObject)
 	particlesToInject() = jsonObject.at("particlesToInject").get<int>();
 }
 
-void Injector::inject(scalar t0, scalar t1, std::vector<Particle *> & pToInject) const
+const Particle & Injector::templateParticle() const
+{
+	if( ! templateParticle_)
+		throw std::runtime_error("No template particle has been assigned to the Injector");
+	return *templateParticle_;
+}
+
+void Injector::inject(scalar t0, scalar t1, std::vector<Vector> & positions) const
 {
 	if( ! templateParticle_)
 		throw std::runtime_error("No template particle has been assigned to the Injector");
@@ -38,14 +45,9 @@ void Injector::inject(scalar t0, scalar t1, std::vector<Particle *> & pToInject)
 		if(((double) rand() / RAND_MAX) < remainder)
 			numberOfParticles += 1;
 
-		std::vector<Vector> positions;
-		getInjectionPositions(tStart(), numberOfParticles, positions);
-
-		for(const Vector & pos : positions) {
-			Particle * p = templateParticle_->clone();
-			p->position() = pos;
-			pToInject.push_back(p);
-		}
+		std::vector<Vector> newPositions;
+		getInjectionPositions(tStart(), numberOfParticles, newPositions);
+		positions.insert(positions.end(), newPositions.begin(), newPositions.end());
 	}
 }
 
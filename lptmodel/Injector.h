@@ -17,7 +17,9 @@ public:
 	virtual void fromJSON(const json & j);
 	virtual void readBinary(std::istream &) { }
 
-	void inject(scalar t0, scalar t1, std::vector<Particle *> & pToInject) const;
+	// Append the positions of the particles injected during [t0, t1]
+	void inject(scalar t0, scalar t1, std::vector<Vector> & positions) const;
+	const Particle & templateParticle() const;
 
 	GETSET(scalar, tStart)
 	GETSET(scalar, tEnd)
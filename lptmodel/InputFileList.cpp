@@ -41,6 +41,9 @@ void InputFileList::fromJSON(const json & jsonObject)
 	
 	dataDt() = jsonObject.at("timeBetweenSamples").get<scalar>();
 
+	// Number of files to read ahead of time, 0 reads the files when needed
+	prefetchDepth() = std::max(0, jsonGetOrDefault<int>(jsonObject, "prefetchDepth", 1));
+
 	// Read files
 	int maxNumberOfFiles = -1;
 	if(jsonObject.count("maxNumberOfFiles"))
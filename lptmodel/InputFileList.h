@@ -9,6 +9,7 @@ public:
 
 	GETSET(OutOfRangeMode, outOfRangeMode)
 	GETSET(scalar, dataDt)
+	GETSET(int, prefetchDepth)
 
 	void readFileList(std::string inputFolder);
 	void globFiles(std::string inputFolder, std::string suffix);
@@ -20,6 +21,7 @@ public:
 private:
 	OutOfRangeMode outOfRangeMode_{OutOfRangeMode::Repeat};
 	scalar dataDt_ = 1.;
+	int prefetchDepth_ = 1;
 	std::vector<std::string> dataFileNames_{};
 };
 
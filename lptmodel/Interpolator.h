@@ -6,11 +6,39 @@
 #include "macros.h"
 #include <stdexcept>
 #include "typedefs.h"
+#include "io.h"
 #include <iostream>
-#include "kd-tree.h"
+#include "FlatKdTree.h"
+#include "CacheFile.h"
+#include "SearchTreeRegistry.h"
+#include "NeighborCache.h"
+#include "StressMetric.h"
+#include <atomic>
+#include <cstdio>
+#include <pmmintrin.h>
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
 
 #include <vtkPoints.h>
 
+struct InterpolationWeight {
+	int pointId;
+	scalar weight;
+};
+
+// Scratch buffers used during interpolation. Each thread should use its own workspace.
+struct InterpolationWorkspace {
+	std::vector<InterpolationWeight> weights;
+	std::vector<vector_distance<scalar>> neighbors;
+
+	// Neighbor cache statistics
+	size_t cacheHits = 0;
+	size_t cacheMisses = 0;
+	// Positions where the interpolation failed, reported once per step by the model
+	size_t interpolationFailures = 0;
+};
+
 class Interpolator {
 public:
 	virtual ~Interpolator()
@@ -21,28 +49,185 @@ public:
 	virtual Interpolator * clone() = 0;
 
 	// Velocity and shear interpolation
-	virtual bool interpolate(const Vector & position, Vector & velocity, Matrix & shear) = 0;
+	virtual bool interpolate(const Vector & position, Vector & velocity, Matrix & shear, InterpolationWorkspace & workspace) = 0;
+
+	// Batch interpolation of n positions, found[i] is set to 0 if the interpolation failed for position i
+	// shear: the shear rate tensor, shearRate: the equivalent shear rate of the stress metric (see StressMetric.h),
+	// either may be null if it is not needed.
+	// cache: optional per-position neighbor caches, used to speed up the search if the positions are close to the previous ones
+	virtual void interpolate(const Vector * positions, size_t n, Vector * velocity, SymmetricTensor * shear, scalar * shearRate,
+		unsigned char * found, InterpolationWorkspace & workspace, NeighborCache * cache = nullptr)
+	{
+		Matrix shearMatrix;
+		for(size_t i = 0; i < n; ++i) {
+			found[i] = interpolate(positions[i], velocity[i], shearMatrix, workspace);
+			const SymmetricTensor symmetricShear = matrixToSymmetricTensor(shearMatrix);
+			if(shear)
+				shear[i] = symmetricShear;
+			if(shearRate)
+				shearRate[i] = equivalentShearRate(stressMetric(), symmetricShear);
+		}
+	}
+
+	void interpolate(const Vector * positions, size_t n, Vector * velocity, SymmetricTensor * shear, 
+		unsigned char * found, InterpolationWorkspace & workspace, NeighborCache * cache = nullptr)
+	{
+		interpolate(positions, n, velocity, shear, nullptr, found, workspace, cache);
+	}
+
+	bool interpolate(const Vector & position, Vector & velocity, Matrix & shear)
+	{
+		InterpolationWorkspace workspace;
+		return interpolate(position, velocity, shear, workspace);
+	}
 
 	// Read next file
 	virtual void readData(std::string) = 0;
 
 	virtual bool hasData() const = 0;
-};
 
-struct InterpolationWeight {
-	int pointId;
-	scalar weight;
+	virtual void fromJSON(const json & jsonObject)
+	{
+		if(jsonObject.count("stressMetric")) {
+			std::string metricName = jsonObject.at("stressMetric");
+			if(metricName == "frobenius")
+				stressMetric() = StressMetric::Frobenius;
+			else if(metricName == "vonMises")
+				stressMetric() = StressMetric::VonMises;
+			else if(metricName == "bludszuweit")
+				stressMetric() = StressMetric::Bludszuweit;
+			else if(metricName == "principal")
+				stressMetric() = StressMetric::Principal;
+			else
+				throw std::runtime_error("Unknown stress metric: " + metricName);
+		}
+	}
+
+	// Metric of the scalar shear rate used by the activation models
+	GETSET(StressMetric, stressMetric)
+	// Number of threads used when reading the data, set by the model from timeStepping.numberOfThreads
+	GETSET(int, numberOfThreads)
+
+private:
+	StressMetric stressMetric_ = StressMetric::Frobenius;
+	int numberOfThreads_ = 1;
 };
 
 class UnstructuredPointInterpolator : public Interpolator {
 public:
-	using SearchTree = kd_tree<scalar, 3>;
+	using SearchTree = FlatKdTree;
 	using KDVectorType = feature_vector<scalar, 3>;
 
+	// Number of floats stored per point: velocity (3), equivalent shear rate (1), shear (6) and padding (2).
+	// The velocity and the shear rate used by the activation are read with one aligned load.
+	static const int pointDataStride = 12;
+
 	UnstructuredPointInterpolator() : searchTree_(nullptr) { }
-	UnstructuredPointInterpolator(const UnstructuredPointInterpolator & rhs) : searchTree_(nullptr)
+	UnstructuredPointInterpolator(const UnstructuredPointInterpolator & rhs) 
+	: Interpolator(rhs), minSearchRadius_(rhs.minSearchRadius_), maxSearchRadius_(rhs.maxSearchRadius_), 
+	  nearestNeighborFallback_(rhs.nearestNeighborFallback_), neighborSearch_(rhs.neighborSearch_), 
+	  numberOfNeighbors_(rhs.numberOfNeighbors_), neighborCacheSize_(rhs.neighborCacheSize_), meshMode_(rhs.meshMode_), searchTree_(nullptr)
+	{
+		// Don't copy the search tree or the point data
+	}
+
+	// Strategy used to find the points used for Shepard interpolation
+	enum class NeighborSearch {
+		KNearest,	// The numberOfNeighbors nearest points within maxSearchRadius, found in one query
+		Bisection	// Bisect the search radius between minSearchRadius and maxSearchRadius until 3-5 points are found
+	};
+
+	// How the search tree is shared between data sets
+	enum class MeshMode {
+		Auto,		// Data sets with the same points (number of points and coordinate hash) share one tree
+		Static,		// All data sets are declared to have the same points, only the number of points is checked
+		Dynamic		// Each data set has its own tree
+	};
+
+	GETSET(scalar, minSearchRadius)
+	GETSET(scalar, maxSearchRadius)
+	GETSET(bool, nearestNeighborFallback)
+	GETSET(NeighborSearch, neighborSearch)
+	GETSET(int, numberOfNeighbors)
+	GETSET(int, neighborCacheSize)
+	GETSET(MeshMode, meshMode)
+
+	void fromJSON(const json & jsonObject) override
 	{
-		// Don't copy the search tree	
+		Interpolator::fromJSON(jsonObject);
+		minSearchRadius() = jsonGetOrDefault<scalar>(jsonObject, "minSearchRadius", minSearchRadius());
+		maxSearchRadius() = jsonGetOrDefault<scalar>(jsonObject, "maxSearchRadius", maxSearchRadius());
+		nearestNeighborFallback() = jsonGetOrDefault<bool>(jsonObject, "nearestNeighborFallback", nearestNeighborFallback());
+		numberOfNeighbors() = jsonGetOrDefault<int>(jsonObject, "numberOfNeighbors", numberOfNeighbors());
+		if(numberOfNeighbors() < 1)
+			throw std::runtime_error("The number of interpolation neighbors must be positive");
+		neighborCacheSize() = jsonGetOrDefault<int>(jsonObject, "neighborCacheSize", neighborCacheSize());
+		if(neighborCacheSize() > NeighborCache::capacity)
+			throw std::runtime_error("The neighbor cache size can be at most " + std::to_string(NeighborCache::capacity));
+
+		if(jsonObject.count("neighborSearch")) {
+			std::string searchName = jsonObject.at("neighborSearch");
+			if(searchName == "kNearest")
+				neighborSearch() = NeighborSearch::KNearest;
+			else if(searchName == "bisection")
+				neighborSearch() = NeighborSearch::Bisection;
+			else
+				throw std::runtime_error("Unknown neighbor search: " + searchName);
+		}
+
+		if(jsonObject.count("meshMode")) {
+			std::string modeName = jsonObject.at("meshMode");
+			if(modeName == "auto")
+				meshMode() = MeshMode::Auto;
+			else if(modeName == "static")
+				meshMode() = MeshMode::Static;
+			else if(modeName == "dynamic")
+				meshMode() = MeshMode::Dynamic;
+			else
+				throw std::runtime_error("Unknown mesh mode: " + modeName);
+		}
+	}
+
+	using Interpolator::interpolate;
+
+	bool interpolate(const Vector & position, Vector & velocity, Matrix & shear, InterpolationWorkspace & workspace) override
+	{
+		SymmetricTensor symmetricShear;
+		if( ! interpolatePoint(position, velocity, &symmetricShear, nullptr, workspace))
+			return false;
+		shear = symmetricTensorToMatrix(symmetricShear);
+		return true;
+	}
+
+	// The shear rate is interpolated from the values precomputed at the points, see setPointData
+	void interpolate(const Vector * positions, size_t n, Vector * velocity, SymmetricTensor * shear, scalar * shearRate,
+		unsigned char * found, InterpolationWorkspace & workspace, NeighborCache * cache = nullptr) override
+	{
+		for(size_t i = 0; i < n; ++i)
+			found[i] = interpolatePoint(positions[i], velocity[i], shear ? &shear[i] : nullptr, shearRate ? &shearRate[i] : nullptr,
+				workspace, cache ? &cache[i] : nullptr);
+	}
+
+	// Point data, packed per point so that the data of a neighbour is read with a few aligned loads.
+	// The data is stored in search tree order, so the search tree must be built before the data is set.
+	size_t numberOfPoints() const { return numberOfPoints_; }
+	void resizePointData(size_t numberOfPoints) 
+	{
+		pointDataFile_.reset();
+		ownedPointData_.assign(numberOfPoints * pointDataStride, 0.f);
+		pointData_ = ownedPointData_.data();
+		numberOfPoints_ = numberOfPoints;
+	}
+	// pointId is the index of the point in the data set. The equivalent shear rate of the stress metric is
+	// computed here, so the metric must be set before the data.
+	void setPointData(size_t pointId, const Vector & velocity, const SymmetricTensor & shear)
+	{
+		float * data = &ownedPointData_[searchTree().treeIndex(pointId) * pointDataStride];
+		for(int k = 0; k < 3; ++k)
+			data[k] = velocity[k];
+		data[3] = equivalentShearRate(stressMetric(), shear);
+		for(int k = 0; k < 6; ++k)
+			data[4+k] = shear[k];
 	}
 
 	void buildSearchTree(vtkPoints * points) 
@@ -59,29 +244,133 @@ public:
 		buildSearchTree(positions);
 	}
 
+	// Unless the mesh mode is dynamic, a tree built from the same points by another interpolator is used instead
 	void buildSearchTree(const std::vector<KDVectorType> & points)
 	{
-		searchTree_.reset(new SearchTree);
-		searchTree_->build(&(points[0]), points.size());
+		SearchTreeRegistry::Entry entry;
+		if(meshMode() == MeshMode::Static && findStaticSearchTree(points.size(), entry)) {
+			useSearchTree(entry, true);
+			return;
+		}
+
+		MeshKey key;
+		if(meshMode() != MeshMode::Dynamic) {
+			MeshHasher hasher;
+			for(const KDVectorType & point : points)
+				hasher.add(point[0], point[1], point[2]);
+			key = hasher.key();
+			if(findSharedSearchTree(key, entry)) {
+				useSearchTree(entry, true);
+				return;
+			}
+		}
+
+		std::shared_ptr<SearchTree> tree = std::make_shared<SearchTree>();
+		tree->build(points, numberOfThreads());
+		addSearchTree(tree, key);
 	}
-	
-	void writeSearchTree(std::ostream & out) const
+
+	// Read a search tree serialized by the kche kd-tree (the legacy .dat cache files)
+	void readLegacySearchTree(std::istream & in)
 	{
-		out << searchTree();
+		kd_tree<scalar, 3> legacyTree;
+		in >> legacyTree;
+		std::shared_ptr<SearchTree> tree = std::make_shared<SearchTree>();
+		tree->build(legacyTree);
+
+		SearchTreeRegistry::Entry entry;
+		if(meshMode() == MeshMode::Static && findStaticSearchTree(tree->size(), entry)) {
+			useSearchTree(entry, true);
+			return;
+		}
+
+		MeshKey key;
+		if(meshMode() != MeshMode::Dynamic) {
+			key = meshKey(*tree);
+			if(findSharedSearchTree(key, entry)) {
+				useSearchTree(entry, true);
+				return;
+			}
+		}
+		addSearchTree(tree, key);
 	}
-	void readSearchTree(std::istream & in)
+
+	// Cache file with the packed point data, see CacheFile.h. The arrays of a cache file that has been 
+	// read are used in place from the memory mapping. A search tree that is shared between data sets 
+	// is written once to a separate mesh file in the same directory, and the cache file refers to it
+	// by its mesh key. Otherwise the search tree is stored in the cache file.
+	bool writeCache(const std::string & fileName) const
 	{
-		searchTree_.reset(new SearchTree);
-		in >> searchTree();
+		if( ! hasSearchTree() || numberOfPoints() != searchTree().size())
+			return false;
+
+		CacheFileWriter writer;
+		if(isSharedSearchTree_) {
+			std::string meshFileName = meshCacheFileName(fileName, meshKey_);
+			if( ! CacheFileReader().open(meshFileName)) {
+				CacheFileWriter meshWriter;
+				searchTree().addSections(meshWriter);
+				meshWriter.addArray(meshKeySection, &meshKey_, 1);
+				if( ! meshWriter.write(meshFileName))
+					return false;
+			}
+			writer.addArray(meshKeySection, &meshKey_, 1);
+		} else {
+			searchTree().addSections(writer);
+		}
+		writer.addArray(pointDataSection, pointData_, numberOfPoints() * pointDataStride);
+		const uint32_t metric = (uint32_t) stressMetric();
+		writer.addArray(stressMetricSection, &metric, 1);
+		return writer.write(fileName);
 	}
 
-	bool getNearestNeighbor(const Vector & position, int & neighborIndex) const
+	// Returns false if the file (or the mesh file it refers to) does not exist or is not a valid cache file
+	bool readCache(const std::string & fileName)
 	{
-		KDVectorType pos;
-		pos[0] = position[0]; pos[1] = position[1]; pos[2] = position[2];
+		std::shared_ptr<CacheFileReader> reader = std::make_shared<CacheFileReader>();
+		if( ! reader->open(fileName) || ! reader->hasSection(pointDataSection))
+			return false;
+
+		SearchTreeRegistry::Entry entry;
+		bool isShared = reader->hasSection(meshKeySection);
+		if(isShared) {
+			if( ! readSharedSearchTree(fileName, *reader, entry))
+				return false;
+		} else {
+			std::shared_ptr<SearchTree> tree = std::make_shared<SearchTree>();
+			if( ! tree->readSections(reader))
+				return false;
+			entry = SearchTreeRegistry::Entry{MeshKey(), tree, nextSearchTreeGeneration()};
+		}
+
+		size_t numberOfValues;
+		const float * pointData = reader->array<float>(pointDataSection, numberOfValues);
+		if(numberOfValues != entry.tree->size() * pointDataStride)
+			return false;
+
+		useSearchTree(entry, isShared);
+		numberOfPoints_ = entry.tree->size();
+
+		// The shear rates of a file written with another stress metric are recomputed on a copy of the data
+		size_t count = 0;
+		const uint32_t * metric = reader->hasSection(stressMetricSection) ? reader->array<uint32_t>(stressMetricSection, count) : nullptr;
+		if(count == 1 && *metric == (uint32_t) stressMetric()) {
+			ownedPointData_.clear();
+			pointDataFile_ = reader;
+			pointData_ = pointData;
+		} else {
+			pointDataFile_.reset();
+			ownedPointData_.assign(pointData, pointData + numberOfValues);
+			pointData_ = ownedPointData_.data();
+			updateShearRates();
+		}
+		return true;
+	}
 
-		std::vector<typename SearchTree::kd_neighbour> neighbors;
-		searchTree().knn(pos, 1, neighbors);
+	bool getNearestNeighbor(const Vector & position, int & neighborIndex, InterpolationWorkspace & workspace) const
+	{
+		std::vector<SearchTree::Neighbor> & neighbors = workspace.neighbors;
+		searchTree().knn(position, 1, neighbors);
 
 		if(neighbors.size() <= 0) {
 			std::cerr << "No neighbors found!" << std::endl;
@@ -93,14 +382,77 @@ public:
 		return true;
 	}
 
-	bool getInterpolationWeights(const Vector & position, scalar minSearchRadius, scalar maxSearchRadius, std::vector<InterpolationWeight> & weights) const
+	bool getInterpolationWeights(const Vector & position, InterpolationWorkspace & workspace, NeighborCache * cache = nullptr) const
 	{
-		KDVectorType pos;
-		pos[0] = position[0]; pos[1] = position[1]; pos[2] = position[2];
+		if(neighborSearch() == NeighborSearch::KNearest)
+			return getKNearestInterpolationWeights(position, workspace, cache);
+		else
+			return getBisectionInterpolationWeights(position, minSearchRadius(), maxSearchRadius(), workspace);
+	}
+
+	bool getKNearestInterpolationWeights(const Vector & position, InterpolationWorkspace & workspace, NeighborCache * cache = nullptr) const
+	{
+		std::vector<InterpolationWeight> & weights = workspace.weights;
+		std::vector<SearchTree::Neighbor> & neighbors = workspace.neighbors;
+		weights.clear();
+
+		// Query one point more than needed, its distance is used as the Shepard radius.
+		// The neighbors are sorted by increasing distance.
+		const unsigned int numberToQuery = numberOfNeighbors() + 1;
+		neighbors.clear();
+		if(cache && (int) numberToQuery <= neighborCacheSize()) {
+			if(lookupNeighborCache(position, numberToQuery, *cache, neighbors)) {
+				++workspace.cacheHits;
+			} else {
+				++workspace.cacheMisses;
+
+				// Query extra points, so that the cache stays valid while the position moves
+				searchTree().knnInRange(position, neighborCacheSize(), maxSearchRadius(), neighbors);
+				fillNeighborCache(position, neighbors, *cache);
+				if(neighbors.size() > numberToQuery)
+					neighbors.resize(numberToQuery);
+			}
+		} else {
+			searchTree().knnInRange(position, numberToQuery, maxSearchRadius(), neighbors);
+		}
+
+		if(neighbors.size() == 0)
+			return false;
+
+		if(sqrtf(neighbors[0].squared_distance) < std::numeric_limits<float>::epsilon()) {
+			// Exact match found
+			InterpolationWeight intWeight;
+			intWeight.weight = 1.;
+			intWeight.pointId = neighbors[0].index;
+			weights.push_back(intWeight);
+			return true;
+		}
+
+		// If fewer points than requested are within the max radius, use all of them
+		scalar searchRadius = maxSearchRadius();
+		unsigned int numberOfPoints = neighbors.size();
+		if(numberOfPoints > (unsigned int) numberOfNeighbors()) {
+			numberOfPoints = numberOfNeighbors();
+			searchRadius = std::sqrt(neighbors[numberOfPoints].squared_distance);
+		}
+
+		formShepardWeights(neighbors, numberOfPoints, searchRadius, weights);
+
+		// All points are equidistant, the weights are zero
+		if(weights.empty())
+			return false;
+
+		return true;
+	}
+
+	bool getBisectionInterpolationWeights(const Vector & position, scalar minSearchRadius, scalar maxSearchRadius, InterpolationWorkspace & workspace) const
+	{
+		std::vector<InterpolationWeight> & weights = workspace.weights;
+		std::vector<SearchTree::Neighbor> & neighbors = workspace.neighbors;
+		weights.clear();
 
 		// First test if an exact match can be found
-		std::vector<typename SearchTree::kd_neighbour> neighbors;
-		searchTree().knn(pos, 1, neighbors);
+		searchTree().knn(position, 1, neighbors);
 		if(neighbors.size() > 0 && sqrtf(neighbors[0].squared_distance) < std::numeric_limits<float>::epsilon()) {
 			// Exact match found
 			InterpolationWeight intWeight;
@@ -113,15 +465,13 @@ public:
 		// No exact match, use Shepard interpolation (inverse distance weighted interpolation)
 		// Test the minimal search radius
 		scalar searchRadius;
-		neighbors.clear(); 	
-		searchTree().all_in_range(pos, minSearchRadius, neighbors, false);
+		searchTree().allInRange(position, minSearchRadius, neighbors);
 		// If we get 3 or more points, use them for interpolation
 		if(neighbors.size() >= 3) {
 			searchRadius = minSearchRadius;
 		} else {
 			// Test the max radius
-			neighbors.clear(); 	
-			searchTree().all_in_range(pos, maxSearchRadius, neighbors, false);
+			searchTree().allInRange(position, maxSearchRadius, neighbors);
 			if(neighbors.size() == 0) {
 				return false;
 			}
@@ -135,8 +485,7 @@ public:
 				scalar maxRadius = maxSearchRadius;
 				while(true) {
 					searchRadius = 0.5*(minRadius + maxRadius);
-					neighbors.clear(); 	
-					searchTree().all_in_range(pos, searchRadius, neighbors, false);
+					searchTree().allInRange(position, searchRadius, neighbors);
 
 					if(neighbors.size() > 5)
 						maxRadius = searchRadius;
@@ -148,16 +497,7 @@ public:
 			}
 		}
 
-		// Form weights
-		for(unsigned int k = 0; k < neighbors.size(); ++k) {
-			scalar dist = std::sqrt(neighbors[k].squared_distance);
-			scalar weight = std::max(0.f, searchRadius - dist) / (searchRadius*dist);
-					
-			InterpolationWeight intWeight;
-			intWeight.weight = weight * weight;
-			intWeight.pointId = neighbors[k].index;
-			weights.push_back(intWeight);
-		}
+		formShepardWeights(neighbors, neighbors.size(), searchRadius, weights);
 
 		return true;
 	}
@@ -167,13 +507,6 @@ public:
 		return (bool) searchTree_;
 	}
 
-	SearchTree & searchTree() 
-	{ 
-		if(! searchTree_)
-			std::runtime_error("The search tree has not been initalized");
-		return *searchTree_; 
-	}
-	
 	const SearchTree & searchTree() const
 	{ 
 		if(! searchTree_)
@@ -182,7 +515,285 @@ public:
 	}
 
 private:
-	std::unique_ptr<SearchTree> searchTree_;
+	// Cache file section ids, the search tree uses ids below 16. Section 16 held the point data before the
+	// shear rate was added to it, such files are not read.
+	static const uint32_t meshKeySection = 17;
+	static const uint32_t pointDataSection = 18;
+	static const uint32_t stressMetricSection = 19;
+
+	// Modified Shepard weights ((R - d) / (R d))^2 of the first numberOfPoints neighbors. Points at distance R or more are skipped.
+	static void formShepardWeights(const std::vector<vector_distance<scalar>> & neighbors, unsigned int numberOfPoints, 
+		scalar searchRadius, std::vector<InterpolationWeight> & weights)
+	{
+		for(unsigned int k = 0; k < numberOfPoints; ++k) {
+			scalar dist = std::sqrt(neighbors[k].squared_distance);
+			scalar weight = std::max(0.f, searchRadius - dist) / (searchRadius*dist);
+			if(weight <= 0)
+				continue;
+
+			InterpolationWeight intWeight;
+			intWeight.weight = weight * weight;
+			intWeight.pointId = neighbors[k].index;
+			weights.push_back(intWeight);
+		}
+	}
+
+	static int nextSearchTreeGeneration()
+	{
+		static std::atomic<int> generation{0};
+		return generation++;
+	}
+
+	// Search tree sharing
+	static MeshKey meshKey(const SearchTree & tree)
+	{
+		MeshHasher hasher;
+		for(size_t i = 0; i < tree.size(); ++i) {
+			Vector point = tree.point(tree.treeIndex(i));
+			hasher.add(point[0], point[1], point[2]);
+		}
+		return hasher.key();
+	}
+
+	static bool findSharedSearchTree(const MeshKey & key, SearchTreeRegistry::Entry & entry)
+	{
+		return SearchTreeRegistry::instance().find(key, entry);
+	}
+
+	static bool findStaticSearchTree(size_t numberOfPoints, SearchTreeRegistry::Entry & entry)
+	{
+		return SearchTreeRegistry::instance().findByNumberOfPoints(numberOfPoints, entry);
+	}
+
+	// Use a newly created tree, which is registered for sharing unless the mesh mode is dynamic
+	void addSearchTree(const std::shared_ptr<const SearchTree> & tree, const MeshKey & key)
+	{
+		SearchTreeRegistry::Entry entry{key, tree, nextSearchTreeGeneration()};
+		if(meshMode() == MeshMode::Dynamic)
+			useSearchTree(entry, false);
+		else
+			useSearchTree(SearchTreeRegistry::instance().add(entry), true);
+	}
+
+	void useSearchTree(const SearchTreeRegistry::Entry & entry, bool isShared)
+	{
+		searchTree_ = entry.tree;
+		searchTreeGeneration_ = entry.generation;
+		meshKey_ = entry.key;
+		isSharedSearchTree_ = isShared;
+	}
+
+	// The mesh file of a data set cache file
+	static std::string meshCacheFileName(const std::string & fileName, const MeshKey & key)
+	{
+		std::string directory;
+		size_t separator = fileName.find_last_of('/');
+		if(separator != std::string::npos)
+			directory = fileName.substr(0, separator + 1);
+
+		char name[64];
+		snprintf(name, sizeof(name), "mesh_%llu_%016llx.lptcache", (unsigned long long) key.numberOfPoints, (unsigned long long) key.hash);
+		return directory + name;
+	}
+
+	// Get the tree referred to by a data set cache file, from the registry or from the mesh file
+	static bool readSharedSearchTree(const std::string & fileName, const CacheFileReader & reader, SearchTreeRegistry::Entry & entry)
+	{
+		size_t count;
+		const MeshKey * key = reader.array<MeshKey>(meshKeySection, count);
+		if(count != 1)
+			return false;
+		if(findSharedSearchTree(*key, entry))
+			return true;
+
+		std::shared_ptr<CacheFileReader> meshReader = std::make_shared<CacheFileReader>();
+		if( ! meshReader->open(meshCacheFileName(fileName, *key)) || ! meshReader->hasSection(meshKeySection))
+			return false;
+		const MeshKey * meshKey = meshReader->array<MeshKey>(meshKeySection, count);
+		if(count != 1 || ! (*meshKey == *key))
+			return false;
+
+		std::shared_ptr<SearchTree> tree = std::make_shared<SearchTree>();
+		if( ! tree->readSections(meshReader) || tree->size() != key->numberOfPoints)
+			return false;
+
+		entry = SearchTreeRegistry::instance().add(SearchTreeRegistry::Entry{*key, tree, nextSearchTreeGeneration()});
+		return true;
+	}
+
+	void fillNeighborCache(const Vector & position, const std::vector<vector_distance<scalar>> & neighbors, NeighborCache & cache) const
+	{
+		cache.center = position;
+		cache.generation = searchTreeGeneration_;
+		cache.size = neighbors.size();
+		for(int k = 0; k < cache.size; ++k)
+			cache.pointIds[k] = neighbors[k].index;
+
+		// If the query was not limited by the number of points, all points within maxSearchRadius are cached
+		if(cache.size == neighborCacheSize())
+			cache.bound = std::sqrt(neighbors.back().squared_distance);
+		else
+			cache.bound = maxSearchRadius();
+	}
+
+	// Find the numberToQuery nearest points within maxSearchRadius among the cached points. Returns false if the
+	// result could differ from a search in the tree, i.e. if a point outside the cache could be closer.
+	bool lookupNeighborCache(const Vector & position, unsigned int numberToQuery, const NeighborCache & cache, 
+		std::vector<vector_distance<scalar>> & neighbors) const
+	{
+		if(cache.generation != searchTreeGeneration_)
+			return false;
+
+		// Points outside the cache are at least this far from the position
+		const scalar freeRadius = cache.bound - (position - cache.center).norm();
+		if(freeRadius <= 0)
+			return false;
+
+		// Sort the cached points by distance (insertion sort, there are few points)
+		const scalar maxSquaredDistance = maxSearchRadius() * maxSearchRadius();
+		for(int k = 0; k < cache.size; ++k) {
+			const Vector point = searchTree().point(cache.pointIds[k]);
+			scalar squaredDistance = 0;
+			for(int d = 0; d < 3; ++d)
+				squaredDistance += (point[d] - position[d]) * (point[d] - position[d]);
+			if(squaredDistance > maxSquaredDistance)
+				continue;
+
+			vector_distance<scalar> neighbor(cache.pointIds[k], squaredDistance);
+			neighbors.push_back(neighbor);
+			for(size_t j = neighbors.size() - 1; j > 0 && neighbors[j-1].squared_distance > squaredDistance; --j)
+				std::swap(neighbors[j-1], neighbors[j]);
+		}
+
+		if(neighbors.size() >= numberToQuery) {
+			neighbors.resize(numberToQuery);
+			return neighbors.back().squared_distance <= freeRadius * freeRadius;
+		} else {
+			// All points within maxSearchRadius must be cached
+			return maxSearchRadius() <= freeRadius;
+		}
+	}
+
+	// shear and shearRate are only set if not null
+	bool interpolatePoint(const Vector & position, Vector & velocity, SymmetricTensor * shear, scalar * shearRate, 
+		InterpolationWorkspace & workspace, NeighborCache * cache = nullptr) const
+	{
+		if(getInterpolationWeights(position, workspace, cache)) {
+			if(shear)
+				accumulatePointData(workspace.weights, velocity, *shear, shearRate);
+			else
+				accumulateVelocityAndShearRate(workspace.weights, velocity, shearRate);
+			return true;
+		}
+
+		// Fall back to nearest neighbor
+		int pointIndex;
+		if(nearestNeighborFallback() && getNearestNeighbor(position, pointIndex, workspace)) {
+			const float * data = &pointData_[pointIndex * pointDataStride];
+			velocity = Vector(data[0], data[1], data[2]);
+			if(shearRate)
+				*shearRate = data[3];
+			if(shear)
+				for(int k = 0; k < 6; ++k)
+					(*shear)[k] = data[4+k];
+			return true;
+		}
+
+		++workspace.interpolationFailures;
+		return false;
+	}
+
+	// Weighted average of the point data, shearRate is only set if not null
+	void accumulatePointData(const std::vector<InterpolationWeight> & weights, Vector & velocity, SymmetricTensor & shear, 
+		scalar * shearRate) const
+	{
+		alignas(32) float sum[pointDataStride];
+		scalar weightSum = 0;
+#ifdef __AVX__
+		__m256 sumLo = _mm256_setzero_ps();
+		__m128 sumHi = _mm_setzero_ps();
+		for(const InterpolationWeight & weight : weights) {
+			const float * data = &pointData_[weight.pointId * pointDataStride];
+			const __m256 w = _mm256_set1_ps(weight.weight);
+			sumLo = _mm256_add_ps(sumLo, _mm256_mul_ps(w, _mm256_loadu_ps(data)));
+			sumHi = _mm_add_ps(sumHi, _mm_mul_ps(_mm256_castps256_ps128(w), _mm_load_ps(data + 8)));
+			weightSum += weight.weight;
+		}
+		_mm256_store_ps(sum, sumLo);
+		_mm_store_ps(sum + 8, sumHi);
+#else
+		__m128 sum0 = _mm_setzero_ps();
+		__m128 sum1 = _mm_setzero_ps();
+		__m128 sum2 = _mm_setzero_ps();
+		for(const InterpolationWeight & weight : weights) {
+			const float * data = &pointData_[weight.pointId * pointDataStride];
+			const __m128 w = _mm_set1_ps(weight.weight);
+			sum0 = _mm_add_ps(sum0, _mm_mul_ps(w, _mm_load_ps(data)));
+			sum1 = _mm_add_ps(sum1, _mm_mul_ps(w, _mm_load_ps(data + 4)));
+			sum2 = _mm_add_ps(sum2, _mm_mul_ps(w, _mm_load_ps(data + 8)));
+			weightSum += weight.weight;
+		}
+		_mm_store_ps(sum, sum0);
+		_mm_store_ps(sum + 4, sum1);
+		_mm_store_ps(sum + 8, sum2);
+#endif
+		const scalar invWeightSum = 1.f / weightSum;
+		velocity = invWeightSum * Vector(sum[0], sum[1], sum[2]);
+		if(shearRate)
+			*shearRate = invWeightSum * sum[3];
+		for(int k = 0; k < 6; ++k)
+			shear[k] = invWeightSum * sum[4+k];
+	}
+
+	// Weighted average of the velocity and of the shear rate, the first four floats of the point data
+	void accumulateVelocityAndShearRate(const std::vector<InterpolationWeight> & weights, Vector & velocity, scalar * shearRate) const
+	{
+		alignas(16) float sum[4];
+		scalar weightSum = 0;
+		__m128 sum0 = _mm_setzero_ps();
+		for(const InterpolationWeight & weight : weights) {
+			sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_set1_ps(weight.weight), _mm_load_ps(&pointData_[weight.pointId * pointDataStride])));
+			weightSum += weight.weight;
+		}
+		_mm_store_ps(sum, sum0);
+
+		const scalar invWeightSum = 1.f / weightSum;
+		velocity = invWeightSum * Vector(sum[0], sum[1], sum[2]);
+		if(shearRate)
+			*shearRate = invWeightSum * sum[3];
+	}
+
+	// Recompute the equivalent shear rates of the owned point data, after a change of the stress metric
+	void updateShearRates()
+	{
+		for(size_t i = 0; i < numberOfPoints_; ++i) {
+			float * data = &ownedPointData_[i * pointDataStride];
+			SymmetricTensor shear;
+			for(int k = 0; k < 6; ++k)
+				shear[k] = data[4+k];
+			data[3] = equivalentShearRate(stressMetric(), shear);
+		}
+	}
+
+	scalar minSearchRadius_ = 1e-4;
+	scalar maxSearchRadius_ = 2e-3;
+	bool nearestNeighborFallback_ = true;
+	NeighborSearch neighborSearch_ = NeighborSearch::KNearest;
+	int numberOfNeighbors_ = 4;
+	int neighborCacheSize_ = 8;
+	MeshMode meshMode_ = MeshMode::Auto;
+	int searchTreeGeneration_ = -1;
+
+	// The search tree may be shared with other interpolators
+	std::shared_ptr<const SearchTree> searchTree_;
+	MeshKey meshKey_{};
+	bool isSharedSearchTree_ = false;
+
+	// View of the point data, either ownedPointData_ or a section of pointDataFile_
+	const float * pointData_ = nullptr;
+	size_t numberOfPoints_ = 0;
+	std::vector<float, Eigen::aligned_allocator<float>> ownedPointData_{};
+	std::shared_ptr<CacheFileReader> pointDataFile_{};
 };
 
 
@@ -0,0 +1,128 @@
+#include "InterpolatorPrefetcher.h"
+#include <string>
+
+InterpolatorPrefetcher::InterpolatorPrefetcher(Interpolator & prototype, const InputFileList & inputFileList, int prefetchDepth, int firstFileId)
+: prototype_(prototype.clone()), inputFileList_(inputFileList), prefetchDepth_(std::max(0, prefetchDepth)), nextFileId_(firstFileId)
+{
+	if(prefetchDepth_ > 0)
+		thread_ = std::thread(&InterpolatorPrefetcher::run, this);
+}
+
+InterpolatorPrefetcher::~InterpolatorPrefetcher()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stop_ = true;
+	}
+	condition_.notify_all();
+
+	// Waits for the file currently being read
+	if(thread_.joinable())
+		thread_.join();
+}
+
+std::unique_ptr<Interpolator> InterpolatorPrefetcher::acquire(int fileId)
+{
+	if(prefetchDepth_ == 0) {
+		// Read on demand
+		std::unique_ptr<Interpolator> interpolator = takeSpare();
+		if( ! load(fileId, *interpolator)) {
+			release(std::move(interpolator));
+			return nullptr;
+		}
+		return interpolator;
+	}
+
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	// Restart the prefetching from fileId if it is not the next file in the sequence
+	int expectedFileId = loaded_.empty() ? (isLoading_ ? nextFileId_-1 : nextFileId_) : loaded_.front().fileId;
+	if(fileId != expectedFileId) {
+		for(LoadedFile & loadedFile : loaded_)
+			spares_.push_back(std::move(loadedFile.interpolator));
+		loaded_.clear();
+		nextFileId_ = fileId;
+		++sequence_;
+		condition_.notify_all();
+	}
+
+	condition_.wait(lock, [this, fileId] { return error_ || ( ! loaded_.empty() && loaded_.front().fileId == fileId); });
+	if(error_)
+		std::rethrow_exception(error_);
+
+	LoadedFile loadedFile = std::move(loaded_.front());
+	loaded_.pop_front();
+	condition_.notify_all();
+
+	if( ! loadedFile.exists) {
+		spares_.push_back(std::move(loadedFile.interpolator));
+		return nullptr;
+	}
+	return std::move(loadedFile.interpolator);
+}
+
+void InterpolatorPrefetcher::release(std::unique_ptr<Interpolator> interpolator)
+{
+	if( ! interpolator)
+		return;
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	spares_.push_back(std::move(interpolator));
+}
+
+void InterpolatorPrefetcher::run()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	while(true) {
+		// Wait until there is room for another file
+		condition_.wait(lock, [this] { return stop_ || ( ! error_ && (int) loaded_.size() < prefetchDepth_); });
+		if(stop_)
+			return;
+
+		const int fileId = nextFileId_++;
+		const int sequence = sequence_;
+		std::unique_ptr<Interpolator> interpolator = takeSpare();
+		isLoading_ = true;
+
+		// Read without holding the lock
+		lock.unlock();
+		bool exists = false;
+		std::exception_ptr error{nullptr};
+		try {
+			exists = load(fileId, *interpolator);
+		} catch(...) {
+			error = std::current_exception();
+		}
+		lock.lock();
+
+		isLoading_ = false;
+		if(error)
+			error_ = error;
+		else if(sequence == sequence_)
+			loaded_.push_back(LoadedFile{fileId, exists, std::move(interpolator)});
+		else
+			spares_.push_back(std::move(interpolator));	// The file is no longer needed
+		condition_.notify_all();
+	}
+}
+
+bool InterpolatorPrefetcher::load(int fileId, Interpolator & interpolator)
+{
+	std::string fileName;
+	if( ! inputFileList_.getDataFileName(fileId, fileName))
+		return false;
+
+	interpolator.readData(fileName);
+	return true;
+}
+
+// Must be called with the mutex held when the loader thread is running
+std::unique_ptr<Interpolator> InterpolatorPrefetcher::takeSpare()
+{
+	if(spares_.empty())
+		return std::unique_ptr<Interpolator>(prototype_->clone());
+
+	std::unique_ptr<Interpolator> interpolator = std::move(spares_.back());
+	spares_.pop_back();
+	return interpolator;
+}
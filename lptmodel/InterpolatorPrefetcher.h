@@ -0,0 +1,69 @@
+#ifndef INTERPOLATORPREFETCHER_H_
+#define INTERPOLATORPREFETCHER_H_
+#include <memory>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include "Interpolator.h"
+#include "InputFileList.h"
+
+/*
+ * Reads the data files ahead of time on a background thread. The interpolators for the
+ * prefetchDepth files following the last requested one are loaded while the particles
+ * are integrated. Interpolators that are released are reused for later files, so at most
+ * prefetchDepth interpolators are held in addition to the ones in use. With a prefetch
+ * depth of 0, the files are read on demand in the calling thread.
+ */
+class InterpolatorPrefetcher {
+public:
+	// The interpolators are clones of prototype, firstFileId is the first file that will be requested
+	InterpolatorPrefetcher(Interpolator & prototype, const InputFileList & inputFileList, int prefetchDepth, int firstFileId);
+	~InterpolatorPrefetcher();
+
+	// Disallow copy construction and assignment
+	InterpolatorPrefetcher(const InterpolatorPrefetcher &) = delete;
+	InterpolatorPrefetcher & operator=(const InterpolatorPrefetcher &) = delete;
+
+	// Get an interpolator holding the data of file fileId, blocks until it has been read.
+	// Returns null if there is no such file. Requesting any other file than the one following
+	// the previous request discards the prefetched files.
+	std::unique_ptr<Interpolator> acquire(int fileId);
+
+	// Return an interpolator that is no longer used
+	void release(std::unique_ptr<Interpolator> interpolator);
+
+	int prefetchDepth() const { return prefetchDepth_; }
+
+private:
+	struct LoadedFile {
+		int fileId;
+		bool exists;
+		std::unique_ptr<Interpolator> interpolator;
+	};
+
+	void run();
+	bool load(int fileId, Interpolator & interpolator);
+	std::unique_ptr<Interpolator> takeSpare();
+
+	std::unique_ptr<Interpolator> prototype_;
+	InputFileList inputFileList_;
+	int prefetchDepth_;
+
+	// Shared with the loader thread, guarded by mutex_
+	std::mutex mutex_;
+	std::condition_variable condition_;
+	std::deque<LoadedFile> loaded_{};
+	std::vector<std::unique_ptr<Interpolator>> spares_{};
+	int nextFileId_;				// Next file to be read by the loader thread
+	int sequence_ = 0;				// Incremented when the prefetched files are discarded
+	bool isLoading_ = false;
+	bool stop_ = false;
+	std::exception_ptr error_{nullptr};
+
+	std::thread thread_;
+};
+
+#endif /* INTERPOLATORPREFETCHER_H_ */
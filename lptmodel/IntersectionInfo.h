@@ -1,12 +1,16 @@
 #ifndef IntersectionInfo_h_
 #define IntersectionInfo_h_
 
+#include <stdint.h>
+
 class Object;
 
 struct IntersectionInfo {
   float t; // Intersection distance along the ray
   const Object* object; // Object that was hit
+  uint32_t primitive; // Index of the object in the BVH primitive list
   Vector3 hit; // Location of the intersection
+  Vector3 normal; // Unit normal of the object at the intersection
 };
 
 #endif
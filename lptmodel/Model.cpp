@@ -6,9 +6,14 @@
 #include "io.h"
 #include "RayTracer.h"
 #include "Injector.h"
+#include "Parallel.h"
 #include <algorithm>
+#include <limits>
 #include "DynamicFactory.hh"
 
+// Number of particles handed to the momentum update at a time
+static const int particleBlockSize = 256;
+
 Model::~Model()
 {
 	clearParticles();
@@ -58,10 +63,11 @@ void Model::run()
 void Model::update()
 {
 	// Remove dead particles
-	particles_.erase(
-		std::remove_if(particles_.begin(), particles_.end(), 
-			[](auto && p) { return !p->isAlive(); }), 
-		particles_.end());
+	particles_.removeDead();
+
+	// Keep particles that are close in space close in memory, for coherent interpolation and collision queries
+	if(spatialSortInterval() > 0 && (iteration() % spatialSortInterval()) == 0)
+		particles_.sortSpatially();
 
 	readDataAndUpdateInterpolators();
 	injectParticles();
@@ -76,46 +82,59 @@ void Model::readDataAndUpdateInterpolators()
 		if(inputFileList_.empty()) {
 			std::cerr << "No data files were found!" << std::endl;
 		} else {
+			// The data files are read ahead of time by the prefetcher, using clones of the interpolator
+			if( ! prefetcher_) {
+				// The clones of the prefetcher build their search trees with the threads of the model
+				interpolator_->numberOfThreads() = numberOfThreads();
+				int firstFileId = this->substeps() > 1 ? this->currentFileId() : iteration_;
+				prefetcher_.reset(new InterpolatorPrefetcher(*interpolator_, inputFileList(), inputFileList().prefetchDepth(), firstFileId));
+			}
+
 			// If we perform multiple substeps per iteration, we need the data
 			// both for the current and the next timestep
 			if(this->substeps() > 1) {
 				// If we're at the first subiteration, fetch new data
 				if(this->currentSubIteration() == 0 || ! interpolator_->hasData()) {
-					std::string nextDataFileName;
-					if( ! inputFileList().getDataFileName(this->currentFileId()+1, nextDataFileName)) {
-						// Reached end of file list
-						isDone_ = true;
-						return;
-					}
-
 					// InterpolatorNext_ will be null if no data has been read
 					if(interpolatorNext_ && interpolatorNext_->hasData()) {
-						// Set interpolator to interpolatorNext and read the data at the next iteration
+						std::unique_ptr<Interpolator> next = prefetcher_->acquire(this->currentFileId()+1);
+						if( ! next) {
+							// Reached end of file list
+							isDone_ = true;
+							return;
+						}
+
+						// Set interpolator to interpolatorNext and use the data at the next iteration
 						std::swap(interpolator_, interpolatorNext_);
+						particles_.swapNeighborCaches();
+						prefetcher_->release(std::move(interpolatorNext_));
+						interpolatorNext_ = std::move(next);
 					} else {
-						// We're at the first timestep, read data for both the current and the next iteration
-						std::string currentDataFileName;
-						if( ! inputFileList().getDataFileName(this->currentFileId(), currentDataFileName)) {
+						// We're at the first timestep, fetch data for both the current and the next iteration
+						std::unique_ptr<Interpolator> current = prefetcher_->acquire(this->currentFileId());
+						std::unique_ptr<Interpolator> next = current ? prefetcher_->acquire(this->currentFileId()+1) : nullptr;
+						if( ! next) {
 							// Reached end of file list
 							isDone_ = true;
 							return;
 						}
-						interpolatorNext_.reset(interpolator_->clone());
-						interpolator_->readData(currentDataFileName);
+
+						prefetcher_->release(std::move(interpolator_));
+						prefetcher_->release(std::move(interpolatorNext_));
+						interpolator_ = std::move(current);
+						interpolatorNext_ = std::move(next);
 					}
-					
-					// Read data at next iteration
-					interpolatorNext_->readData(nextDataFileName);
 				}
 			} else {
 				// Only one substep, just use the iteration counter as file index
-				std::string currentDataFileName;
-				if( ! inputFileList().getDataFileName(iteration_, currentDataFileName)) {
+				std::unique_ptr<Interpolator> current = prefetcher_->acquire(iteration_);
+				if( ! current) {
 					// Reached end of file list
 					isDone_ = true;
 					return;
 				}
-				interpolator_->readData(currentDataFileName);
+				prefetcher_->release(std::move(interpolator_));
+				interpolator_ = std::move(current);
 			}
 		}
 	}
@@ -124,136 +143,346 @@ void Model::readDataAndUpdateInterpolators()
 void Model::injectParticles()
 {
 	std::cout << "  Injecting particles" << std::endl;
-	std::vector<Particle *> particlesToInject;
-	for(auto && injector : injectors_)
-		injector->inject(time(), time()+dt(), particlesToInject);
+	std::vector<Vector> positions;
+
+	// The particle type is the index of the injector
+	const size_t firstInjected = particles_.size();
+	for(size_t type = 0; type < injectors_.size(); ++type) {
+		positions.clear();
+		injectors_[type]->inject(time(), time()+dt(), positions);
 
-	int numberOfInjectedParticles = 0;
-	for(auto && p : particlesToInject) {
-		if(interpolator_)
-			interpolator_->interpolate(p->position(), p->velocity(), p->shear());
-		p->isAlive() = true;
-		p->injectionTime() = this->time();
-		addParticle(p);
+		for(const Vector & position : positions)
+			addParticle(position, type);
+	}
 
-		++numberOfInjectedParticles;
+	// Initial velocity from the fluid. The shear and the stored fluid velocity (see ParticleStore::HasFluidVelocity)
+	// are set with the other particles in updateParticles, where the substeps are blended.
+	const size_t numberOfInjectedParticles = particles_.size() - firstInjected;
+	if(interpolator_ && numberOfInjectedParticles > 0) {
+		interpolationWorkspaces_.resize(numberOfThreads());
+		interpolationFound_.resize(particles_.size());
+		interpolator_->interpolate(&particles_.position()[firstInjected], numberOfInjectedParticles, 
+			&particles_.velocity()[firstInjected], nullptr, nullptr,
+			&interpolationFound_[firstInjected], interpolationWorkspaces_[0], &particles_.neighborCache()[firstInjected]);
 	}
 	if(numberOfInjectedParticles > 0)
 		std::cout << "   Injected " << numberOfInjectedParticles << " particles" << std::endl;
 }
 
-void Model::addParticle(Particle * particle)
+size_t Model::addParticle(const Vector & position, int type)
 {
-	particle->id() = nextParticleId_++;
-	particles_.emplace_back(particle);
+	return particles_.add(nextParticleId_++, type, position, this->time());
 }
 
 void Model::updateParticles()
 {
 	std::cout << "  Updating particles" << std::endl;
-	for(auto && p : particles_) {
-		if( ! p->isAlive())
-			continue;
 
-		updateParticleMomentumAndActivation(p.get());
-		updateParticlePosition(p.get(), time(), time() + dt());
-		p->age() += dt();
+	// One set of interpolation scratch buffers per thread
+	interpolationWorkspaces_.resize(numberOfThreads());
+
+	// The particles are updated independently of each other, so the result
+	// does not depend on the number of threads or on the scheduling
+	const int numberOfParticles = particles_.size();
+	const int numberOfBlocks = (numberOfParticles + particleBlockSize - 1) / particleBlockSize;
+	fluidVelocity_.resize(numberOfParticles);
+	fluidShearRate_.resize(numberOfParticles);
+	interpolationFound_.resize(numberOfParticles);
+	if(substeps() > 1) {
+		fluidVelocityNext_.resize(numberOfParticles);
+		fluidShearRateNext_.resize(numberOfParticles);
+		shearNext_.resize(numberOfParticles);
+		interpolationFoundNext_.resize(numberOfParticles);
 	}
-}
 
-void Model::updateParticleMomentumAndActivation(Particle * p)
-{
+	// The activation only needs the scalar shear rate. The shear tensor is interpolated when it is 
+	// written at the next iteration, or when the momentum update of a particle type uses it.
+	bool interpolateShear = ((iteration() + 1) % outputInterval()) == 0;
+	for(auto && injector : injectors_)
+		interpolateShear = interpolateShear || injector->templateParticle().usesShear();
+
 	if(interpolator_) {
-		Matrix shear;
-		Vector fluidVelocity;
-		if(!interpolator_->interpolate(p->position(), fluidVelocity, shear)) {
-			p->isAlive() = false;
-			return;
+		// Fluid velocity and shear at the particle positions, one batch per block of particles
+		#pragma omp parallel for schedule(dynamic) num_threads(numberOfThreads())
+		for(int block = 0; block < numberOfBlocks; ++block) {
+			size_t begin = (size_t) block * particleBlockSize;
+			size_t end = std::min<size_t>(begin + particleBlockSize, numberOfParticles);
+			interpolateFluidState(begin, end, interpolateShear, interpolationWorkspaces_[threadId()]);
 		}
 
-		if(substeps() > 1) {
-			// Linear interpolation between the value from the two interpolators
-			Matrix shear2;
-			Vector fluidVelocity2;				
-			if(!interpolatorNext_->interpolate(p->position(), fluidVelocity2, shear2)) {
-				p->isAlive() = false;
-				return;
+		// Collect the neighbor cache statistics and the failed interpolations, including those of the injection
+		size_t cacheHits = 0, cacheMisses = 0, interpolationFailures = 0;
+		for(InterpolationWorkspace & workspace : interpolationWorkspaces_) {
+			cacheHits += workspace.cacheHits;
+			cacheMisses += workspace.cacheMisses;
+			interpolationFailures += workspace.interpolationFailures;
+			workspace.cacheHits = workspace.cacheMisses = workspace.interpolationFailures = 0;
+		}
+		interpolationCacheHits_ += cacheHits;
+		interpolationCacheMisses_ += cacheMisses;
+		if(cacheHits + cacheMisses > 0)
+			std::cout << "   Neighbor cache: " << cacheHits << " hits, " << cacheMisses << " misses" << std::endl;
+		if(interpolationFailures > 0)
+			std::cerr << "   Interpolation failed at " << interpolationFailures << " positions" << std::endl;
+
+		// Momentum update, one virtual call per particle type and block of particles. The fluid acceleration
+		// is the change of the fluid velocity seen by the particle since the previous time step. It is zero
+		// at the first step of a particle, which stores the (substep blended) fluid velocity for the next step.
+		fluidAcceleration_.resize(numberOfParticles);
+		#pragma omp parallel for schedule(dynamic) num_threads(numberOfThreads())
+		for(int block = 0; block < numberOfBlocks; ++block) {
+			size_t begin = (size_t) block * particleBlockSize;
+			size_t end = std::min<size_t>(begin + particleBlockSize, numberOfParticles);
+			for(size_t i = begin; i < end; ++i) {
+				unsigned char & flags = particles_.flags()[i];
+				if(flags & ParticleStore::HasFluidVelocity)
+					fluidAcceleration_[i] = (fluidVelocity_[i] - particles_.fluidVelocity()[i]) / dt();
+				else
+					fluidAcceleration_[i].setZero();
+				particles_.fluidVelocity()[i] = fluidVelocity_[i];
+				flags |= ParticleStore::HasFluidVelocity;
 			}
+			for(size_t type = 0; type < injectors_.size(); ++type)
+				injectors_[type]->templateParticle().updateMomentum(dt(), fluid(), type, begin, end, fluidVelocity_, fluidAcceleration_, particles_);
+		}
 
-			fluidVelocity = (1 - currentTimeStepFraction()) * fluidVelocity + currentTimeStepFraction() * fluidVelocity2;
-			shear = (1 - currentTimeStepFraction()) * shear + currentTimeStepFraction() * shear2;
+		// Update pas, one batch per block of particles. Dead particles are masked out and not updated.
+		// All models of a multi-model are evaluated on a block, each in its own dose and pas columns.
+		const int numberOfModels = activationModel_->numberOfModels();
+		if(particles_.numberOfActivationModels() != numberOfModels)
+			particles_.setNumberOfActivationModels(numberOfModels);
+		// The scalar stress is the viscosity times the equivalent shear rate of the stress metric of the interpolator
+		activationStress_.resize(numberOfParticles);
+		activationAlive_.resize(numberOfParticles);
+		const scalar mu = fluid().mu();
+		#pragma omp parallel for schedule(static) num_threads(numberOfThreads())
+		for(int block = 0; block < numberOfBlocks; ++block) {
+			size_t begin = (size_t) block * particleBlockSize;
+			size_t end = std::min<size_t>(begin + particleBlockSize, numberOfParticles);
+			for(size_t i = begin; i < end; ++i) {
+				activationAlive_[i] = particles_.isAlive(i);
+				activationStress_[i] = activationAlive_[i] ? mu * fluidShearRate_[i] : 0;
+			}
+			if(numberOfModels == 1) {
+				activationModel_->evaluate(dt(), &activationStress_[begin], &activationAlive_[begin], 
+					&particles_.dose()[begin], &particles_.pas()[begin], end - begin);
+			} else {
+				std::vector<scalar *> dose(numberOfModels), pas(numberOfModels);
+				for(int m = 0; m < numberOfModels; ++m) {
+					dose[m] = &particles_.activationDose(m)[begin];
+					pas[m] = &particles_.activationPas(m)[begin];
+				}
+				activationModel_->evaluateModels(dt(), &activationStress_[begin], &activationAlive_[begin], dose.data(), pas.data(), end - begin);
+			}
 		}
+	}
 
-		p->updateMomentum(dt(), fluidVelocity, shear, fluid());
+	updateParticlePositions();
 
-		// Update pas
-		scalar tau = std::sqrt(2) * fluid().mu() * shear.norm();
-		activationModel_->evaluate(dt(), tau, p->dose(), p->pas());
-		p->shear() = shear;
-	}
+	#pragma omp parallel for schedule(static) num_threads(numberOfThreads())
+	for(int i = 0; i < numberOfParticles; ++i)
+		if(particles_.isAlive(i))
+			particles_.age()[i] += dt();
 }
 
-void Model::updateParticlePosition(Particle * p, scalar tCurrent, scalar tNext, int collCount)
+// Interpolate the fluid velocity and equivalent shear rate to the positions of the particles in [begin, end),
+// and the shear tensor if interpolateShear is set. Particles outside the domain are killed.
+void Model::interpolateFluidState(size_t begin, size_t end, bool interpolateShear, InterpolationWorkspace & workspace)
 {
-	scalar dtCurrent = tNext - tCurrent;
+	const size_t n = end - begin;
+	interpolator_->interpolate(&particles_.position()[begin], n, &fluidVelocity_[begin], 
+		interpolateShear ? &particles_.shear()[begin] : nullptr, &fluidShearRate_[begin], 
+		&interpolationFound_[begin], workspace, &particles_.neighborCache()[begin]);
+
+	if(substeps() > 1) {
+		// Linear interpolation between the value from the two interpolators
+		interpolatorNext_->interpolate(&particles_.position()[begin], n, &fluidVelocityNext_[begin], 
+			interpolateShear ? &shearNext_[begin] : nullptr, &fluidShearRateNext_[begin], 
+			&interpolationFoundNext_[begin], workspace, &particles_.neighborCacheNext()[begin]);
+
+		const scalar fraction = currentTimeStepFraction();
+		for(size_t i = begin; i < end; ++i) {
+			interpolationFound_[i] = interpolationFound_[i] && interpolationFoundNext_[i];
+			fluidVelocity_[i] = (1 - fraction) * fluidVelocity_[i] + fraction * fluidVelocityNext_[i];
+			fluidShearRate_[i] = (1 - fraction) * fluidShearRate_[i] + fraction * fluidShearRateNext_[i];
+		}
+		if(interpolateShear)
+			for(size_t i = begin; i < end; ++i)
+				particles_.shear()[i] = (1 - fraction) * particles_.shear()[i] + fraction * shearNext_[i];
+	}
 
-	Vector pos_last = p->position();
-	p->position() += dtCurrent * p->velocity();
-	
-	if(collCount > 10)
-		return;
+	for(size_t i = begin; i < end; ++i)
+		if( ! interpolationFound_[i])
+			particles_.kill(i);
+}
 
-	// Check if the line between the current and the next position intersects the boundary
-	for(auto rtIt = rayTracers_.begin(); rtIt != rayTracers_.end(); ++rtIt) {
-		RayTracer & rayTracer = *(*rtIt);
+// Move the particles to the end of the time step, with elastic collisions with the boundaries.
+// The segments of all moving particles are tested against a boundary in one batch. The particles 
+// that collide continue from the collision point in the next round, at most 10 collisions per step.
+// Each particle carries a lower bound of its distance to all boundaries (in their local frames). A segment
+// shorter than the bound is not tested, and the bound is decreased by the segment length. When the bound
+// is used up, it is recomputed with a closest point query, up to wallDistanceHorizon segment lengths.
+// The segments are tested in the local frames of the boundaries. For a rotating boundary the path of a
+// particle is curved in the local frame, and is followed by several chords when the segment deviates
+// from it by more than the path tolerance of the boundary (fast particles far from the rotation axis).
+void Model::updateParticlePositions()
+{
+	const scalar wallDistanceHorizon = 64;
+	const scalar tNext = time() + dt();
+	const int numberOfParticles = particles_.size();
+	movingParticles_.clear();
+	for(int i = 0; i < numberOfParticles; ++i)
+		if(particles_.isAlive(i))
+			movingParticles_.push_back(i);
+	segmentStartTime_.assign(numberOfParticles, time());
+	size_t numberOfSegments = 0, numberOfSkipped = 0;
+
+	// Boundary transforms at the start and end of the step, all segments but those after a collision start at time()
+	boundaryTransformStart_.clear();
+	boundaryTransformEnd_.clear();
+	for(auto && rayTracer : rayTracers_) {
+		boundaryTransformStart_.push_back(rayTracer->coordinateSystem().transformAt(time()));
+		boundaryTransformEnd_.push_back(rayTracer->coordinateSystem().transformAt(tNext));
+	}
 
-		// Transform positions to the raytracer's coordinate system
-		Vector pos_start_rf, pos_end_rf;
-		rayTracer.coordinateSystem().positionToLocalFrame(tCurrent, pos_last, pos_start_rf);
-		rayTracer.coordinateSystem().positionToLocalFrame(tNext, p->position(), pos_end_rf);
+	for(int collCount = 0; ! movingParticles_.empty(); ++collCount) {
+		// Move the particles to the end of the time step
+		const int numberOfMoving = movingParticles_.size();
+		segmentStart_.resize(numberOfMoving);
+		#pragma omp parallel for schedule(static) num_threads(numberOfThreads())
+		for(int k = 0; k < numberOfMoving; ++k) {
+			const size_t i = movingParticles_[k];
+			segmentStart_[k] = particles_.position()[i];
+			particles_.position()[i] += (tNext - segmentStartTime_[i]) * particles_.velocity()[i];
+		}
 
-		// Check for collision
-		IntersectionInfo intersectionInfo;
-		if(rayTracer.findRayIntersection(pos_start_rf, pos_end_rf, intersectionInfo)) {
-			// Determine fraction of timestep before collision
-			scalar ts_fraction = intersectionInfo.t / (pos_end_rf - pos_start_rf).norm();
+		if(collCount > 10) {
+			// Moved without collision tests
+			for(size_t i : movingParticles_)
+				particles_.wallDistance()[i] = 0;
+			break;
+		}
+
+		// Check if the lines between the start and end positions intersect the boundaries. A particle
+		// collides with the first boundary, in the order of the boundaries, that it intersects.
+		collided_.assign(numberOfMoving, 0);
+		wallDistance_.assign(numberOfMoving, std::numeric_limits<scalar>::infinity());
+		for(size_t boundary = 0; boundary < rayTracers_.size(); ++boundary) {
+			const RayTracer & rayTracer = *rayTracers_[boundary];
+
+			boundaryParticles_.clear();
+			for(int k = 0; k < numberOfMoving; ++k)
+				if( ! collided_[k])
+					boundaryParticles_.push_back(k);
+
+			// Transform positions to the raytracer's coordinate system
+			const int numberOfBoundarySegments = boundaryParticles_.size();
+			boundarySegmentStart_.resize(numberOfBoundarySegments);
+			boundarySegmentEnd_.resize(numberOfBoundarySegments);
+			boundaryWallDistance_.resize(numberOfBoundarySegments);
+			#pragma omp parallel for schedule(static) num_threads(numberOfThreads())
+			for(int s = 0; s < numberOfBoundarySegments; ++s) {
+				const size_t k = boundaryParticles_[s];
+				const size_t i = movingParticles_[k];
+				boundarySegmentStart_[s] = segmentStart_[k];
+				boundarySegmentEnd_[s] = particles_.position()[i];
+				boundaryWallDistance_[s] = particles_.wallDistance()[i];
+			}
+			if(collCount == 0)
+				boundaryTransformStart_[boundary].positionsToLocalFrame(boundarySegmentStart_.data(), numberOfBoundarySegments, boundarySegmentStart_.data());
+			else
+				for(int s = 0; s < numberOfBoundarySegments; ++s)
+					rayTracer.coordinateSystem().positionToLocalFrame(segmentStartTime_[movingParticles_[boundaryParticles_[s]]], 
+						boundarySegmentStart_[s], boundarySegmentStart_[s]);
+			boundaryTransformEnd_[boundary].positionsToLocalFrame(boundarySegmentEnd_.data(), numberOfBoundarySegments, boundarySegmentEnd_.data());
+
+			// Check for collisions
+			numberOfSkipped += rayTracer.findSegmentIntersections(boundarySegmentStart_, boundarySegmentEnd_, 
+				boundaryIntersections_, numberOfThreads(), boundaryWallDistance_.data());
+			numberOfSegments += numberOfBoundarySegments;
+
+			const scalar pathTolerance = rayTracer.pathTolerance();
+			#pragma omp parallel for schedule(dynamic, 256) num_threads(numberOfThreads())
+			for(int s = 0; s < numberOfBoundarySegments; ++s) {
+				SegmentIntersection & intersection = boundaryIntersections_[s];
+				const size_t k = boundaryParticles_[s];
+				const size_t i = movingParticles_[k];
+				scalar length = (boundarySegmentEnd_[s] - boundarySegmentStart_[s]).norm();
+
+				// In a rotating frame the path is curved, the segments whose chord deviates too much from the
+				// path are tested again along the path
+				if(pathTolerance > 0) {
+					const int numberOfSweepSegments = rayTracer.numberOfSweepSegments(segmentStart_[k], particles_.position()[i], 
+						tNext - segmentStartTime_[i]);
+					if(numberOfSweepSegments > 1)
+						rayTracer.findSweptIntersection(segmentStart_[k], particles_.position()[i], segmentStartTime_[i], tNext, 
+							numberOfSweepSegments, boundaryWallDistance_[s], intersection, length);
+				}
 
-			// Time of impact
-			scalar tImpact = tCurrent + ts_fraction * dtCurrent;
+				if( ! intersection.hit) {
+					// Distance bound at the end of the segment, the path is within the path tolerance of the segment
+					length += pathTolerance;
+					const scalar bound = length < boundaryWallDistance_[s] ? boundaryWallDistance_[s] - length 
+						: rayTracer.wallDistance(boundarySegmentEnd_[s], wallDistanceHorizon * length);
+					wallDistance_[k] = std::min(wallDistance_[k], bound);
+					continue;
+				}
 
-			// Integrate the position up to the collision moment
-			p->position() = pos_last + dtCurrent * ts_fraction * p->velocity();
+				Vector & position = particles_.position()[i];
+				Vector & velocity = particles_.velocity()[i];
+				const scalar tCurrent = segmentStartTime_[i];
+				const scalar dtCurrent = tNext - tCurrent;
 
-			// Assume that the collision is fully elastic, so that
-			// the normal component of the velocity is reversed
-			Vector velocityImpactLocalFrame;
-			Vector3 normal1 = intersectionInfo.object->getNormal(intersectionInfo);
-			Vector normalLocalFrame(normal1.x, normal1.y, normal1.z);
+				// Time of impact
+				scalar tImpact = tCurrent + intersection.fraction * dtCurrent;
 
-			rayTracer.coordinateSystem().velocityToLocalFrame(tImpact, p->position(), p->velocity(), velocityImpactLocalFrame);
-			velocityImpactLocalFrame -= 2. * (velocityImpactLocalFrame.dot(normalLocalFrame)) * normalLocalFrame;
+				// Integrate the position up to the collision moment
+				position = segmentStart_[k] + dtCurrent * intersection.fraction * velocity;
 
-			// Transform back world frame, and set the particle velocity to the post collision velocity
-			rayTracer.coordinateSystem().velocityToWorldFrame(tImpact, p->position(), velocityImpactLocalFrame, p->velocity());
+				// Assume that the collision is fully elastic, so that
+				// the normal component of the velocity is reversed
+				Vector velocityImpactLocalFrame;
+				rayTracer.coordinateSystem().velocityToLocalFrame(tImpact, position, velocity, velocityImpactLocalFrame);
+				velocityImpactLocalFrame -= 2. * (velocityImpactLocalFrame.dot(intersection.normal)) * intersection.normal;
 
-			// Update postion (post collision)
-			updateParticlePosition(p, tImpact, tNext, collCount+1);
+				// Transform back world frame, and set the particle velocity to the post collision velocity
+				rayTracer.coordinateSystem().velocityToWorldFrame(tImpact, position, velocityImpactLocalFrame, velocity);
 
-			p->collisionCount() += 1;
-			break;
+				// The rest of the step is integrated in the next round, the particle is at the wall
+				segmentStartTime_[i] = tImpact;
+				particles_.wallDistance()[i] = 0;
+				particles_.collisionCount()[i] += 1;
+				collided_[k] = 1;
+			}
 		}
+
+		for(int k = 0; k < numberOfMoving; ++k)
+			if( ! collided_[k])
+				particles_.wallDistance()[movingParticles_[k]] = wallDistance_[k];
+
+		// Continue with the particles that collided
+		size_t numberOfCollided = 0;
+		for(int k = 0; k < numberOfMoving; ++k)
+			if(collided_[k])
+				movingParticles_[numberOfCollided++] = movingParticles_[k];
+		movingParticles_.resize(numberOfCollided);
 	}
+
+	collisionSegments_ += numberOfSegments;
+	collisionSegmentsSkipped_ += numberOfSkipped;
+	if(numberOfSegments > 0)
+		std::cout << "   Collision broad phase: " << numberOfSkipped << " of " << numberOfSegments << " segments skipped" << std::endl;
 }
 
 void Model::absorbParticles()
 {
 	std::cout << "  Absorbing particles" << std::endl;
 	int numberOfAbsorbedParticles = 0;
-	for(auto && p : particles_)
-		if(p->isAlive())
+	for(size_t i = 0; i < particles_.size(); ++i)
+		if(particles_.isAlive(i))
 			for(auto && absorber: absorbers_)
-				if(absorber->isOutside(p->position())) {
-					p->isAlive() = false;
+				if(absorber->isOutside(particles_.position()[i])) {
+					particles_.kill(i);
 					++numberOfAbsorbedParticles;
 				}
 	if(numberOfAbsorbedParticles > 0)
@@ -285,6 +514,7 @@ void Model::fromJSON(const json & jsonObject)
 
 	// Read activation model
 	activationModel_ = activationModelFactory().createFromJSON(jsonObject.at("activation"));
+	particles_.setNumberOfActivationModels(activationModel_->numberOfModels());
 
 	// Read boundaries
 	std::cout << "Reading boundaries" << std::endl;
@@ -329,6 +559,8 @@ void Model::fromJSON(const json & jsonObject)
 			substeps() = timesteppingProperties.at("subIterations").get<int>();
 		else
 			substeps() = 1;
+		numberOfThreads() = std::max(1, jsonGetOrDefault<int>(timesteppingProperties, "numberOfThreads", 1));
+		spatialSortInterval() = jsonGetOrDefault<int>(timesteppingProperties, "spatialSortInterval", 10);
 	}
 }
 
@@ -340,26 +572,37 @@ void Model::writeParticles(std::string fileName) const
 	if(out.good()) {
 		std::cout << "  Writing data to " << fileName << std::endl;
 		// Write header
-		out << "id,injection_time,age,x,y,z,ux,uy,uz,pas,tauXX,tauXY,tauXZ,tauYY,tauYZ,tauZZ,dose,isAlive,collisionCount" << std::endl;
+		// The additional models of a multi-model are written after the other columns
+		const int numberOfExtraModels = std::min(particles_.numberOfActivationModels(), 
+			activationModel_ ? activationModel_->numberOfModels() : 1) - 1;
+		out << "id,injection_time,age,x,y,z,ux,uy,uz,pas,tauXX,tauXY,tauXZ,tauYY,tauYZ,tauZZ,dose,isAlive,collisionCount";
+		for(int m = 1; m <= numberOfExtraModels; ++m)
+			out << ",pas_" << activationModel_->modelName(m) << ",dose_" << activationModel_->modelName(m);
+		out << std::endl;
 
 		// Write particle data
-		for(auto &&  p : particles_) {
-			out 	<< p->id() << ","
-					<< p->injectionTime() << ","
-					<< p->age() << ","
-					<< p->position()[0] << "," << p->position()[1] << "," << p->position()[2] << ","
-					<< p->velocity()[0] << "," << p->velocity()[1] << "," << p->velocity()[2] << ","
-					<< p->pas() << ","
-					<< 2*fluid().mu() * p->shear()(0, 0) << ","
-					<< 2*fluid().mu() * p->shear()(0, 1) << ","
-					<< 2*fluid().mu() * p->shear()(0, 2) << ","
-					<< 2*fluid().mu() * p->shear()(1, 1) << ","
-					<< 2*fluid().mu() * p->shear()(1, 2) << ","
-					<< 2*fluid().mu() * p->shear()(2, 2) << ","
-					<< p->dose() << ","
-					<< p->isAlive() << ","
-					<< p->collisionCount()
-					<< std::endl;
+		for(size_t i = 0; i < particles_.size(); ++i) {
+			const Vector & position = particles_.position()[i];
+			const Vector & velocity = particles_.velocity()[i];
+			const SymmetricTensor & shear = particles_.shear()[i];
+			out 	<< particles_.id()[i] << ","
+					<< particles_.injectionTime()[i] << ","
+					<< particles_.age()[i] << ","
+					<< position[0] << "," << position[1] << "," << position[2] << ","
+					<< velocity[0] << "," << velocity[1] << "," << velocity[2] << ","
+					<< particles_.pas()[i] << ","
+					<< 2*fluid().mu() * shear[0] << ","
+					<< 2*fluid().mu() * shear[1] << ","
+					<< 2*fluid().mu() * shear[2] << ","
+					<< 2*fluid().mu() * shear[3] << ","
+					<< 2*fluid().mu() * shear[4] << ","
+					<< 2*fluid().mu() * shear[5] << ","
+					<< particles_.dose()[i] << ","
+					<< particles_.isAlive(i) << ","
+					<< particles_.collisionCount()[i];
+			for(int m = 1; m <= numberOfExtraModels; ++m)
+				out << "," << particles_.activationPas(m)[i] << "," << particles_.activationDose(m)[i];
+			out << std::endl;
 		}
 	} else {
 		std::cout << "  Could not open " << fileName << " for writing" << std::endl;
@@ -378,13 +621,8 @@ void Model::writeCheckpoint(std::string fileName) const
 		write_to_stream(out, &iteration_, 1);
 		//write_to_stream(out, &dt_, 1);
 
-		// Write number of particles
-		int num_particles = particles_.size();
-		write_to_stream(out, &num_particles, 1);
-
-		// Dump data
-		for(auto && p : particles_)
-			p->writeBinary(out);
+		// Dump particle data
+		particles_.writeBinary(out);
 
 		out.close();
 	} else {
@@ -400,14 +638,15 @@ void Model::readCheckpoint(std::string fileName)
 		// Read iteration
 		read_from_stream(in, &iteration_, 1);
 
-		// Read number of particles
-		int num_particles;
-		read_from_stream(in, &num_particles, 1);
+		// Read particle data
+		particles_.readBinary(in);
 
-		// Read data
-		particles_.clear();
-		for(int i = 0; i < num_particles; ++i) {
-			particles_.emplace_back(particleFactory().createFromStream(in));
+		// The particle types refer to the injectors, which are not part of the checkpoint
+		nextParticleId_ = 0;
+		for(size_t i = 0; i < particles_.size(); ++i) {
+			if(particles_.type()[i] < 0 || particles_.type()[i] >= (int) injectors_.size())
+				throw std::runtime_error("The checkpoint contains particles of a type that does not match any injector");
+			nextParticleId_ = std::max(nextParticleId_, particles_.id()[i] + 1);
 		}
 
 		std::cout << "  Successfully read " << numParticles() << " particles" << std::endl;
@@ -8,7 +8,9 @@
 #include "Interpolator.h"
 #include "RayTracer.h"
 #include "Interpolator.h"
+#include "InterpolatorPrefetcher.h"
 #include "Injector.h"
+#include "ParticleStore.h"
 #include "Absorber.h"
 #include "InputFileList.h"
 #include "ActivationModel.h"
@@ -26,11 +28,12 @@ public:
 	void clearRayTracers() { rayTracers_.clear(); }
 	void addInjector(Injector * injector) { injectors_.push_back(std::unique_ptr<Injector>(injector)); }
 	void clearInjectors() { injectors_.clear(); }
-	void addParticle(Particle * particle);
+	// Add a particle of the given type (injector index) and return its index in the particle store
+	size_t addParticle(const Vector & position, int type);
 	void clearParticles();
 	void addAbsorber(Absorber * absorber) { absorbers_.push_back(std::unique_ptr<Absorber>(absorber)); }
 	void clearAbsorbers() { absorbers_.clear(); }
-	void setInterpolator(Interpolator * interpolator) { interpolator_.reset(interpolator); interpolatorNext_.reset(nullptr); }
+	void setInterpolator(Interpolator * interpolator) { prefetcher_.reset(nullptr); interpolator_.reset(interpolator); interpolatorNext_.reset(nullptr); }
 	void setActivationModel(ActivationModel * activationModel) { activationModel_.reset(activationModel); }
 	bool isDone() const { return isDone_; }
 
@@ -40,10 +43,16 @@ public:
 	GETSET(int, iteration)
 	GETSET(Fluid, fluid)
 	GETSET(int, substeps)
+	GETSET(int, numberOfThreads)
+	GETSET(int, spatialSortInterval)
 	GETSET(InputFileList, inputFileList)
 	GETSET(std::string, outputFolder)
 
 	int numParticles() const { return particles_.size(); }
+	size_t interpolationCacheHits() const { return interpolationCacheHits_; }
+	size_t interpolationCacheMisses() const { return interpolationCacheMisses_; }
+	size_t collisionSegments() const { return collisionSegments_; }
+	size_t collisionSegmentsSkipped() const { return collisionSegmentsSkipped_; }
 	scalar time() const { return iteration() * dt(); }
 	scalar dataDt() const { return inputFileList().dataDt(); }
 	scalar dt() const { return dataDt() / (scalar) substeps(); }
@@ -68,13 +77,19 @@ private:
 	void injectParticles();
 	void absorbParticles();
 	void readDataAndUpdateInterpolators();
-	void updateParticleMomentumAndActivation(Particle * p);
-	void updateParticlePosition(Particle * p, scalar, scalar, int collCount = 0);
+	void interpolateFluidState(size_t begin, size_t end, bool interpolateShear, InterpolationWorkspace & workspace);
+	void updateParticlePositions();
 
 	bool isDone_ = false;
 	int substeps_ = 1;
+	int numberOfThreads_ = 1;
+	int spatialSortInterval_ = 10;
 	int iteration_ = 0;
 	int nextParticleId_ = 0;
+	size_t interpolationCacheHits_ = 0;
+	size_t interpolationCacheMisses_ = 0;
+	size_t collisionSegments_ = 0;
+	size_t collisionSegmentsSkipped_ = 0;
 	int Nt_ = 0;
 	int outputInterval_ = 1;
 	int checkpointInterval_ = 1;
@@ -82,11 +97,37 @@ private:
 	InputFileList inputFileList_{};
 	std::unique_ptr<Interpolator> interpolator_{nullptr};
 	std::unique_ptr<Interpolator> interpolatorNext_{nullptr};
+	std::unique_ptr<InterpolatorPrefetcher> prefetcher_{nullptr};
 	std::unique_ptr<ActivationModel> activationModel_{nullptr};
 	std::vector<std::unique_ptr<RayTracer>> rayTracers_{};
 	std::vector<std::unique_ptr<Injector>> injectors_{};
 	std::vector<std::unique_ptr<Absorber>> absorbers_{};
-	std::vector<std::unique_ptr<Particle>> particles_{};
+	ParticleStore particles_{};
+	std::vector<Vector> fluidVelocity_{};
+	std::vector<Vector> fluidVelocityNext_{};
+	std::vector<Vector> fluidAcceleration_{};
+	std::vector<SymmetricTensor> shearNext_{};
+	std::vector<scalar> fluidShearRate_{};
+	std::vector<scalar> fluidShearRateNext_{};
+	std::vector<unsigned char> interpolationFound_{};
+	std::vector<unsigned char> interpolationFoundNext_{};
+	std::vector<InterpolationWorkspace> interpolationWorkspaces_{};
+	std::vector<scalar> activationStress_{};
+	std::vector<unsigned char> activationAlive_{};
+
+	// Collision workspace, see updateParticlePositions
+	std::vector<size_t> movingParticles_{};
+	std::vector<scalar> segmentStartTime_{};
+	std::vector<Vector> segmentStart_{};
+	std::vector<unsigned char> collided_{};
+	std::vector<size_t> boundaryParticles_{};
+	std::vector<Vector> boundarySegmentStart_{};
+	std::vector<Vector> boundarySegmentEnd_{};
+	std::vector<scalar> boundaryWallDistance_{};
+	std::vector<scalar> wallDistance_{};
+	std::vector<FrameTransform> boundaryTransformStart_{};
+	std::vector<FrameTransform> boundaryTransformEnd_{};
+	std::vector<SegmentIntersection> boundaryIntersections_{};
 	Fluid fluid_{};
 };
 
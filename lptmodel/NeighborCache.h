@@ -0,0 +1,21 @@
+#ifndef NEIGHBORCACHE_H_
+#define NEIGHBORCACHE_H_
+#include "typedefs.h"
+
+/*
+ * Result of the last neighbor search of a particle. Stores the nearest points to center,
+ * and a distance from center within which no other points exist. A later search from a
+ * nearby position can be answered from the cached points as long as the answer cannot
+ * contain points outside the cache (see UnstructuredPointInterpolator).
+ */
+struct NeighborCache {
+	static const int capacity = 12;
+
+	Vector center{0, 0, 0};
+	scalar bound = 0;			// All points not in pointIds are at least this far from center
+	int generation = -1;		// Search tree the point ids refer to, -1 if the cache is empty
+	int size = 0;
+	unsigned int pointIds[capacity];
+};
+
+#endif /* NEIGHBORCACHE_H_ */
@@ -0,0 +1,18 @@
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Index of the calling thread in the enclosing parallel region (0 if compiled without OpenMP)
+inline int threadId()
+{
+#ifdef _OPENMP
+	return omp_get_thread_num();
+#else
+	return 0;
+#endif
+}
+
+#endif /* PARALLEL_H_ */
@@ -4,6 +4,8 @@
 #include "Fluid.h"
 #include "typedefs.h"
 #include "DynamicFactory.hh"
+#include <cmath>
+#include <stdexcept>
 
 // Explicit instantiation of factory
 //template class DynamicFactory<Particle>;
@@ -18,30 +20,6 @@ ParticleFactory & particleFactory()
 void Particle::writeBinary(std::ostream & os) const
 {
 	write_to_stream(os, typeId());
-	write_to_stream(os, id_);
-	write_to_stream(os, position());
-	write_to_stream(os, velocity());
-	write_to_stream(os, shear_);
-	write_to_stream(os, pas_);
-	write_to_stream(os, dose_);
-	write_to_stream(os, age_);
-	write_to_stream(os, isAlive_);
-	write_to_stream(os, collisionCount_);
-	write_to_stream(os, injectionTime_);
-}
-
-void Particle::readBinary(std::istream & is)
-{
-	read_from_stream(is, id_);
-	read_from_stream(is, position());
-	read_from_stream(is, velocity());
-	read_from_stream(is, shear_);
-	read_from_stream(is, pas_);
-	read_from_stream(is, dose_);
-	read_from_stream(is, age_);
-	read_from_stream(is, isAlive_);
-	read_from_stream(is, collisionCount_);
-	read_from_stream(is, injectionTime_);
 }
 
 // Tracer particle
@@ -52,49 +30,70 @@ TracerParticle * TracerParticle::clone() const
 	return new TracerParticle(*this); 
 }
 
-void TracerParticle::updateMomentum(scalar dt, const Vector & fluidVelocity, const Matrix & shear, const Fluid & fluid)
+void TracerParticle::updateMomentum(scalar dt, const Fluid & fluid, int type, size_t begin, size_t end, 
+	const std::vector<Vector> & fluidVelocity, const std::vector<Vector> & fluidAcceleration, ParticleStore & particles) const
 {
-	this->velocity() = fluidVelocity;
+	for(size_t i = begin; i < end; ++i)
+		if(particles.type()[i] == type && particles.isAlive(i))
+			particles.velocity()[i] = fluidVelocity[i];
 }
 
 // Material particle
 int MaterialParticle::typeId_ = registerParticleTypeToFactory<MaterialParticle>("MaterialParticle");
 
-MaterialParticle::MaterialParticle(const MaterialParticle & rhs)
-: density_(rhs.density_), radius_(rhs.radius_)
-{
-	// Clone particle forces
-	for(auto && particleForce : rhs.particleForces_)
-		particleForces_.emplace_back(std::unique_ptr<ParticleForce>(particleForce->clone()));
-}
-
-MaterialParticle & MaterialParticle::operator=(const MaterialParticle & rhs)
-{
-	if(this != &rhs) {
-		particleForces_.clear();
-		for(auto && particleForce : rhs.particleForces_)
-			particleForces_.emplace_back(std::unique_ptr<ParticleForce>(particleForce->clone()));
-		radius_ = rhs.radius_;
-		density_ = rhs.density_;
-	}
-	return *this;
-}
-
 MaterialParticle * MaterialParticle::clone() const
 { 
 	return new MaterialParticle(*this); 
 }
 
-void MaterialParticle::updateMomentum(scalar dt, const Vector & fluidVelocity, const Matrix & shear, const Fluid & fluid)
+// With the exponential integrator, the drag forces k (u - v) are integrated exactly over the time step with the
+// fluid velocity u and the other forces F held constant: v(dt) = w + (v - w) exp(-dt / tau), with the terminal 
+// velocity w = u + F / k and the response time tau = m / k.
+void MaterialParticle::updateMomentum(scalar dt, const Fluid & fluid, int type, size_t begin, size_t end, 
+	const std::vector<Vector> & fluidVelocity, const std::vector<Vector> & fluidAcceleration, ParticleStore & particles) const
 {
-	// Compute total force
-	Vector totalForce(0, 0, 0);
-	ParticleForceData forceData{fluidVelocity, velocity(), shear, fluid, radius(), density()};
-
-	for(auto && particleForce : particleForces_)
-		totalForce += particleForce->getParticleForce(forceData);
-	
-	this->velocity() += 3. * dt * totalForce / (4. * density_ * radius_ * radius_ * radius_ * M_PI);
+	// The particles of the type are collected in groups, and each force is applied to a whole group
+	const size_t groupSize = 64;
+	size_t indices[groupSize];
+	Vector totalForce[groupSize];
+	ParticleForceBlock block{indices, 0, fluidVelocity.data(), fluidAcceleration.data(), particles, fluid, radius(), density()};
+
+	// The mass includes the added mass, and the drag coefficient the forces integrated implicitly
+	scalar mass = density() * block.particleVolume();
+	scalar dragCoefficient = 0;
+	for(auto && particleForce : particleForces_) {
+		mass += particleForce->addedMass(block);
+		if(integrator() == Integrator::Exponential)
+			dragCoefficient += particleForce->dragCoefficient(block);
+	}
+	const scalar invMass = 1 / mass;
+	const scalar invDragCoefficient = dragCoefficient > 0 ? 1 / dragCoefficient : 0;
+	const scalar decay = std::exp(-dt * dragCoefficient * invMass);
+
+	size_t i = begin;
+	while(i < end) {
+		block.size = 0;
+		for(; i < end && block.size < groupSize; ++i)
+			if(particles.type()[i] == type && particles.isAlive(i))
+				indices[block.size++] = i;
+
+		for(size_t k = 0; k < block.size; ++k)
+			totalForce[k].setZero();
+		for(auto && particleForce : particleForces_)
+			if( ! (dragCoefficient > 0 && particleForce->dragCoefficient(block) > 0))
+				particleForce->addForces(block, totalForce);
+
+		if(dragCoefficient > 0) {
+			for(size_t k = 0; k < block.size; ++k) {
+				const Vector terminalVelocity = fluidVelocity[indices[k]] + invDragCoefficient * totalForce[k];
+				Vector & velocity = particles.velocity()[indices[k]];
+				velocity = terminalVelocity + decay * (velocity - terminalVelocity);
+			}
+		} else {
+			for(size_t k = 0; k < block.size; ++k)
+				particles.velocity()[indices[k]] += dt * invMass * totalForce[k];
+		}
+	}
 }
 
 int MaterialParticle::typeId() const
@@ -102,12 +101,33 @@ int MaterialParticle::typeId() const
 	return typeId_; 
 }
 
+bool MaterialParticle::usesShear() const
+{
+	for(auto && particleForce : particleForces_)
+		if(particleForce->usesShear())
+			return true;
+	return false;
+}
+
 void MaterialParticle::fromJSON(const json & jsonObject)
 {
 	Particle::fromJSON(jsonObject);
 	density() = jsonObject.at("density");
 	radius() = jsonObject.at("radius");
-	particleForces_ = particleForceFactory().createVectorFromJSON(jsonObject.at("forces"));
+
+	if(jsonObject.count("integrator")) {
+		std::string integratorName = jsonObject.at("integrator");
+		if(integratorName == "explicit")
+			integrator() = Integrator::Explicit;
+		else if(integratorName == "exponential")
+			integrator() = Integrator::Exponential;
+		else
+			throw std::runtime_error("Unknown particle integrator: " + integratorName);
+	}
+
+	particleForces_.clear();
+	for(auto && particleForce : particleForceFactory().createVectorFromJSON(jsonObject.at("forces")))
+		particleForces_.emplace_back(std::move(particleForce));
 }
 
 void MaterialParticle::writeBinary(std::ostream & out) const
@@ -120,6 +140,8 @@ void MaterialParticle::writeBinary(std::ostream & out) const
 	write_to_stream<int>(out, particleForces_.size());
 	for(auto && particleForce : particleForces_)
 		particleForce->writeBinary(out);
+
+	write_to_stream<int>(out, (int) integrator_);
 }
 
 void MaterialParticle::readBinary(std::istream & in)
@@ -133,6 +155,10 @@ void MaterialParticle::readBinary(std::istream & in)
 	read_from_stream(in, numberOfParticleForces);
 	for(int i = 0; i < numberOfParticleForces; ++i)
 		particleForces_.emplace_back(particleForceFactory().createFromStream(in));
+
+	int integratorId;
+	read_from_stream(in, integratorId);
+	integrator_ = (Integrator) integratorId;
 }
 
 // No momentum update particle
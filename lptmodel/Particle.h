@@ -8,42 +8,31 @@
 #include <memory>
 #include "DynamicFactory.h"
 #include "ParticleForces.h"
+#include "ParticleStore.h"
 
-/* Particle base class */
+/*
+ * Particle type base class. Describes the properties shared by all particles
+ * of one type and how their momentum is updated. The state of the individual
+ * particles is kept in a ParticleStore.
+ */
 class Particle {
 public:
 	virtual ~Particle() { }
 	virtual Particle * clone() const = 0;
 
-	// Getters and setters
-	GETSET(Vector, position)
-	GETSET(Vector, velocity)
-	GETSET(Matrix, shear)
-	GETSET(scalar, pas)
-	GETSET(scalar, dose)
-	GETSET(scalar, age)
-	GETSET(bool, isAlive)
-	GETSET(int, id)
-	GETSET(int, collisionCount)
-	GETSET(scalar, injectionTime)
-
-	virtual void updateMomentum(scalar dt, const Vector & fluidVelocity, const Matrix & shear, const Fluid & fluid) = 0;
+	/*
+	 * Update the velocity of the alive particles in [begin, end) that are tagged with type
+	 * fluidVelocity: fluid velocity at the particle positions (indexed as the store)
+	 * fluidAcceleration: rate of change of the fluid velocity along the particle paths (indexed as the store)
+	 */
+	virtual void updateMomentum(scalar dt, const Fluid & fluid, int type, size_t begin, size_t end, 
+		const std::vector<Vector> & fluidVelocity, const std::vector<Vector> & fluidAcceleration, ParticleStore & particles) const = 0;
 	virtual int typeId() const = 0;
 	virtual void fromJSON(const json & jsonObject) { }
 	virtual void writeBinary(std::ostream & os) const;
-	virtual void readBinary(std::istream & is);
-
-private:
-	Vector position_{0., 0., 0.};
-	Vector velocity_{0., 0., 0.};
-	int id_{-1};
-	Matrix shear_;
-	scalar pas_{0.};
-	scalar dose_{0.};
-	scalar age_{0.};
-	bool isAlive_{true};
-	int collisionCount_{0};
-	scalar injectionTime_{-1};
+	virtual void readBinary(std::istream & is) { }
+	// Whether updateMomentum reads the shear of the particles, the shear is only interpolated if needed
+	virtual bool usesShear() const { return false; }
 };
 
 /* Particle creation */
@@ -61,7 +50,8 @@ inline int registerParticleTypeToFactory(const std::string & typeName)
 class TracerParticle : public Particle {
 public:
 	TracerParticle * clone() const override;
-	void updateMomentum(scalar dt, const Vector & fluidVelocity, const Matrix & shear, const Fluid & fluid) override;
+	void updateMomentum(scalar dt, const Fluid & fluid, int type, size_t begin, size_t end, 
+		const std::vector<Vector> & fluidVelocity, const std::vector<Vector> & fluidAcceleration, ParticleStore & particles) const override;
 	int typeId() const override { return typeId_; }
 
 private:
@@ -71,33 +61,41 @@ private:
 /* Material particle */
 class MaterialParticle : public Particle {
 public:
-	MaterialParticle() = default;
-	MaterialParticle(const MaterialParticle &);
-	MaterialParticle & operator=(const MaterialParticle &);
+	// Time integration of the velocity
+	enum class Integrator {
+		Explicit,	// Explicit Euler, stable for time steps shorter than twice the particle response time
+		Exponential	// Exact for the drag forces at constant fluid velocity and other forces, stable for any time step
+	};
 
 	GETSET(scalar, density)
 	GETSET(scalar, radius)
+	GETSET(Integrator, integrator)
 
 	MaterialParticle * clone() const override;
-	void updateMomentum(scalar dt, const Vector & fluidVelocity, const Matrix & shear, const Fluid & fluid) override;
+	void updateMomentum(scalar dt, const Fluid & fluid, int type, size_t begin, size_t end, 
+		const std::vector<Vector> & fluidVelocity, const std::vector<Vector> & fluidAcceleration, ParticleStore & particles) const override;
 	int typeId() const override;
 	void fromJSON(const json & jsonObject) override;
 	void writeBinary(std::ostream & out) const override;
 	void readBinary(std::istream & in) override;
+	bool usesShear() const override;
 
 private:
 	static int typeId_;
 
-	std::vector<std::unique_ptr<ParticleForce>> particleForces_;
+	// The forces are shared by the copies of the particle
+	std::vector<std::shared_ptr<const ParticleForce>> particleForces_;
 	scalar density_{1};
 	scalar radius_{1};
+	Integrator integrator_ = Integrator::Explicit;
 };
 
 /* Particle moving with constant velocity (for testing) */
 class NoMomentumUpdateParticle : public Particle {
 public:
 	NoMomentumUpdateParticle * clone() const { return new NoMomentumUpdateParticle(*this); }
-	void updateMomentum(scalar dt, const Vector & fluidVelocity, const Matrix & shear, const Fluid & fluid) { }
+	void updateMomentum(scalar dt, const Fluid & fluid, int type, size_t begin, size_t end, 
+		const std::vector<Vector> & fluidVelocity, const std::vector<Vector> & fluidAcceleration, ParticleStore & particles) const { }
 	virtual int typeId() const { return typeId_; }
 
 private:
@@ -2,6 +2,8 @@
 #include <ostream>
 #include "typedefs.h"
 #include <algorithm>
+#include <stdexcept>
+#include "io.h"
 #include "DynamicFactory.hh"
 
 // Explicit instantiation of the factory
@@ -20,9 +22,70 @@ void ParticleForce::writeBinary(std::ostream & os) const
 }
 
 // StokesDrag
-Vector StokesDrag::getParticleForce(const ParticleForceData & forceData)
+int StokesDrag::typeId_ = registerParticleForceTypeToFactory<StokesDrag>("StokesDrag");
+
+// SaffmanLift
+int SaffmanLift::typeId_ = registerParticleForceTypeToFactory<SaffmanLift>("SaffmanLift");
+
+void SaffmanLift::fromJSON(const json & jsonObject)
 {
-	return 6. * M_PI * forceData.fluid.mu() * forceData.particleRadius * (forceData.fluidVelocity - forceData.particleVelocity);
+	K() = jsonGetOrDefault<scalar>(jsonObject, "K", K());
 }
 
-int StokesDrag::typeId_ = registerParticleForceTypeToFactory<StokesDrag>("StokesDrag");
+void SaffmanLift::writeBinary(std::ostream & os) const
+{
+	ParticleForce::writeBinary(os);
+	write_to_stream(os, K_);
+}
+
+void SaffmanLift::readBinary(std::istream & is)
+{
+	read_from_stream(is, K_);
+}
+
+// PressureGradientForce
+int PressureGradientForce::typeId_ = registerParticleForceTypeToFactory<PressureGradientForce>("PressureGradient");
+
+// AddedMassForce
+int AddedMassForce::typeId_ = registerParticleForceTypeToFactory<AddedMassForce>("AddedMass");
+
+void AddedMassForce::fromJSON(const json & jsonObject)
+{
+	coefficient() = jsonGetOrDefault<scalar>(jsonObject, "coefficient", coefficient());
+	if(coefficient() < 0)
+		throw std::runtime_error("The added mass coefficient must be non-negative");
+}
+
+void AddedMassForce::writeBinary(std::ostream & os) const
+{
+	ParticleForce::writeBinary(os);
+	write_to_stream(os, coefficient_);
+}
+
+void AddedMassForce::readBinary(std::istream & is)
+{
+	read_from_stream(is, coefficient_);
+}
+
+// Gravity
+int Gravity::typeId_ = registerParticleForceTypeToFactory<Gravity>("Gravity");
+
+void Gravity::fromJSON(const json & jsonObject)
+{
+	if(jsonObject.count("g"))
+		g() = jsonObject.at("g").get<Vector>();
+	buoyancy() = jsonGetOrDefault<bool>(jsonObject, "buoyancy", buoyancy());
+}
+
+void Gravity::writeBinary(std::ostream & os) const
+{
+	ParticleForce::writeBinary(os);
+	write_to_stream(os, &g_[0], 3);
+	write_to_stream(os, buoyancy_);
+}
+
+void Gravity::readBinary(std::istream & is)
+{
+	read_from_stream(is, &g_[0], 3);
+	read_from_stream(is, buoyancy_);
+}
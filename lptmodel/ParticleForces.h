@@ -4,23 +4,60 @@
 #include "typedefs.h"
 #include "DynamicFactory.h"
 #include "Fluid.h"
+#include "ParticleStore.h"
 
-struct ParticleForceData {
-	Vector fluidVelocity;
-	Vector particleVelocity;
-	Matrix shear;
-	Fluid fluid;
+/*
+ * Fluid and particle state of a group of particles of one type. The state is read in place from
+ * the arrays of the particle store, particles[k] is the index in the store of the k:th particle.
+ */
+struct ParticleForceBlock {
+	const size_t * particles;
+	size_t size;
+	const Vector * fluidVelocity;		// Indexed as the store
+	const Vector * fluidAcceleration;	// Indexed as the store, the rate of change of the fluid velocity along the particle path
+	const ParticleStore & store;		// The shear is only up to date if a force uses it, see ParticleForce::usesShear
+	const Fluid & fluid;
 	scalar particleRadius;
 	scalar particleDensity;
+
+	scalar particleVolume() const { return 4. / 3. * M_PI * particleRadius * particleRadius * particleRadius; }
 };
 
+/*
+ * Force on a particle. The forces are evaluated for a group of particles at a time, with one virtual
+ * call per force and group. The force objects are not modified after they have been read, and are
+ * shared by all copies of a particle type.
+ */
 struct ParticleForce {
-	virtual Vector getParticleForce(const ParticleForceData & forceData) = 0;
+	virtual ~ParticleForce() { }
+	// Add the force on particle block.particles[k] to force[k], for all particles of the block
+	virtual void addForces(const ParticleForceBlock & block, Vector * force) const = 0;
 	virtual ParticleForce * clone() const = 0;
 	virtual void writeBinary(std::ostream &) const;
 	virtual void readBinary(std::istream &) { };
 	virtual void fromJSON(const json &) { };
 	virtual int typeId() const = 0;
+	// Whether the force depends on the shear of the fluid
+	virtual bool usesShear() const { return false; }
+	// Forces that are linear in the slip velocity, k (u - v), return k. The exponential integrator of
+	// MaterialParticle integrates them exactly instead of calling addForces.
+	virtual scalar dragCoefficient(const ParticleForceBlock &) const { return 0; }
+	// Forces proportional to the particle acceleration, -m dv/dt, return m. The mass is added to the particle mass.
+	virtual scalar addedMass(const ParticleForceBlock &) const { return 0; }
+};
+
+/*
+ * Base class of the forces that are given per particle by Derived::force(block, i), for particle i of the store.
+ * The per particle function is inlined in the loop over the block.
+ */
+template<class Derived>
+struct ParticleForceKernel : public ParticleForce {
+	void addForces(const ParticleForceBlock & block, Vector * force) const override
+	{
+		const Derived & derived = static_cast<const Derived &>(*this);
+		for(size_t k = 0; k < block.size; ++k)
+			force[k] += derived.force(block, block.particles[k]);
+	}
 };
 
 // Particle force factory
@@ -34,14 +71,114 @@ int registerParticleForceTypeToFactory(const std::string & typeName)
 	return particleForceFactory().registerCreator(new NamedSimpleObjectCreator<ParticleForce, DerivedType>(typeName));
 }
 
-class StokesDrag : public ParticleForce {
+class StokesDrag : public ParticleForceKernel<StokesDrag> {
+public:
+	Vector force(const ParticleForceBlock & block, size_t i) const
+	{
+		return dragCoefficient(block) * (block.fluidVelocity[i] - block.store.velocity()[i]);
+	}
+
+	scalar dragCoefficient(const ParticleForceBlock & block) const override { return 6. * M_PI * block.fluid.mu() * block.particleRadius; }
+	int typeId() const override { return typeId_; }
+	StokesDrag * clone() const override { return new StokesDrag(*this); }
+
+private:
+	static int typeId_;
+};
+
+// Shear induced lift in the form of Li and Ahmadi (1992), which generalizes the lift of Saffman (1965) to
+// three dimensional flows through the deformation rate tensor S:
+// F = pi K d^2 / 3 sqrt(rho mu) S (u - v) / (S:S)^(1/4), with d the particle diameter
+class SaffmanLift : public ParticleForceKernel<SaffmanLift> {
+public:
+	Vector force(const ParticleForceBlock & block, size_t i) const
+	{
+		const SymmetricTensor & s = block.store.shear()[i];
+		const scalar squaredNorm = s[0]*s[0] + s[3]*s[3] + s[5]*s[5] + 2*(s[1]*s[1] + s[2]*s[2] + s[4]*s[4]);
+		if( ! (squaredNorm > 0))
+			return Vector::Zero();
+		const scalar diameter = 2 * block.particleRadius;
+		const scalar coefficient = M_PI * K() / 3 * diameter * diameter * std::sqrt(block.fluid.rho() * block.fluid.mu()) / std::sqrt(std::sqrt(squaredNorm));
+		return coefficient * (symmetricTensorToMatrix(s) * (block.fluidVelocity[i] - block.store.velocity()[i]));
+	}
+
+	GETSET(scalar, K)
+
+	bool usesShear() const override { return true; }
+	void fromJSON(const json & jsonObject) override;
+	void writeBinary(std::ostream &) const override;
+	void readBinary(std::istream &) override;
+	int typeId() const override { return typeId_; }
+	SaffmanLift * clone() const override { return new SaffmanLift(*this); }
+
+private:
+	static int typeId_;
+	scalar K_ = 2.594;
+};
+
+// Force of the undisturbed flow (pressure gradient and viscous stress), the fluid mass displaced by the particle 
+// times the fluid acceleration. The acceleration is taken along the particle path, which differs from the 
+// material derivative by (v - u).grad(u). The hydrostatic pressure is assumed to be removed from the flow data,
+// its effect is included in Gravity.
+class PressureGradientForce : public ParticleForceKernel<PressureGradientForce> {
 public:
-	Vector getParticleForce(const ParticleForceData & forceData) override;
+	Vector force(const ParticleForceBlock & block, size_t i) const
+	{
+		return block.fluid.rho() * block.particleVolume() * block.fluidAcceleration[i];
+	}
+
+	int typeId() const override { return typeId_; }
+	PressureGradientForce * clone() const override { return new PressureGradientForce(*this); }
+
+private:
+	static int typeId_;
+};
+
+// Added mass force C m_f (Du/Dt - dv/dt), with m_f the displaced fluid mass. The dv/dt part is integrated 
+// implicitly through the added mass C m_f, addForces only adds C m_f Du/Dt.
+class AddedMassForce : public ParticleForceKernel<AddedMassForce> {
+public:
+	Vector force(const ParticleForceBlock & block, size_t i) const
+	{
+		return addedMass(block) * block.fluidAcceleration[i];
+	}
+
+	GETSET(scalar, coefficient)
+
+	scalar addedMass(const ParticleForceBlock & block) const override { return coefficient() * block.fluid.rho() * block.particleVolume(); }
+	void fromJSON(const json & jsonObject) override;
+	void writeBinary(std::ostream &) const override;
+	void readBinary(std::istream &) override;
+	int typeId() const override { return typeId_; }
+	AddedMassForce * clone() const override { return new AddedMassForce(*this); }
+
+private:
+	static int typeId_;
+	scalar coefficient_ = 0.5;
+};
+
+// Gravity, with the buoyancy of the displaced fluid unless disabled
+class Gravity : public ParticleForceKernel<Gravity> {
+public:
+	Vector force(const ParticleForceBlock & block, size_t) const
+	{
+		const scalar density = buoyancy() ? block.particleDensity - block.fluid.rho() : block.particleDensity;
+		return density * block.particleVolume() * g();
+	}
+
+	GETSET(Vector, g)
+	GETSET(bool, buoyancy)
+
+	void fromJSON(const json & jsonObject) override;
+	void writeBinary(std::ostream &) const override;
+	void readBinary(std::istream &) override;
 	int typeId() const override { return typeId_; }
-	StokesDrag * clone() const { return new StokesDrag(*this); }
+	Gravity * clone() const override { return new Gravity(*this); }
 
 private:
 	static int typeId_;
+	Vector g_{0, 0, -9.81};
+	bool buoyancy_ = true;
 };
 
 #endif /* PARTICLEFORCES_H_ */
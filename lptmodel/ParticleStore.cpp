@@ -0,0 +1,295 @@
+#include "ParticleStore.h"
+#include "io.h"
+#include <algorithm>
+
+void ParticleStore::clear()
+{
+	resize(0);
+}
+
+void ParticleStore::reserve(size_t n)
+{
+	position_.reserve(n);
+	velocity_.reserve(n);
+	fluidVelocity_.reserve(n);
+	shear_.reserve(n);
+	pas_.reserve(n);
+	dose_.reserve(n);
+	age_.reserve(n);
+	injectionTime_.reserve(n);
+	id_.reserve(n);
+	type_.reserve(n);
+	collisionCount_.reserve(n);
+	flags_.reserve(n);
+	for(size_t m = 0; m < extraDose_.size(); ++m) {
+		extraDose_[m].reserve(n);
+		extraPas_[m].reserve(n);
+	}
+	wallDistance_.reserve(n);
+	neighborCache_.reserve(n);
+	neighborCacheNext_.reserve(n);
+}
+
+void ParticleStore::resize(size_t n)
+{
+	position_.resize(n);
+	velocity_.resize(n);
+	fluidVelocity_.resize(n);
+	shear_.resize(n);
+	pas_.resize(n);
+	dose_.resize(n);
+	age_.resize(n);
+	injectionTime_.resize(n);
+	id_.resize(n);
+	type_.resize(n);
+	collisionCount_.resize(n);
+	flags_.resize(n);
+	for(size_t m = 0; m < extraDose_.size(); ++m) {
+		extraDose_[m].resize(n);
+		extraPas_[m].resize(n);
+	}
+	wallDistance_.resize(n);
+	neighborCache_.resize(n);
+	neighborCacheNext_.resize(n);
+}
+
+size_t ParticleStore::add(int id, int type, const Vector & position, scalar injectionTime)
+{
+	position_.push_back(position);
+	velocity_.push_back(Vector::Zero());
+	fluidVelocity_.push_back(Vector::Zero());
+	shear_.push_back(SymmetricTensor::Zero());
+	pas_.push_back(0);
+	dose_.push_back(0);
+	age_.push_back(0);
+	injectionTime_.push_back(injectionTime);
+	id_.push_back(id);
+	type_.push_back(type);
+	collisionCount_.push_back(0);
+	flags_.push_back(Alive);
+	for(size_t m = 0; m < extraDose_.size(); ++m) {
+		extraDose_[m].push_back(0);
+		extraPas_[m].push_back(0);
+	}
+	wallDistance_.push_back(0);
+	neighborCache_.emplace_back();
+	neighborCacheNext_.emplace_back();
+	return size() - 1;
+}
+
+void ParticleStore::removeDead()
+{
+	size_t numberAlive = 0;
+	for(size_t i = 0; i < size(); ++i) {
+		if( ! isAlive(i))
+			continue;
+
+		if(i != numberAlive) {
+			position_[numberAlive] = position_[i];
+			velocity_[numberAlive] = velocity_[i];
+			fluidVelocity_[numberAlive] = fluidVelocity_[i];
+			shear_[numberAlive] = shear_[i];
+			pas_[numberAlive] = pas_[i];
+			dose_[numberAlive] = dose_[i];
+			age_[numberAlive] = age_[i];
+			injectionTime_[numberAlive] = injectionTime_[i];
+			id_[numberAlive] = id_[i];
+			type_[numberAlive] = type_[i];
+			collisionCount_[numberAlive] = collisionCount_[i];
+			flags_[numberAlive] = flags_[i];
+			for(size_t m = 0; m < extraDose_.size(); ++m) {
+				extraDose_[m][numberAlive] = extraDose_[m][i];
+				extraPas_[m][numberAlive] = extraPas_[m][i];
+			}
+			wallDistance_[numberAlive] = wallDistance_[i];
+			neighborCache_[numberAlive] = neighborCache_[i];
+			neighborCacheNext_[numberAlive] = neighborCacheNext_[i];
+		}
+		++numberAlive;
+	}
+	resize(numberAlive);
+}
+
+namespace detail {
+// Spread the lower 10 bits of x to every third bit
+inline uint32_t expandMortonBits(uint32_t x)
+{
+	x = (x | (x << 16)) & 0x030000FF;
+	x = (x | (x << 8)) & 0x0300F00F;
+	x = (x | (x << 4)) & 0x030C30C3;
+	x = (x | (x << 2)) & 0x09249249;
+	return x;
+}
+
+template<class T>
+inline void permute_array(std::vector<T> & v, const std::vector<uint32_t> & order)
+{
+	std::vector<T> permuted(order.size());
+	for(size_t k = 0; k < order.size(); ++k)
+		permuted[k] = v[order[k]];
+	v.swap(permuted);
+}
+}
+
+void ParticleStore::sortSpatially()
+{
+	const size_t n = size();
+	if(n < 2)
+		return;
+
+	// Morton codes of the positions, on a 1024^3 grid over their bounding box
+	Vector lower = position_[0], upper = position_[0];
+	for(const Vector & p : position_) {
+		lower = lower.cwiseMin(p);
+		upper = upper.cwiseMax(p);
+	}
+	Vector scale;
+	for(int d = 0; d < 3; ++d)
+		scale[d] = upper[d] > lower[d] ? 1023.f / (upper[d] - lower[d]) : 0.f;
+
+	mortonCodes_.resize(n);
+	mortonOrder_.resize(n);
+	for(size_t i = 0; i < n; ++i) {
+		const Vector cell = (position_[i] - lower).cwiseProduct(scale);
+		mortonCodes_[i] = (detail::expandMortonBits((uint32_t) cell[0]) << 2) 
+			| (detail::expandMortonBits((uint32_t) cell[1]) << 1) | detail::expandMortonBits((uint32_t) cell[2]);
+		mortonOrder_[i] = i;
+	}
+
+	// Stable LSD radix sort of the 30 bit codes, 3 passes of 10 bits
+	sortBuffer_[0].resize(n);
+	sortBuffer_[1].resize(n);
+	for(int pass = 0; pass < 3; ++pass) {
+		const int shift = 10 * pass;
+		std::vector<uint32_t> offset(1025, 0);
+		for(size_t i = 0; i < n; ++i)
+			++offset[((mortonCodes_[i] >> shift) & 1023) + 1];
+		for(int bucket = 0; bucket < 1024; ++bucket)
+			offset[bucket + 1] += offset[bucket];
+		for(size_t i = 0; i < n; ++i) {
+			const uint32_t k = offset[(mortonCodes_[i] >> shift) & 1023]++;
+			sortBuffer_[0][k] = mortonCodes_[i];
+			sortBuffer_[1][k] = mortonOrder_[i];
+		}
+		mortonCodes_.swap(sortBuffer_[0]);
+		mortonOrder_.swap(sortBuffer_[1]);
+	}
+
+	reorder(mortonOrder_);
+}
+
+void ParticleStore::reorder(const std::vector<uint32_t> & order)
+{
+	detail::permute_array(position_, order);
+	detail::permute_array(velocity_, order);
+	detail::permute_array(fluidVelocity_, order);
+	detail::permute_array(shear_, order);
+	detail::permute_array(pas_, order);
+	detail::permute_array(dose_, order);
+	detail::permute_array(age_, order);
+	detail::permute_array(injectionTime_, order);
+	detail::permute_array(id_, order);
+	detail::permute_array(type_, order);
+	detail::permute_array(collisionCount_, order);
+	detail::permute_array(flags_, order);
+	for(size_t m = 0; m < extraDose_.size(); ++m) {
+		detail::permute_array(extraDose_[m], order);
+		detail::permute_array(extraPas_[m], order);
+	}
+	detail::permute_array(wallDistance_, order);
+	detail::permute_array(neighborCache_, order);
+	detail::permute_array(neighborCacheNext_, order);
+}
+
+namespace detail {
+template<class T>
+inline void write_array_to_stream(std::ostream & out, const std::vector<T> & v)
+{
+	write_to_stream(out, v.data(), v.size());
+}
+
+template<class T>
+inline void read_array_from_stream(std::istream & in, std::vector<T> & v)
+{
+	read_from_stream(in, v.data(), v.size());
+}
+}
+
+void ParticleStore::writeBinary(std::ostream & out) const
+{
+	int numberOfParticles = size();
+	write_to_stream(out, numberOfParticles);
+	detail::write_array_to_stream(out, position_);
+	detail::write_array_to_stream(out, velocity_);
+	detail::write_array_to_stream(out, shear_);
+	detail::write_array_to_stream(out, pas_);
+	detail::write_array_to_stream(out, dose_);
+	detail::write_array_to_stream(out, age_);
+	detail::write_array_to_stream(out, injectionTime_);
+	detail::write_array_to_stream(out, id_);
+	detail::write_array_to_stream(out, type_);
+	detail::write_array_to_stream(out, collisionCount_);
+	detail::write_array_to_stream(out, flags_);
+
+	// The additional activation columns are last, so that checkpoints without them can be read
+	int numberOfExtraColumns = extraDose_.size();
+	write_to_stream(out, numberOfExtraColumns);
+	for(size_t m = 0; m < extraDose_.size(); ++m) {
+		detail::write_array_to_stream(out, extraDose_[m]);
+		detail::write_array_to_stream(out, extraPas_[m]);
+	}
+	detail::write_array_to_stream(out, fluidVelocity_);
+}
+
+void ParticleStore::readBinary(std::istream & in)
+{
+	int numberOfParticles = 0;
+	read_from_stream(in, numberOfParticles);
+	extraDose_.clear();
+	extraPas_.clear();
+	clear();
+	resize(numberOfParticles);
+	detail::read_array_from_stream(in, position_);
+	detail::read_array_from_stream(in, velocity_);
+	detail::read_array_from_stream(in, shear_);
+	detail::read_array_from_stream(in, pas_);
+	detail::read_array_from_stream(in, dose_);
+	detail::read_array_from_stream(in, age_);
+	detail::read_array_from_stream(in, injectionTime_);
+	detail::read_array_from_stream(in, id_);
+	detail::read_array_from_stream(in, type_);
+	detail::read_array_from_stream(in, collisionCount_);
+	detail::read_array_from_stream(in, flags_);
+
+	int numberOfExtraColumns = 0;
+	read_from_stream(in, numberOfExtraColumns);
+	if( ! in.good()) {
+		in.clear();
+		numberOfExtraColumns = 0;
+	}
+	setNumberOfActivationModels(1 + numberOfExtraColumns);
+	for(size_t m = 0; m < extraDose_.size(); ++m) {
+		detail::read_array_from_stream(in, extraDose_[m]);
+		detail::read_array_from_stream(in, extraPas_[m]);
+	}
+
+	// In checkpoints without the fluid velocity, the particles start as newly injected ones
+	detail::read_array_from_stream(in, fluidVelocity_);
+	if( ! in.good()) {
+		in.clear();
+		std::fill(fluidVelocity_.begin(), fluidVelocity_.end(), Vector::Zero());
+		for(unsigned char & flag : flags_)
+			flag &= ~HasFluidVelocity;
+	}
+}
+
+void ParticleStore::setNumberOfActivationModels(int n)
+{
+	const size_t numberOfExtraColumns = std::max(n, 1) - 1;
+	extraDose_.resize(numberOfExtraColumns);
+	extraPas_.resize(numberOfExtraColumns);
+	for(size_t m = 0; m < numberOfExtraColumns; ++m) {
+		extraDose_[m].resize(size(), 0);
+		extraPas_[m].resize(size(), 0);
+	}
+}
@@ -0,0 +1,103 @@
+#ifndef PARTICLESTORE_H_
+#define PARTICLESTORE_H_
+#include <vector>
+#include <cstdint>
+#include <ostream>
+#include <istream>
+#include "typedefs.h"
+#include "macros.h"
+#include "NeighborCache.h"
+
+/*
+ * Structure of arrays holding the state of all particles in the model.
+ * Particle i is described by element i of every array. The type tag is
+ * the index of the injector that created the particle, and selects the
+ * template particle used to update its momentum.
+ */
+class ParticleStore {
+public:
+	enum Flags : unsigned char {
+		Alive = 1,
+		HasFluidVelocity = 2	// fluidVelocity holds the fluid velocity of the previous step
+	};
+
+	size_t size() const { return id_.size(); }
+	bool empty() const { return id_.empty(); }
+	void clear();
+	void reserve(size_t n);
+
+	// Append a particle at rest and return its index
+	size_t add(int id, int type, const Vector & position, scalar injectionTime);
+
+	// Remove all dead particles. The order of the remaining particles is preserved and no memory is released.
+	void removeDead();
+
+	// Reorder the particles along a Morton curve through their positions, so that particles that are
+	// close in space are close in memory. Particle i is moved to the index k with order[k] == i.
+	void sortSpatially();
+
+	bool isAlive(size_t i) const { return flags_[i] & Alive; }
+	void kill(size_t i) { flags_[i] &= ~Alive; }
+
+	// Dose and pas columns of the activation models, column 0 is dose() and pas(), see ActivationModel::numberOfModels.
+	// New columns are zero.
+	int numberOfActivationModels() const { return 1 + extraDose_.size(); }
+	void setNumberOfActivationModels(int n);
+	std::vector<scalar> & activationDose(int model) { return model == 0 ? dose_ : extraDose_[model - 1]; }
+	std::vector<scalar> & activationPas(int model) { return model == 0 ? pas_ : extraPas_[model - 1]; }
+	const std::vector<scalar> & activationDose(int model) const { return model == 0 ? dose_ : extraDose_[model - 1]; }
+	const std::vector<scalar> & activationPas(int model) const { return model == 0 ? pas_ : extraPas_[model - 1]; }
+
+	// The neighbor caches belong to the current and the next interpolator, swap them when the interpolators are swapped
+	void swapNeighborCaches() { std::swap(neighborCache_, neighborCacheNext_); }
+
+	GETSET(std::vector<Vector>, position)
+	GETSET(std::vector<Vector>, velocity)
+	GETSET(std::vector<Vector>, fluidVelocity)	// Fluid velocity at the particle at the last momentum update
+	GETSET(std::vector<SymmetricTensor>, shear)
+	GETSET(std::vector<scalar>, pas)
+	GETSET(std::vector<scalar>, dose)
+	GETSET(std::vector<scalar>, age)
+	GETSET(std::vector<scalar>, injectionTime)
+	GETSET(std::vector<int>, id)
+	GETSET(std::vector<int>, type)
+	GETSET(std::vector<int>, collisionCount)
+	GETSET(std::vector<unsigned char>, flags)
+	GETSET(std::vector<scalar>, wallDistance)
+	GETSET(std::vector<NeighborCache>, neighborCache)
+	GETSET(std::vector<NeighborCache>, neighborCacheNext)
+
+	void writeBinary(std::ostream &) const;
+	void readBinary(std::istream &);
+
+private:
+	void resize(size_t n);
+	void reorder(const std::vector<uint32_t> & order);
+
+	std::vector<Vector> position_{};
+	std::vector<Vector> velocity_{};
+	std::vector<Vector> fluidVelocity_{};
+	std::vector<SymmetricTensor> shear_{};
+	std::vector<scalar> pas_{};
+	std::vector<scalar> dose_{};
+	std::vector<scalar> age_{};
+	std::vector<scalar> injectionTime_{};
+	std::vector<int> id_{};
+	std::vector<int> type_{};
+	std::vector<int> collisionCount_{};
+	std::vector<unsigned char> flags_{};
+	std::vector<std::vector<scalar>> extraDose_{};
+	std::vector<std::vector<scalar>> extraPas_{};
+
+	// Not part of the checkpoint, the caches are refilled on the first interpolation
+	std::vector<scalar> wallDistance_{};	// Lower bound of the distance to the boundaries, see Model::updateParticlePositions
+	std::vector<NeighborCache> neighborCache_{};
+	std::vector<NeighborCache> neighborCacheNext_{};
+
+	// Workspace of sortSpatially
+	std::vector<uint32_t> mortonCodes_{};
+	std::vector<uint32_t> mortonOrder_{};
+	std::vector<uint32_t> sortBuffer_[2];
+};
+
+#endif /* PARTICLESTORE_H_ */
@@ -4,8 +4,11 @@
 #include <iostream>
 #include "io.h"
 #include <stdexcept>
+#include <limits>
+#include <cmath>
+#include <algorithm>
 
-RayTracer::RayTracer() : bvh_(nullptr), objects_()
+RayTracer::RayTracer() : mesh_()
 {
 
 }
@@ -17,11 +20,7 @@ RayTracer::~RayTracer()
 
 void RayTracer::clear()
 {
-	for(std::vector<Object *>::iterator it = objects_.begin(); it != objects_.end(); ++it)
-		delete *it;
-	objects_.clear();
-	if(bvh_)
-		delete bvh_;
+	mesh_.reset();
 }
 
 void RayTracer::fromJSON(const json & j)
@@ -37,81 +36,52 @@ void RayTracer::fromJSON(const json & j)
 		transform.fromJSON(j.at("transform"));
 	coordinateSystem() = transform;
 
-	readSTL(stlFile.c_str());
-}
-
-void RayTracer::readSTL(const char * fname)
-{
-	// Clear
-	clear();
-
-	// Open input file
-	std::ifstream myFile(fname, std::ios::in | std::ios::binary);
-
-	if(!myFile)
-		throw std::runtime_error(stringify("Could not open the stl file ", fname));
-
-	char header_info[80] = "";
-	unsigned long nTriLong = 0;
+	// Search tree parameters
+	if(j.count("bvh")) {
+		const json & bvhObject = j.at("bvh");
+		int leafSize = jsonGetOrDefault<int>(bvhObject, "leafSize", bvhParameters().leafSize);
+		int numberOfBins = jsonGetOrDefault<int>(bvhObject, "bins", bvhParameters().numberOfBins);
+		if(leafSize < 1 || numberOfBins < 2)
+			throw std::runtime_error("The BVH leaf size must be positive and the number of bins at least 2");
+		bvhParameters().leafSize = leafSize;
+		bvhParameters().numberOfBins = numberOfBins;
+
+		if(bvhObject.count("splitMethod")) {
+			std::string splitName = bvhObject.at("splitMethod");
+			if(splitName == "sah")
+				bvhParameters().splitMethod = BVHBuildParameters::SAH;
+			else if(splitName == "midpoint")
+				bvhParameters().splitMethod = BVHBuildParameters::Midpoint;
+			else
+				throw std::runtime_error("Unknown BVH split method: " + splitName);
+		}
 
-	//read 80 byte header
-	if (myFile) {
-		myFile.read (header_info, 80);
-		std::cout << "Reading stl file " << fname << std::endl;
-		std::cout << "  Header: " << header_info << std::endl;
-	} else {
-		std::cerr << "Error reading STL header" << std::endl;
-	}
+		bvhParameters().doublePrecisionFallback = jsonGetOrDefault<bool>(bvhObject, "doublePrecisionFallback", bvhParameters().doublePrecisionFallback);
 
-	//read 4-byte ulong
-	if (myFile) {
-		myFile.read(reinterpret_cast<char * >(&nTriLong), sizeof(unsigned int));
-		std::cout << "  Number of triangles: " << nTriLong << std::endl;
-	} else {
-		std::cerr << "Error reading number of triangles in the STL file" << std::endl;
+		// The BVH is cached in the file <stlFile>.bvhcache
+		useBVHCache() = jsonGetOrDefault<bool>(bvhObject, "cache", useBVHCache());
 	}
 
-	//now read in all the triangles
-	IntersectionInfo info;
-	for(unsigned int i = 0; i < nTriLong; i++){
-		char facet[50];
-		if (myFile) {
-			//read one 50-byte triangle
-			myFile.read(facet, 50);
-
-			//populate each point of the triangle
-			char * ptr = facet;
-			float * data[4];
-			for(unsigned int j = 0; j < 4; ++j) {
-				data[j] = reinterpret_cast<float*>(ptr);
-				ptr += 3*sizeof(float);
-			}
+	// Number of broad phase cells along the longest axis of the mesh, 0 disables the broad phase
+	distanceGridResolution() = jsonGetOrDefault<int>(j, "distanceGridResolution", distanceGridResolution());
+	if(distanceGridResolution() < 0)
+		throw std::runtime_error("The distance grid resolution must be non-negative");
 
-			Vector3 normal(data[0][0], data[0][1], data[0][2]);
-			Vector3 p1(data[1][0], data[1][1], data[1][2]);
-			Vector3 p2(data[2][0], data[2][1], data[2][2]);
-			Vector3 p3(data[3][0], data[3][1], data[3][2]);
+	// Largest deviation, relative to the mesh size, of the chords used to follow the particle paths in a rotating frame
+	relativeSweepTolerance() = jsonGetOrDefault<scalar>(j, "sweepTolerance", relativeSweepTolerance());
+	if( ! (relativeSweepTolerance() > 0))
+		throw std::runtime_error("The sweep tolerance must be positive");
 
-			//add a new triangle to the array
-			Triangle * tri = new Triangle(p1,p2,p3);
-
-			// Reorder indices if the resulting normal points in the wrong direction
-			if((tri->getNormal(info) * normal) < 0) {
-				std::swap(tri->v0, tri->v1);
-			}
-
-			/*std::cout << tri->getNormal(info)[0] << ", " << tri->getNormal(info)[1] << ", " << tri->getNormal(info)[2]
-			           << " : " << normal[0] << ", " << normal[1] << ", " << normal[2] << std::endl;
-			std::cout << objects_.size() << std::endl;
-			std::cout << tri->v0.x << ", " << tri->v0.y << ", " << tri->v0.z << std::endl;
-			std::cout << tri->v1.x << ", " << tri->v1.y << ", " << tri->v1.z << std::endl;
-			std::cout << tri->v2.x << ", " << tri->v2.y << ", " << tri->v2.z << std::endl;*/
-
-			objects_.push_back(tri);
-		}
-	}
+	readSTL(stlFile.c_str());
+}
 
-	bvh_ = new BVH(&objects_);
+void RayTracer::readSTL(const char * fname)
+{
+	TriangleMeshParameters parameters;
+	parameters.bvh = bvhParameters();
+	parameters.distanceGridResolution = distanceGridResolution();
+	parameters.useBVHCache = useBVHCache();
+	mesh_ = TriangleMesh::load(fname, parameters);
 }
 
 void RayTracer::writeSTL(const char * fname, scalar t) const
@@ -124,57 +94,130 @@ void RayTracer::writeSTL(const char * fname, scalar t) const
 	myFile.write(header, 80);
 
 	// Write number of elements
-	unsigned int numTris = objects_.size();
+	unsigned int numTris = mesh_ ? mesh_->size() : 0;
 	write_to_stream(myFile, &numTris, 1);
 
 	// Flags
 	char tmp[2];
 	std::fill(tmp, tmp+2, ' ');
 
+	// Transform the shared vertices once
+	const FrameTransform transform = coordinateSystem_.transformAt(t);
+	std::vector<Vector> vertices;
+	if(mesh_) {
+		vertices = mesh_->vertices();
+		transform.positionsToWorldFrame(vertices.data(), vertices.size(), vertices.data());
+	}
+
 	// Write triangles
 	IntersectionInfo info;
-	Vector normal, v0, v1, v2;
+	Vector normal;
 	for(unsigned int i = 0; i < numTris; ++i) {
 		// Write normal
-		const Triangle * tri = reinterpret_cast<Triangle *>(objects_[i]);
-		Vector3 n = objects_[i]->getNormal(info);
-		coordinateSystem_.normalVectorToWorldFrame(t, Vector(n.x, n.y, n.z), normal);
-		coordinateSystem_.positionToWorldFrame(t, Vector(tri->v0.x, tri->v0.y, tri->v0.z), v0);
-		coordinateSystem_.positionToWorldFrame(t, Vector(tri->v1.x, tri->v1.y, tri->v1.z), v1);
-		coordinateSystem_.positionToWorldFrame(t, Vector(tri->v2.x, tri->v2.y, tri->v2.z), v2);
+		Vector3 n = mesh_->triangle(i).getNormal(info);
+		transform.normalVectorToWorldFrame(Vector(n.x, n.y, n.z), normal);
 		write_to_stream(myFile, &(normal[0]), 3);
-		write_to_stream(myFile, &(v0[0]), 3);
-		write_to_stream(myFile, &(v1[0]), 3);
-		write_to_stream(myFile, &(v2[0]), 3);
+		const uint32_t * index = mesh_->vertexIndices(i);
+		for(int j = 0; j < 3; ++j)
+			write_to_stream(myFile, &(vertices[index[j]][0]), 3);
 		myFile.write(tmp, 2);
 	}
 	myFile.close();
 }
 
-/*
- * p0: ray start point (local frame)
- * p1: ray end point (local frame)
- * info: Info about the intersection (if found)
- */
 bool RayTracer::findRayIntersection(const Vector & p0, const Vector & p1, IntersectionInfo & info) const
 {
-	if( ! bvh_)
-		return false;
+	return mesh_ && mesh_->findRayIntersection(p0, p1, info);
+}
 
-	// Get ray direction
-	Vector dir = p1 - p0;
-	float dist = dir.norm();
-	if(std::abs(dist) < std::numeric_limits<float>::epsilon())
+size_t RayTracer::findSegmentIntersections(const std::vector<Vector> & start, const std::vector<Vector> & end, 
+	std::vector<SegmentIntersection> & output, int numberOfThreads, const scalar * knownWallDistance) const
+{
+	if( ! mesh_) {
+		output.assign(start.size(), SegmentIntersection{false, 0, Vector::Zero(), 0});
+		return start.size();
+	}
+	return mesh_->findSegmentIntersections(start, end, output, numberOfThreads, knownWallDistance, pathTolerance());
+}
+
+scalar RayTracer::pathTolerance() const
+{
+	if( ! mesh_ || coordinateSystem().angularVelocity().squaredNorm() == 0)
+		return 0;
+	return relativeSweepTolerance() * (mesh_->upper() - mesh_->lower()).maxCoeff();
+}
+
+int RayTracer::numberOfSweepSegments(const Vector & start, const Vector & end, scalar dt) const
+{
+	const scalar tolerance = pathTolerance();
+	if( ! (tolerance > 0) || ! (dt > 0))
+		return 1;
+
+	// Largest distance from the rotation axis, the distance to a line is convex along the segment
+	const Vector & angularVelocity = coordinateSystem().angularVelocity();
+	const scalar angularSpeed = angularVelocity.norm();
+	const Vector axis = angularVelocity / angularSpeed;
+	auto axisDistance = [&](const Vector & position) {
+		const Vector r = position - coordinateSystem().offset();
+		return (r - axis.dot(r) * axis).norm();
+	};
+	const scalar radius = std::max(axisDistance(start), axisDistance(end));
+
+	// The acceleration along the path in the local frame is at most w^2 r + 2 w |v| (centripetal and Coriolis terms),
+	// and a chord over a time h deviates at most h^2 / 8 times the acceleration from the path
+	const scalar acceleration = angularSpeed * (angularSpeed * radius + 2 * (end - start).norm() / dt);
+	const scalar numberOfSegments = std::ceil(dt * std::sqrt(acceleration / (8 * tolerance)));
+	return (int) std::min<scalar>(std::max<scalar>(numberOfSegments, 1), maxSweepSegments);
+}
+
+bool RayTracer::findSweptIntersection(const Vector & start, const Vector & end, scalar t0, scalar t1, int numberOfSegments,
+	scalar knownWallDistance, SegmentIntersection & output, scalar & pathLength) const
+{
+	output.hit = false;
+	pathLength = 0;
+	if( ! mesh_)
 		return false;
-	dir /= dist;
 
-	// Check for intersection
-	if(bvh_->getIntersection(Ray(Vector3(p0[0], p0[1], p0[2]), Vector3(dir[0], dir[1], dir[2])), &info, false)) {
-		return info.t > 0 && info.t <= dist;
+	const scalar tolerance = pathTolerance();
+	Vector chordStart, chordEnd;
+	coordinateSystem().positionToLocalFrame(t0, start, chordStart);
+	for(int j = 0; j < numberOfSegments; ++j) {
+		const scalar fraction = (j + 1) / (scalar) numberOfSegments;
+		coordinateSystem().positionToLocalFrame(t0 + fraction * (t1 - t0), start + fraction * (end - start), chordEnd);
+		const scalar length = (chordEnd - chordStart).norm();
+
+		// The chord start is on the path, at most pathLength from the start
+		const scalar bound = std::max(knownWallDistance - pathLength, mesh_->wallDistanceLowerBound(chordStart)) - tolerance;
+		IntersectionInfo info;
+		if( ! (length < bound) && mesh_->findRayIntersection(chordStart, chordEnd, info)) {
+			output.hit = true;
+			output.fraction = (j + info.t / length) / numberOfSegments;
+			output.normal = Vector(info.normal.x, info.normal.y, info.normal.z);
+			output.triangle = info.primitive;
+			pathLength += info.t;
+			return true;
+		}
+		pathLength += length;
+		chordStart = chordEnd;
 	}
 	return false;
 }
 
+scalar RayTracer::wallDistanceLowerBound(const Vector & position) const
+{
+	return mesh_ ? mesh_->wallDistanceLowerBound(position) : std::numeric_limits<scalar>::infinity();
+}
+
+bool RayTracer::closestPoint(const Vector & position, Vector & point, uint32_t & triangle, scalar maxDistance) const
+{
+	return mesh_ && mesh_->closestPoint(position, point, triangle, maxDistance);
+}
+
+scalar RayTracer::wallDistance(const Vector & position, scalar maxDistance) const
+{
+	return mesh_ ? mesh_->wallDistance(position, maxDistance) : maxDistance;
+}
+
 // Naive implementation
 /*bool RayTracer::findRayIntersection(const VectorType & p0, const VectorType & p1, IntersectionInfo & info) const
 {
@@ -1,12 +1,18 @@
 #ifndef RAYTRACER_H_
 #define RAYTRACER_H_
-#include "BVH.h"
-#include "Object.h"
+#include "TriangleMesh.h"
 #include "Quaternion.h"
 #include "CoordinateSystem.h"
 #include "typedefs.h"
 #include "macros.h"
+#include <limits>
+#include <memory>
 
+/*
+ * Boundary made of a triangle mesh placed in the world frame by a coordinate system, which may rotate.
+ * The mesh and its search structures are static and in the local frame of the boundary, and shared with
+ * the other boundaries using the same STL file (see TriangleMesh). Only the transform depends on time.
+ */
 class RayTracer {
 public:
 	RayTracer();
@@ -16,19 +22,61 @@ public:
 
 	GETSET(CoordinateSystem, coordinateSystem)
 	GETSET(bool, shouldWrite)
+	GETSET(BVHBuildParameters, bvhParameters)
+	GETSET(bool, useBVHCache)
+	GETSET(int, distanceGridResolution)
+	GETSET(scalar, relativeSweepTolerance)
+
+	// Most chords used to follow a particle path in a rotating frame
+	static const int maxSweepSegments = 64;
 
 	void readSTL(const char *);
 	void writeSTL(const char *, scalar) const;
 	void fromJSON(const json &);
 
 	void clear();
+	const TriangleMesh & mesh() const { return *mesh_; }
 	bool findRayIntersection(const Vector &, const Vector &, IntersectionInfo &) const;
 
+	// Intersect the segments from start[i] to end[i] (local frame) with the mesh, see TriangleMesh::findSegmentIntersections.
+	// The segments are taken to approximate the particle paths up to the path tolerance.
+	size_t findSegmentIntersections(const std::vector<Vector> & start, const std::vector<Vector> & end, 
+		std::vector<SegmentIntersection> & output, int numberOfThreads = 1, const scalar * knownWallDistance = nullptr) const;
+
+	// Largest distance between a particle path in the local frame and the chords used to test it for intersections.
+	// Zero when the coordinate system does not rotate, as the paths are then straight in the local frame.
+	scalar pathTolerance() const;
+
+	// Number of chords that keep the path of a particle moving with constant velocity from start to end (world frame)
+	// during dt within the path tolerance in the local frame, at most maxSweepSegments
+	int numberOfSweepSegments(const Vector & start, const Vector & end, scalar dt) const;
+
+	// Intersection of the path of a particle moving with constant velocity from start to end (world frame) during [t0, t1]
+	// with the moving mesh. The path in the local frame is followed by numberOfSegments chords at equal time intervals, the
+	// fraction of the output is of the time interval. The chords within knownWallDistance (minus the length of the chords
+	// before) of the mesh are not tested. pathLength is set to the total length of the chords up to the intersection.
+	bool findSweptIntersection(const Vector & start, const Vector & end, scalar t0, scalar t1, int numberOfSegments,
+		scalar knownWallDistance, SegmentIntersection & output, scalar & pathLength) const;
+
+	// Lower bound of the distance from a position (local frame) to the mesh, from the distance grid
+	scalar wallDistanceLowerBound(const Vector & position) const;
+
+	// Closest point of the mesh to a position (local frame), closer than maxDistance. Returns false if there is none.
+	bool closestPoint(const Vector & position, Vector & point, uint32_t & triangle, 
+		scalar maxDistance = std::numeric_limits<scalar>::infinity()) const;
+
+	// Conservative lower bound of the distance from a position (local frame) to the mesh, at most maxDistance.
+	// The distance is exact up to the rounding error of the closest point query.
+	scalar wallDistance(const Vector & position, scalar maxDistance) const;
+
 private:
 	bool shouldWrite_ = false;
+	BVHBuildParameters bvhParameters_{};
+	bool useBVHCache_ = true;	// See TriangleMeshParameters
+	int distanceGridResolution_ = 64;
+	scalar relativeSweepTolerance_ = 1e-3;	// Path tolerance relative to the longest side of the mesh
 	CoordinateSystem coordinateSystem_;
-	BVH * bvh_ = nullptr;
-	std::vector<Object *> objects_{};
+	std::shared_ptr<const TriangleMesh> mesh_{};
 };
 
 #endif /* RAYTRACER_H_ */
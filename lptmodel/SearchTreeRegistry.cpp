@@ -0,0 +1,60 @@
+#include "SearchTreeRegistry.h"
+#include <algorithm>
+
+SearchTreeRegistry & SearchTreeRegistry::instance()
+{
+	static SearchTreeRegistry registry;
+	return registry;
+}
+
+bool SearchTreeRegistry::find(const MeshKey & key, Entry & entry)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	for(const StoredEntry & storedEntry : entries_) {
+		if(storedEntry.key == key) {
+			std::shared_ptr<const FlatKdTree> tree = storedEntry.tree.lock();
+			if(tree) {
+				entry = Entry{storedEntry.key, tree, storedEntry.generation};
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+bool SearchTreeRegistry::findByNumberOfPoints(uint64_t numberOfPoints, Entry & entry)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	for(const StoredEntry & storedEntry : entries_) {
+		if(storedEntry.key.numberOfPoints == numberOfPoints) {
+			std::shared_ptr<const FlatKdTree> tree = storedEntry.tree.lock();
+			if(tree) {
+				entry = Entry{storedEntry.key, tree, storedEntry.generation};
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+SearchTreeRegistry::Entry SearchTreeRegistry::add(const Entry & entry)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	removeExpired();
+	for(const StoredEntry & storedEntry : entries_) {
+		if(storedEntry.key == entry.key) {
+			std::shared_ptr<const FlatKdTree> tree = storedEntry.tree.lock();
+			if(tree)
+				return Entry{storedEntry.key, tree, storedEntry.generation};
+		}
+	}
+
+	entries_.push_back(StoredEntry{entry.key, entry.tree, entry.generation});
+	return entry;
+}
+
+void SearchTreeRegistry::removeExpired()
+{
+	entries_.erase(std::remove_if(entries_.begin(), entries_.end(), 
+		[](const StoredEntry & storedEntry) { return storedEntry.tree.expired(); }), entries_.end());
+}
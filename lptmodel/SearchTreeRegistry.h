@@ -0,0 +1,88 @@
+#ifndef SEARCHTREEREGISTRY_H_
+#define SEARCHTREEREGISTRY_H_
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <cstdint>
+#include <cstddef>
+#include "FlatKdTree.h"
+
+// Identifies a point set by its number of points and a hash of the coordinates
+struct MeshKey {
+	uint64_t numberOfPoints = 0;
+	uint64_t hash = 0;
+
+	bool operator==(const MeshKey & rhs) const { return numberOfPoints == rhs.numberOfPoints && hash == rhs.hash; }
+};
+
+// FNV-1a hash of the point coordinates, in data set order
+class MeshHasher {
+public:
+	void add(float x, float y, float z)
+	{
+		addBytes(x);
+		addBytes(y);
+		addBytes(z);
+		++numberOfPoints_;
+	}
+
+	MeshKey key() const
+	{
+		MeshKey key;
+		key.numberOfPoints = numberOfPoints_;
+		key.hash = hash_;
+		return key;
+	}
+
+private:
+	void addBytes(float value)
+	{
+		const unsigned char * bytes = reinterpret_cast<const unsigned char *>(&value);
+		for(size_t i = 0; i < sizeof(float); ++i) {
+			hash_ ^= bytes[i];
+			hash_ *= 1099511628211ULL;
+		}
+	}
+
+	uint64_t hash_ = 14695981039346656037ULL;
+	uint64_t numberOfPoints_ = 0;
+};
+
+/*
+ * Process wide registry of the search trees in use, so that the interpolators of data sets
+ * with the same mesh share one search tree. The registry does not keep the trees alive, a tree
+ * is released when the last interpolator using it is destroyed or reads another mesh.
+ */
+class SearchTreeRegistry {
+public:
+	struct Entry {
+		MeshKey key;
+		std::shared_ptr<const FlatKdTree> tree;
+		int generation;		// Identifies the tree in the neighbor caches
+	};
+
+	static SearchTreeRegistry & instance();
+
+	// Returns false if no tree with the key is in use
+	bool find(const MeshKey & key, Entry & entry);
+
+	// Find any tree with the given number of points, used when the mesh is declared to be static
+	bool findByNumberOfPoints(uint64_t numberOfPoints, Entry & entry);
+
+	// Register a tree. If a tree with the same key has been registered in the meantime, that tree is returned instead.
+	Entry add(const Entry & entry);
+
+private:
+	struct StoredEntry {
+		MeshKey key;
+		std::weak_ptr<const FlatKdTree> tree;
+		int generation;
+	};
+
+	void removeExpired();
+
+	std::mutex mutex_;
+	std::vector<StoredEntry> entries_{};
+};
+
+#endif /* SEARCHTREEREGISTRY_H_ */
@@ -0,0 +1,101 @@
+#ifndef SIMDMATH_H_
+#define SIMDMATH_H_
+#include <emmintrin.h>
+#include <cstdint>
+#include <cstring>
+
+/*
+ * Single precision exp and log of four values at once, with the polynomial approximations
+ * of the Cephes library (expf, logf). The relative error is within a few ulp of std::exp and
+ * std::log over the range where the result is a normal number.
+ */
+namespace simd {
+
+// Natural logarithm, the arguments must be positive. Subnormal arguments are rounded up to the smallest normal number.
+inline __m128 log4(__m128 x)
+{
+	const __m128 one = _mm_set1_ps(1.f);
+	x = _mm_max_ps(x, _mm_castsi128_ps(_mm_set1_epi32(0x00800000)));
+
+	// x = m * 2^e, with m in [sqrt(1/2), sqrt(2))
+	__m128i exponentBits = _mm_srli_epi32(_mm_castps_si128(x), 23);
+	x = _mm_or_ps(_mm_and_ps(x, _mm_castsi128_ps(_mm_set1_epi32(~0x7f800000))), _mm_set1_ps(0.5f));
+	__m128 e = _mm_add_ps(_mm_cvtepi32_ps(_mm_sub_epi32(exponentBits, _mm_set1_epi32(0x7f))), one);
+	const __m128 small = _mm_cmplt_ps(x, _mm_set1_ps(0.707106781186547524f));
+	e = _mm_sub_ps(e, _mm_and_ps(one, small));
+	x = _mm_add_ps(_mm_sub_ps(x, one), _mm_and_ps(x, small));
+
+	// log(1 + x) = x - x^2/2 + x^3 P(x)
+	const __m128 z = _mm_mul_ps(x, x);
+	__m128 y = _mm_set1_ps(7.0376836292e-2f);
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(-1.1514610310e-1f));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.1676998740e-1f));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(-1.2420140846e-1f));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.4249322787e-1f));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(-1.6668057665e-1f));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(2.0000714765e-1f));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(-2.4999993993e-1f));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(3.3333331174e-1f));
+	y = _mm_mul_ps(_mm_mul_ps(y, x), z);
+
+	// Add e * log(2), with log(2) split in two parts to keep the precision
+	y = _mm_add_ps(y, _mm_mul_ps(e, _mm_set1_ps(-2.12194440e-4f)));
+	y = _mm_sub_ps(y, _mm_mul_ps(z, _mm_set1_ps(0.5f)));
+	x = _mm_add_ps(x, y);
+	return _mm_add_ps(x, _mm_mul_ps(e, _mm_set1_ps(0.693359375f)));
+}
+
+// Exponential, the arguments are clamped to [-87.3, 88.3] so that the result is a finite normal number
+inline __m128 exp4(__m128 x)
+{
+	const __m128 one = _mm_set1_ps(1.f);
+	x = _mm_min_ps(x, _mm_set1_ps(88.3762626647949f));
+	x = _mm_max_ps(x, _mm_set1_ps(-87.3365447505531f));
+
+	// exp(x) = 2^n exp(r), with n = floor(x / log(2) + 1/2)
+	__m128 n = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(1.44269504088896341f)), _mm_set1_ps(0.5f));
+	const __m128 truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(n));
+	n = _mm_sub_ps(truncated, _mm_and_ps(_mm_cmpgt_ps(truncated, n), one));
+	x = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(0.693359375f)));
+	x = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(-2.12194440e-4f)));
+
+	// exp(r) = 1 + r + r^2 P(r)
+	const __m128 z = _mm_mul_ps(x, x);
+	__m128 y = _mm_set1_ps(1.9875691500e-4f);
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.3981999507e-3f));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(8.3334519073e-3f));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(4.1665795894e-2f));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.6666665459e-1f));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(5.0000001201e-1f));
+	y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(y, z), x), one);
+
+	// Scale by 2^n
+	const __m128i pow2n = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(n), _mm_set1_epi32(0x7f)), 23);
+	return _mm_mul_ps(y, _mm_castsi128_ps(pow2n));
+}
+
+// x^p for positive x
+inline __m128 pow4(__m128 x, __m128 p)
+{
+	return exp4(_mm_mul_ps(p, log4(x)));
+}
+
+// Mask of the lanes with a nonzero byte among four bytes
+inline __m128 mask4(const unsigned char * bytes)
+{
+	int32_t packed;
+	std::memcpy(&packed, bytes, sizeof(packed));
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i words = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+	return _mm_castsi128_ps(_mm_cmpgt_epi32(words, zero));
+}
+
+// Lanes of a where mask is set, of b elsewhere
+inline __m128 select4(__m128 mask, __m128 a, __m128 b)
+{
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+}
+
+#endif /* SIMDMATH_H_ */
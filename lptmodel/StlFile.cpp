@@ -0,0 +1,247 @@
+#include "StlFile.h"
+#include "CacheFile.h"
+#include "io.h"
+#include <unordered_map>
+#include <stdexcept>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+
+namespace {
+	// Merges the vertices with bitwise equal coordinates
+	class VertexWelder {
+	public:
+		VertexWelder(std::vector<Vector> & vertices, size_t expectedNumberOfVertices)
+		: vertices_(vertices)
+		{
+			indices_.reserve(expectedNumberOfVertices);
+		}
+
+		uint32_t add(float x, float y, float z)
+		{
+			// Adding zero maps -0 to +0
+			x += 0.f; y += 0.f; z += 0.f;
+			Key key;
+			std::memcpy(&key.bits[0], &x, sizeof(float));
+			std::memcpy(&key.bits[1], &y, sizeof(float));
+			std::memcpy(&key.bits[2], &z, sizeof(float));
+
+			auto inserted = indices_.emplace(key, (uint32_t) vertices_.size());
+			if(inserted.second)
+				vertices_.push_back(Vector(x, y, z));
+			return inserted.first->second;
+		}
+
+	private:
+		struct Key {
+			uint32_t bits[3];
+			bool operator==(const Key & rhs) const { return bits[0] == rhs.bits[0] && bits[1] == rhs.bits[1] && bits[2] == rhs.bits[2]; }
+		};
+
+		struct KeyHash {
+			size_t operator()(const Key & key) const
+			{
+				uint64_t h = key.bits[0];
+				h = h * 0x9E3779B97F4A7C15ull ^ key.bits[1];
+				h = h * 0x9E3779B97F4A7C15ull ^ key.bits[2];
+				return (size_t) (h ^ (h >> 29));
+			}
+		};
+
+		std::vector<Vector> & vertices_;
+		std::unordered_map<Key, uint32_t, KeyHash> indices_;
+	};
+
+	const size_t binaryHeaderSize = 80;
+	const size_t binaryFacetSize = 50;
+
+	void parseBinaryStl(const char * data, size_t size, uint32_t numberOfFacets, StlMesh & mesh)
+	{
+		if(size < binaryHeaderSize + sizeof(uint32_t) || (size - binaryHeaderSize - sizeof(uint32_t)) / binaryFacetSize < numberOfFacets)
+			throw std::runtime_error("Malformed stl file: truncated binary data");
+
+		mesh.header.assign(data, strnlen(data, binaryHeaderSize));
+		mesh.normals.resize(numberOfFacets);
+		mesh.indices.resize(3 * (size_t) numberOfFacets);
+		mesh.vertices.reserve(numberOfFacets / 2 + 3);
+		VertexWelder welder(mesh.vertices, numberOfFacets / 2 + 3);
+
+		// Each facet is a normal and three vertices as floats, followed by a two byte attribute.
+		// The facets are not aligned, so the floats are copied out.
+		const char * facet = data + binaryHeaderSize + sizeof(uint32_t);
+		for(uint32_t f = 0; f < numberOfFacets; ++f, facet += binaryFacetSize) {
+			float values[12];
+			std::memcpy(values, facet, sizeof(values));
+			mesh.normals[f] = Vector(values[0], values[1], values[2]);
+			for(int i = 0; i < 3; ++i)
+				mesh.indices[3*f + i] = welder.add(values[3 + 3*i], values[4 + 3*i], values[5 + 3*i]);
+		}
+	}
+
+	// Tokenizer of an ASCII STL file, the data is not null terminated
+	class AsciiReader {
+	public:
+		AsciiReader(const char * data, size_t size) : current_(data), end_(data + size) { }
+
+		bool atEnd()
+		{
+			skipWhitespace();
+			return current_ == end_;
+		}
+
+		// Next whitespace separated word
+		std::string word()
+		{
+			skipWhitespace();
+			const char * begin = current_;
+			while(current_ != end_ && ! std::isspace((unsigned char) *current_))
+				++current_;
+			return std::string(begin, current_);
+		}
+
+		// Rest of the current line, without surrounding whitespace
+		std::string line()
+		{
+			while(current_ != end_ && (*current_ == ' ' || *current_ == '\t'))
+				++current_;
+			const char * begin = current_;
+			while(current_ != end_ && *current_ != '\n' && *current_ != '\r')
+				++current_;
+			const char * last = current_;
+			while(last != begin && std::isspace((unsigned char) last[-1]))
+				--last;
+			return std::string(begin, last);
+		}
+
+		void expect(const char * keyword)
+		{
+			const std::string w = word();
+			if(w != keyword)
+				throw std::runtime_error(stringify("Malformed ASCII stl file: expected '", keyword, "', found '", w, "'"));
+		}
+
+		float number()
+		{
+			skipWhitespace();
+			char buffer[64];
+			size_t length = 0;
+			while(current_ != end_ && ! std::isspace((unsigned char) *current_) && length < sizeof(buffer) - 1)
+				buffer[length++] = *current_++;
+			buffer[length] = '\0';
+
+			char * parsedEnd;
+			const float value = std::strtof(buffer, &parsedEnd);
+			if(length == 0 || parsedEnd != buffer + length)
+				throw std::runtime_error(stringify("Malformed ASCII stl file: invalid number '", buffer, "'"));
+			return value;
+		}
+
+	private:
+		void skipWhitespace()
+		{
+			while(current_ != end_ && std::isspace((unsigned char) *current_))
+				++current_;
+		}
+
+		const char * current_;
+		const char * end_;
+	};
+
+	void parseAsciiStl(const char * data, size_t size, StlMesh & mesh)
+	{
+		// A binary file starting with "solid" but with the wrong size ends up here
+		if(std::memchr(data, '\0', size))
+			throw std::runtime_error("Malformed stl file: binary data with an inconsistent facet count");
+
+		// About 250 bytes per facet
+		const size_t expectedNumberOfFacets = size / 250 + 1;
+		mesh.normals.reserve(expectedNumberOfFacets);
+		mesh.indices.reserve(3 * expectedNumberOfFacets);
+		mesh.vertices.reserve(expectedNumberOfFacets / 2 + 3);
+		VertexWelder welder(mesh.vertices, expectedNumberOfFacets / 2 + 3);
+
+		AsciiReader reader(data, size);
+		reader.expect("solid");
+		mesh.header = reader.line();
+
+		// Files concatenated from several solids are accepted
+		while( ! reader.atEnd()) {
+			const std::string keyword = reader.word();
+			if(keyword == "endsolid") {
+				reader.line();
+				if( ! reader.atEnd())
+					reader.expect("solid");
+				reader.line();
+				continue;
+			}
+			if(keyword != "facet")
+				throw std::runtime_error(stringify("Malformed ASCII stl file: expected 'facet', found '", keyword, "'"));
+
+			reader.expect("normal");
+			const float nx = reader.number(), ny = reader.number(), nz = reader.number();
+			mesh.normals.push_back(Vector(nx, ny, nz));
+
+			reader.expect("outer");
+			reader.expect("loop");
+			for(int i = 0; i < 3; ++i) {
+				reader.expect("vertex");
+				const float x = reader.number(), y = reader.number(), z = reader.number();
+				mesh.indices.push_back(welder.add(x, y, z));
+			}
+			reader.expect("endloop");
+			reader.expect("endfacet");
+		}
+	}
+}
+
+void parseStl(const char * data, size_t size, StlMesh & mesh)
+{
+	mesh = StlMesh();
+
+	// A binary file has exactly the size given by its facet count. Some binary files start with
+	// "solid" as well, so the size is checked first.
+	uint32_t numberOfFacets = 0;
+	const size_t headerSize = binaryHeaderSize + sizeof(uint32_t);
+	if(size >= headerSize)
+		std::memcpy(&numberOfFacets, data + binaryHeaderSize, sizeof(uint32_t));
+	const bool binarySizeMatches = size >= headerSize && (size - headerSize) / binaryFacetSize >= numberOfFacets;
+
+	const char * first = data;
+	while(first != data + size && std::isspace((unsigned char) *first))
+		++first;
+	const bool startsWithSolid = (size_t) (data + size - first) >= 5 && std::strncmp(first, "solid", 5) == 0;
+
+	if(binarySizeMatches && ( ! startsWithSolid || size - headerSize == (size_t) numberOfFacets * binaryFacetSize))
+		parseBinaryStl(data, size, numberOfFacets, mesh);
+	else if(startsWithSolid)
+		parseAsciiStl(data, size, mesh);
+	else
+		throw std::runtime_error("Malformed stl file: truncated binary data");
+}
+
+// FNV-1a hash, taken over 64-bit words to keep up with the parsing
+uint64_t hashStlContents(const char * data, size_t size)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	size_t i = 0;
+	for(; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+		uint64_t word;
+		std::memcpy(&word, data + i, sizeof(uint64_t));
+		hash ^= word;
+		hash *= 1099511628211ULL;
+	}
+	for(; i < size; ++i) {
+		hash ^= (unsigned char) data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+void readStlFile(const std::string & fileName, StlMesh & mesh)
+{
+	MappedFile file;
+	if( ! file.open(fileName))
+		throw std::runtime_error(stringify("Could not open the stl file ", fileName));
+	parseStl(file.data(), file.size(), mesh);
+	mesh.contentHash = hashStlContents(file.data(), file.size());
+}
@@ -0,0 +1,33 @@
+#ifndef STLFILE_H_
+#define STLFILE_H_
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include "typedefs.h"
+
+/*
+ * Indexed triangle mesh read from an STL file. The vertices shared between facets are
+ * stored once, vertex i of facet f is vertices[indices[3*f + i]].
+ */
+struct StlMesh {
+	std::string header{};			// Binary header or ASCII solid name
+	std::vector<Vector> vertices{};
+	std::vector<uint32_t> indices{};	// Three vertex indices per facet
+	std::vector<Vector> normals{};		// Facet normals as given in the file, may be zero
+	uint64_t contentHash = 0;		// Hash of the file contents, identifies the file in caches
+
+	size_t numberOfFacets() const { return normals.size(); }
+};
+
+// Reads a binary or ASCII STL file. The file is memory mapped and parsed in one pass.
+// Throws std::runtime_error if the file cannot be opened or is malformed.
+void readStlFile(const std::string & fileName, StlMesh & mesh);
+
+// Parses the contents of an STL file
+void parseStl(const char * data, size_t size, StlMesh & mesh);
+
+// Hash of the contents of an STL file
+uint64_t hashStlContents(const char * data, size_t size);
+
+#endif /* STLFILE_H_ */
@@ -0,0 +1,47 @@
+#ifndef STRESSMETRIC_H_
+#define STRESSMETRIC_H_
+#include <cmath>
+#include <algorithm>
+#include "typedefs.h"
+
+/*
+ * Scalar measures of the viscous stress tau = 2 mu S of a Newtonian fluid, with S the shear rate
+ * (strain rate) tensor. The metrics are evaluated from the six components of S, and are returned per
+ * unit viscosity (as an equivalent shear rate), the scalar stress is mu times the returned value.
+ * S' denotes the deviatoric part of S, which only differs from S by the numerical divergence of the flow.
+ */
+enum class StressMetric {
+	Frobenius,	// sqrt(tau:tau / 2) = sqrt(2) mu |S|
+	VonMises,	// von Mises stress sqrt(3/2 tau':tau') = sqrt(6) mu |S'|
+	Bludszuweit,	// Bludszuweit's scalar stress, the von Mises stress scaled to pure shear, sqrt(2) mu |S'|
+	Principal	// Largest principal shear stress (tau_1 - tau_3) / 2 = mu (s_1 - s_3)
+};
+
+inline scalar equivalentShearRate(StressMetric metric, const SymmetricTensor & s)
+{
+	if(metric == StressMetric::Frobenius)
+		return std::sqrt(2.f) * symmetricTensorNorm(s);
+
+	// Deviatoric part, in double precision as the diagonal may be dominated by the trace
+	const double trace = ((double) s[0] + s[3] + s[5]) / 3;
+	const double d0 = s[0] - trace, d3 = s[3] - trace, d5 = s[5] - trace;
+	const double offDiagonal = (double) s[1]*s[1] + (double) s[2]*s[2] + (double) s[4]*s[4];
+	const double squaredNorm = d0*d0 + d3*d3 + d5*d5 + 2*offDiagonal;
+	if(metric == StressMetric::VonMises)
+		return (scalar) std::sqrt(6 * squaredNorm);
+	if(metric == StressMetric::Bludszuweit)
+		return (scalar) std::sqrt(2 * squaredNorm);
+
+	// Eigenvalues of the deviator d = q + 2 p cos(phi + 2 pi k / 3), with cos(3 phi) = det(d / p) / 2 (Smith, 1961).
+	// The difference of the largest and smallest is 2 sqrt(3) p sin(phi + pi / 3).
+	const double p = std::sqrt(squaredNorm / 6);
+	if( ! (p > 0))
+		return 0;
+	const double determinant = d0 * (d3*d5 - (double) s[4]*s[4]) - s[1] * ((double) s[1]*d5 - (double) s[4]*s[2])
+		+ s[2] * ((double) s[1]*s[4] - d3*s[2]);
+	const double r = std::max(-1.0, std::min(1.0, determinant / (2 * p*p*p)));
+	const double phi = std::acos(r) / 3;
+	return (scalar) (2 * std::sqrt(3.0) * p * std::sin(phi + M_PI / 3));
+}
+
+#endif /* STRESSMETRIC_H_ */
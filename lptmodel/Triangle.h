@@ -2,6 +2,7 @@
 #define Triangle_h_
 
 #include <cmath>
+#include <Eigen/Dense>
 #include "Object.h"
 #include <limits>
 
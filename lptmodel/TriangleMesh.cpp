@@ -0,0 +1,376 @@
+#include "TriangleMesh.h"
+#include <fstream>
+#include <iostream>
+#include "io.h"
+#include "StlFile.h"
+#include "CacheFile.h"
+#include <stdexcept>
+#include <limits>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <algorithm>
+
+namespace {
+	// Meshes in use, the registry does not keep them alive
+	struct LoadedMesh {
+		std::string fileName;
+		TriangleMeshParameters parameters;
+		std::weak_ptr<const TriangleMesh> mesh;
+	};
+	std::mutex loadedMeshesMutex;
+	std::vector<LoadedMesh> loadedMeshes;
+}
+
+std::shared_ptr<const TriangleMesh> TriangleMesh::load(const std::string & fileName, const TriangleMeshParameters & parameters)
+{
+	std::lock_guard<std::mutex> lock(loadedMeshesMutex);
+	loadedMeshes.erase(std::remove_if(loadedMeshes.begin(), loadedMeshes.end(), 
+		[](const LoadedMesh & loaded) { return loaded.mesh.expired(); }), loadedMeshes.end());
+	for(const LoadedMesh & loaded : loadedMeshes) {
+		if(loaded.fileName == fileName && loaded.parameters == parameters) {
+			std::shared_ptr<const TriangleMesh> mesh = loaded.mesh.lock();
+			if(mesh) {
+				std::cout << "Reusing the mesh of the stl file " << fileName << std::endl;
+				return mesh;
+			}
+		}
+	}
+
+	auto mesh = std::make_shared<TriangleMesh>();
+	mesh->readSTL(fileName.c_str(), parameters);
+	loadedMeshes.push_back(LoadedMesh{fileName, parameters, mesh});
+	return mesh;
+}
+
+TriangleMesh::~TriangleMesh()
+{
+	clear();
+}
+
+void TriangleMesh::clear()
+{
+	objects_.clear();
+	triangles_.clear();
+	vertices_.clear();
+	vertexIndices_.clear();
+	gridDistance_.clear();
+	gridCellSize_ = 0;
+	if(bvh_)
+		delete bvh_;
+	bvh_ = nullptr;
+}
+
+void TriangleMesh::readSTL(const char * fname, const TriangleMeshParameters & parameters)
+{
+	// Clear
+	clear();
+
+	std::cout << "Reading stl file " << fname << std::endl;
+	StlMesh stl;
+	readStlFile(fname, stl);
+	std::cout << "  Header: " << stl.header << std::endl;
+	std::cout << "  Number of triangles: " << stl.numberOfFacets() << ", vertices: " << stl.vertices.size() << std::endl;
+
+	// Reorder the vertices of the triangles whose normal points in the wrong direction
+	const size_t numberOfTriangles = stl.numberOfFacets();
+	triangles_.reserve(numberOfTriangles);
+	for(size_t i = 0; i < numberOfTriangles; ++i) {
+		uint32_t * index = &stl.indices[3*i];
+		auto vertex = [&stl](uint32_t j) { return Vector3(stl.vertices[j][0], stl.vertices[j][1], stl.vertices[j][2]); };
+		Triangle tri(vertex(index[0]), vertex(index[1]), vertex(index[2]));
+		if(stl.normals[i].dot((stl.vertices[index[1]] - stl.vertices[index[0]]).cross(stl.vertices[index[2]] - stl.vertices[index[0]])) < 0) {
+			std::swap(tri.v0, tri.v1);
+			std::swap(index[0], index[1]);
+		}
+		triangles_.push_back(tri);
+	}
+
+	// The triangles are stored by value, the BVH sorts the pointers
+	objects_.reserve(triangles_.size());
+	for(Triangle & tri : triangles_)
+		objects_.push_back(&tri);
+
+	// The BVH is read from the cache file of the STL file when it matches the file and the build parameters
+	const std::string cacheFileName = std::string(fname) + ".bvhcache";
+	if( ! parameters.useBVHCache || ! readBVHCache(cacheFileName, stl.contentHash, parameters.bvh)) {
+		bvh_ = new BVH(&objects_, parameters.bvh);
+		if(parameters.useBVHCache)
+			writeBVHCache(cacheFileName, stl.contentHash, parameters.bvh);
+	}
+
+	// Vertex indices in BVH order
+	vertices_ = std::move(stl.vertices);
+	vertexIndices_.resize(3 * numberOfTriangles);
+	for(size_t i = 0; i < numberOfTriangles; ++i) {
+		const size_t j = static_cast<const Triangle *>(objects_[i]) - triangles_.data();
+		std::copy(&stl.indices[3*j], &stl.indices[3*j] + 3, &vertexIndices_[3*i]);
+	}
+
+	buildDistanceGrid(parameters.distanceGridResolution);
+}
+
+// BVH cache file, see CacheFile.h. Holds the BVH sections, the order of the triangles in the BVH
+// and the key of the STL contents and the build parameters.
+namespace {
+	const uint32_t bvhKeySection = 16;
+	const uint32_t bvhPermutationSection = 17;
+
+	struct BVHCacheKey {
+		uint64_t stlHash;
+		uint64_t numberOfTriangles;
+		uint32_t leafSize;
+		uint32_t numberOfBins;
+		uint32_t splitMethod;
+		uint32_t padding;
+	};
+
+	BVHCacheKey bvhCacheKey(uint64_t stlHash, uint64_t numberOfTriangles, const BVHBuildParameters & parameters)
+	{
+		BVHCacheKey key;
+		std::memset(&key, 0, sizeof(key));
+		key.stlHash = stlHash;
+		key.numberOfTriangles = numberOfTriangles;
+		key.leafSize = parameters.leafSize;
+		key.numberOfBins = parameters.numberOfBins;
+		key.splitMethod = parameters.splitMethod;
+		return key;
+	}
+}
+
+bool TriangleMesh::readBVHCache(const std::string & fileName, uint64_t stlHash, const BVHBuildParameters & parameters)
+{
+	std::shared_ptr<CacheFileReader> reader = std::make_shared<CacheFileReader>();
+	if( ! reader->open(fileName) || ! reader->hasSection(bvhKeySection) || ! reader->hasSection(bvhPermutationSection))
+		return false;
+
+	try {
+		size_t count;
+		const BVHCacheKey * key = reader->array<BVHCacheKey>(bvhKeySection, count);
+		const BVHCacheKey expectedKey = bvhCacheKey(stlHash, triangles_.size(), parameters);
+		if(count != 1 || std::memcmp(key, &expectedKey, sizeof(BVHCacheKey)) != 0)
+			return false;
+
+		const uint32_t * permutation = reader->array<uint32_t>(bvhPermutationSection, count);
+		if(count != triangles_.size())
+			return false;
+		std::vector<bool> used(triangles_.size(), false);
+		for(size_t i = 0; i < count; ++i) {
+			if(permutation[i] >= count || used[permutation[i]])
+				return false;
+			used[permutation[i]] = true;
+		}
+
+		// Put the triangles in BVH order before the tree is used
+		for(size_t i = 0; i < count; ++i)
+			objects_[i] = &triangles_[permutation[i]];
+		bvh_ = BVH::fromCache(&objects_, parameters, reader);
+	} catch(const std::runtime_error &) {
+		bvh_ = nullptr;
+	}
+
+	if( ! bvh_) {
+		for(size_t i = 0; i < triangles_.size(); ++i)
+			objects_[i] = &triangles_[i];
+		return false;
+	}
+	std::cout << "  Read BVH cache " << fileName << std::endl;
+	return true;
+}
+
+void TriangleMesh::writeBVHCache(const std::string & fileName, uint64_t stlHash, const BVHBuildParameters & parameters) const
+{
+	const BVHCacheKey key = bvhCacheKey(stlHash, triangles_.size(), parameters);
+	std::vector<uint32_t> permutation(objects_.size());
+	for(size_t i = 0; i < objects_.size(); ++i)
+		permutation[i] = static_cast<const Triangle *>(objects_[i]) - triangles_.data();
+
+	CacheFileWriter writer;
+	bvh_->addSections(writer);
+	writer.addArray(bvhKeySection, &key, 1);
+	writer.addArray(bvhPermutationSection, permutation.data(), permutation.size());
+	if( ! writer.write(fileName))
+		std::cerr << "  Could not write the BVH cache " << fileName << std::endl;
+}
+
+void TriangleMesh::buildDistanceGrid(int resolution)
+{
+	gridDistance_.clear();
+	gridCellSize_ = 0;
+	if(triangles_.empty())
+		return;
+
+	meshLower_ = meshUpper_ = Vector(triangles_[0].v0.x, triangles_[0].v0.y, triangles_[0].v0.z);
+	for(const Triangle & tri : triangles_) {
+		for(const Vector3 * v : {&tri.v0, &tri.v1, &tri.v2}) {
+			const Vector p(v->x, v->y, v->z);
+			meshLower_ = meshLower_.cwiseMin(p);
+			meshUpper_ = meshUpper_.cwiseMax(p);
+		}
+	}
+	meshEpsilon_ = 1e-5f * (meshUpper_ - meshLower_).maxCoeff();
+	if(resolution == 0)
+		return;
+
+	// Cubic cells, with one layer of cells outside the mesh bounding box
+	const scalar longestSide = (meshUpper_ - meshLower_).maxCoeff();
+	if( ! (longestSide > 0))
+		return;
+	gridCellSize_ = longestSide / resolution;
+	gridOrigin_ = meshLower_ - Vector::Constant(gridCellSize_);
+	for(int d = 0; d < 3; ++d)
+		gridSize_[d] = (int) std::ceil((meshUpper_[d] - meshLower_[d]) / gridCellSize_) + 2;
+	const size_t numberOfCells = (size_t) gridSize_[0] * gridSize_[1] * gridSize_[2];
+	auto cellIndex = [this](int i, int j, int k) { return ((size_t) k * gridSize_[1] + j) * gridSize_[0] + i; };
+
+	// Mark the cells overlapped by the triangle bounding boxes
+	const uint16_t unvisited = std::numeric_limits<uint16_t>::max();
+	gridDistance_.assign(numberOfCells, unvisited);
+	std::deque<size_t> queue;
+	for(const Triangle & tri : triangles_) {
+		int first[3], last[3];
+		for(int d = 0; d < 3; ++d) {
+			const scalar lower = std::min(tri.v0[d], std::min(tri.v1[d], tri.v2[d]));
+			const scalar upper = std::max(tri.v0[d], std::max(tri.v1[d], tri.v2[d]));
+			first[d] = std::max(0, (int) std::floor((lower - gridOrigin_[d]) / gridCellSize_));
+			last[d] = std::min(gridSize_[d] - 1, (int) std::floor((upper - gridOrigin_[d]) / gridCellSize_));
+		}
+		for(int k = first[2]; k <= last[2]; ++k)
+			for(int j = first[1]; j <= last[1]; ++j)
+				for(int i = first[0]; i <= last[0]; ++i) {
+					const size_t cell = cellIndex(i, j, k);
+					if(gridDistance_[cell] != 0) {
+						gridDistance_[cell] = 0;
+						queue.push_back(cell);
+					}
+				}
+	}
+
+	// Breadth first search from the occupied cells through the 26 neighbors of each cell gives the Chebyshev distance
+	while( ! queue.empty()) {
+		const size_t cell = queue.front();
+		queue.pop_front();
+		const int i = cell % gridSize_[0];
+		const int j = (cell / gridSize_[0]) % gridSize_[1];
+		const int k = cell / ((size_t) gridSize_[0] * gridSize_[1]);
+		const uint16_t distance = gridDistance_[cell] + 1;
+		for(int dk = std::max(0, k-1); dk <= std::min(gridSize_[2]-1, k+1); ++dk)
+			for(int dj = std::max(0, j-1); dj <= std::min(gridSize_[1]-1, j+1); ++dj)
+				for(int di = std::max(0, i-1); di <= std::min(gridSize_[0]-1, i+1); ++di) {
+					const size_t neighbor = cellIndex(di, dj, dk);
+					if(gridDistance_[neighbor] == unvisited) {
+						gridDistance_[neighbor] = distance;
+						queue.push_back(neighbor);
+					}
+				}
+	}
+
+	std::cout << "  Distance grid: " << gridSize_[0] << " x " << gridSize_[1] << " x " << gridSize_[2] 
+		<< " cells of size " << gridCellSize_ << std::endl;
+}
+
+scalar TriangleMesh::wallDistanceLowerBound(const Vector & position) const
+{
+	if(triangles_.empty())
+		return std::numeric_limits<scalar>::infinity();
+
+	// Outside the mesh bounding box, the distance to the box
+	const Vector outside = (meshLower_ - position).cwiseMax(position - meshUpper_).cwiseMax(Vector::Zero());
+	const scalar boxDistance = outside.norm();
+	if(gridDistance_.empty() || boxDistance > 0)
+		return boxDistance;
+
+	// A point in a cell at Chebyshev distance n cells from the nearest occupied cell is at least
+	// n - 1 cell sizes from any point of the occupied cells
+	int cell[3];
+	for(int d = 0; d < 3; ++d)
+		cell[d] = std::min(gridSize_[d] - 1, std::max(0, (int) ((position[d] - gridOrigin_[d]) / gridCellSize_)));
+	const uint16_t distance = gridDistance_[((size_t) cell[2] * gridSize_[1] + cell[1]) * gridSize_[0] + cell[0]];
+	return distance > 1 ? (distance - 1) * gridCellSize_ : 0;
+}
+
+bool TriangleMesh::closestPoint(const Vector & position, Vector & point, uint32_t & triangle, scalar maxDistance) const
+{
+	if( ! bvh_)
+		return false;
+
+	ClosestPointInfo info;
+	if( ! bvh_->getClosestPoint(Vector3(position[0], position[1], position[2]), &info, maxDistance))
+		return false;
+	point = Vector(info.point.x, info.point.y, info.point.z);
+	triangle = info.primitive;
+	return true;
+}
+
+scalar TriangleMesh::wallDistance(const Vector & position, scalar maxDistance) const
+{
+	const scalar lowerBound = wallDistanceLowerBound(position);
+	if(lowerBound >= maxDistance)
+		return maxDistance;
+
+	Vector point;
+	uint32_t triangle;
+	scalar distance = maxDistance;
+	if(closestPoint(position, point, triangle, maxDistance))
+		distance = (point - position).norm();
+	return std::max(lowerBound, distance - meshEpsilon_);
+}
+
+/*
+ * p0: ray start point
+ * p1: ray end point
+ * info: Info about the intersection (if found)
+ */
+bool TriangleMesh::findRayIntersection(const Vector & p0, const Vector & p1, IntersectionInfo & info) const
+{
+	if( ! bvh_)
+		return false;
+
+	// Get ray direction
+	Vector dir = p1 - p0;
+	float dist = dir.norm();
+	if(std::abs(dist) < std::numeric_limits<float>::epsilon())
+		return false;
+	dir /= dist;
+
+	// Check for intersection, only the hits up to p1 are searched for
+	const float maxDistance = std::nextafter(dist, std::numeric_limits<float>::infinity());
+	if(bvh_->getIntersection(Ray(Vector3(p0[0], p0[1], p0[2]), Vector3(dir[0], dir[1], dir[2])), &info, false, maxDistance)) {
+		return info.t > 0 && info.t <= dist;
+	}
+	return false;
+}
+
+size_t TriangleMesh::findSegmentIntersections(const std::vector<Vector> & start, const std::vector<Vector> & end, 
+	std::vector<SegmentIntersection> & output, int numberOfThreads, const scalar * knownWallDistance, scalar pathMargin) const
+{
+	const size_t n = start.size();
+	output.resize(n);
+
+	// Consecutive segments are handed to the same thread, so the traversal of a thread stays coherent
+	// when the segments are ordered spatially
+	size_t numberOfSkipped = 0;
+	#pragma omp parallel for schedule(dynamic, 256) num_threads(numberOfThreads) reduction(+:numberOfSkipped)
+	for(int i = 0; i < (int) n; ++i) {
+		SegmentIntersection & result = output[i];
+
+		// Broad phase, a segment shorter than the distance from its start to the mesh cannot reach the mesh
+		const scalar bound = (knownWallDistance ? std::max(knownWallDistance[i], wallDistanceLowerBound(start[i])) 
+			: wallDistanceLowerBound(start[i])) - pathMargin;
+		if(bound > 0 && (end[i] - start[i]).squaredNorm() < bound * bound) {
+			result.hit = false;
+			++numberOfSkipped;
+			continue;
+		}
+
+		IntersectionInfo info;
+		result.hit = findRayIntersection(start[i], end[i], info);
+		if(result.hit) {
+			result.fraction = info.t / (end[i] - start[i]).norm();
+			result.normal = Vector(info.normal.x, info.normal.y, info.normal.z);
+			result.triangle = info.primitive;
+		}
+	}
+	return numberOfSkipped;
+}
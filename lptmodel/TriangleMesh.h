@@ -0,0 +1,105 @@
+#ifndef TRIANGLEMESH_H_
+#define TRIANGLEMESH_H_
+#include "BVH.h"
+#include "Object.h"
+#include "Triangle.h"
+#include "typedefs.h"
+#include <memory>
+#include <string>
+#include <vector>
+#include <limits>
+
+// Intersection of a segment with the mesh
+struct SegmentIntersection {
+	bool hit;
+	scalar fraction;	// Fraction of the segment before the intersection
+	Vector normal;		// Unit normal of the triangle (local frame)
+	uint32_t triangle;	// Index of the triangle, in BVH order
+};
+
+struct TriangleMeshParameters {
+	BVHBuildParameters bvh{};
+	int distanceGridResolution = 64;	// Number of broad phase cells along the longest axis of the mesh, 0 disables the broad phase
+	bool useBVHCache = true;		// Read the BVH from a cache file next to the STL file, and write it if missing
+
+	bool operator==(const TriangleMeshParameters & rhs) const
+	{
+		return bvh.leafSize == rhs.bvh.leafSize && bvh.numberOfBins == rhs.bvh.numberOfBins && bvh.splitMethod == rhs.bvh.splitMethod
+			&& bvh.doublePrecisionFallback == rhs.bvh.doublePrecisionFallback && distanceGridResolution == rhs.distanceGridResolution;
+	}
+};
+
+/*
+ * Static triangle mesh with its search structures (BVH and distance grid), in the frame of the STL file.
+ * The mesh is never modified after it has been built, so one mesh is shared by all boundaries using
+ * the same STL file, each boundary placing it in the world frame with its own coordinate system (see RayTracer).
+ */
+class TriangleMesh {
+public:
+	TriangleMesh() = default;
+	~TriangleMesh();
+	TriangleMesh(const TriangleMesh &) = delete;
+	TriangleMesh & operator=(const TriangleMesh &) = delete;
+
+	// Returns the mesh of an STL file. Meshes in use are shared between the callers with the same file and parameters.
+	static std::shared_ptr<const TriangleMesh> load(const std::string & fileName, const TriangleMeshParameters & parameters);
+
+	void readSTL(const char *, const TriangleMeshParameters & parameters);
+
+	size_t size() const { return objects_.size(); }
+	// Triangle i, in BVH order
+	const Triangle & triangle(size_t i) const { return *static_cast<const Triangle *>(objects_[i]); }
+	// Vertices of the mesh, each shared vertex stored once
+	const std::vector<Vector> & vertices() const { return vertices_; }
+	// Indices of the vertices of triangle i, in BVH order
+	const uint32_t * vertexIndices(size_t i) const { return &vertexIndices_[3*i]; }
+	const Vector & lower() const { return meshLower_; }
+	const Vector & upper() const { return meshUpper_; }
+
+	bool findRayIntersection(const Vector &, const Vector &, IntersectionInfo &) const;
+
+	// Intersect the segments from start[i] to end[i] with the mesh. The threads are handed contiguous groups
+	// of segments, so spatially ordered segments (see ParticleStore::sortSpatially) visit the same nodes in
+	// consecutive queries. Segments shorter than the distance from their start to the mesh are not tested
+	// against the BVH, returns the number of such segments. The distance is bounded by the distance grid,
+	// and by knownWallDistance[i] if given. The paths between the segment ends may deviate by up to pathMargin
+	// from the segments, such segments are only skipped if the margin is within the distance as well.
+	size_t findSegmentIntersections(const std::vector<Vector> & start, const std::vector<Vector> & end,
+		std::vector<SegmentIntersection> & output, int numberOfThreads = 1, const scalar * knownWallDistance = nullptr,
+		scalar pathMargin = 0) const;
+
+	// Lower bound of the distance from a position to the mesh, from the distance grid
+	scalar wallDistanceLowerBound(const Vector & position) const;
+
+	// Closest point of the mesh to a position, closer than maxDistance. Returns false if there is none.
+	bool closestPoint(const Vector & position, Vector & point, uint32_t & triangle,
+		scalar maxDistance = std::numeric_limits<scalar>::infinity()) const;
+
+	// Conservative lower bound of the distance from a position to the mesh, at most maxDistance.
+	// The distance is exact up to the rounding error of the closest point query.
+	scalar wallDistance(const Vector & position, scalar maxDistance) const;
+
+private:
+	void clear();
+	void buildDistanceGrid(int resolution);
+	bool readBVHCache(const std::string & fileName, uint64_t stlHash, const BVHBuildParameters & parameters);
+	void writeBVHCache(const std::string & fileName, uint64_t stlHash, const BVHBuildParameters & parameters) const;
+
+	BVH * bvh_ = nullptr;
+	std::vector<Triangle> triangles_{};
+	std::vector<Object *> objects_{};	// Pointers to the triangles, in BVH order
+	std::vector<Vector> vertices_{};
+	std::vector<uint32_t> vertexIndices_{};	// Three per triangle, in BVH order
+
+	// Broad phase. The mesh bounding box is divided into cubic cells, and each cell stores the
+	// Chebyshev distance, in cells, to the nearest cell overlapped by a triangle bounding box.
+	Vector meshLower_{0, 0, 0};
+	Vector meshUpper_{0, 0, 0};
+	scalar meshEpsilon_ = 0;	// Rounding error margin of the closest point queries
+	Vector gridOrigin_{0, 0, 0};
+	scalar gridCellSize_ = 0;
+	int gridSize_[3] = {0, 0, 0};
+	std::vector<uint16_t> gridDistance_{};
+};
+
+#endif /* TRIANGLEMESH_H_ */
@@ -29,6 +29,9 @@
 #include <cstring>
 #include <algorithm>
 #include <new>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 /**
  * Default kd-tree constructor.
@@ -91,10 +94,11 @@ const typename kd_tree<T, D, S>::kd_point & kd_tree<T, D, S>::operator [] (unsig
  * \param points Array of contiguous D-dimensional kd_points.
  * \param num_points Number of elements in \a p.
  * \param bucket_size Number of elements that should be grouped in leaf nodes.
+ * \param num_threads Number of OpenMP threads used to build the subtrees. Ignored when called from a parallel region.
  * \return \c true if successful, \c false otherwise.
  */
 template <typename T, const unsigned int D, typename S>
-bool kd_tree<T, D, S>::build(const kd_point *points, unsigned int num_points, unsigned int bucket_size) {
+bool kd_tree<T, D, S>::build(const kd_point *points, unsigned int num_points, unsigned int bucket_size, int num_threads) {
 
   // Check params.
   if (points == NULL || num_points == 0 || bucket_size == 0)
@@ -108,9 +112,12 @@ bool kd_tree<T, D, S>::build(const kd_point *points, unsigned int num_points, un
   for (unsigned int i=0; i<num_points; ++i)
     permutation[i] = i;
 
-  // Build the kd-tree recursively (num_elements will contain a recursively-calculated num_points after the call).
-  num_elements = 0;
-  root = kd_node::build(points, permutation, num_points, NULL, bucket_size, num_elements);
+  // Build the kd-tree recursively. Large subtrees are built as parallel tasks when OpenMP is enabled,
+  // the resulting tree is the same as when built serially.
+  num_elements = num_points;
+  #pragma omp parallel if(num_threads > 1 && !omp_in_parallel()) num_threads(num_threads > 1 ? num_threads : 1)
+  #pragma omp single
+  root = kd_node::build(points, permutation, num_points, NULL, bucket_size, 0);
 
   // Make a permutated copy of the input data and calculate the inverse permutation.
   data = new kd_point[num_points];
@@ -131,12 +138,13 @@ bool kd_tree<T, D, S>::build(const kd_point *points, unsigned int num_points, un
  * \param n Number of elements in \a index.
  * \param parent Parent node.
  * \param bucket_size Number of elements that should be grouped in leaf nodes.
- * \param processed Number of elements already processed and stored in the tree. Updated as the building expands.
+ * \param first Position of the first element of \a indices in the permutation array. The subtrees of a node
+ * cover disjoint ranges of the array, so they can be built independently.
  * \return Node of the tree completely initialized.
  */
 template <typename T, const unsigned int D, typename S>
 typename kd_tree<T, D, S>::kd_node *kd_tree<T, D, S>::kd_node::build(const kd_point *data, unsigned int *indices, unsigned int n,
-    kd_node *parent, unsigned int bucket_size, unsigned int &processed) {
+    kd_node *parent, unsigned int bucket_size, unsigned int first) {
 
   // Handle empty nodes (only for degenerate bucket sizes).
   if (n == 0)
@@ -163,24 +171,26 @@ typename kd_tree<T, D, S>::kd_node *kd_tree<T, D, S>::kd_node::build(const kd_po
   node->split_value = data[indices[pivot]][node->axis];
 
   // Process the left part recursively, creating a leaf is remaining data is not greater than the bucket size.
-  if (left_elements > bucket_size)
-    node->left_branch = build(data, indices, left_elements, node, bucket_size, processed);
-  else {
-    node->left_leaf = new kd_leaf(processed, left_elements);
+  // The subtrees of large nodes are built as tasks (ignored when OpenMP is disabled).
+  if (left_elements > bucket_size) {
+    #pragma omp task if(n >= parallel_build_size)
+    node->left_branch = build(data, indices, left_elements, node, bucket_size, first);
+  } else {
+    node->left_leaf = new kd_leaf(first, left_elements);
     node->is_leaf |= left_bit;
-    processed += left_elements;
   }
 
   // Process the right part recursively, creating a leaf is remaining data is not greater than the bucket size.
-  if (right_elements > bucket_size)
-    node->right_branch = build(data, right_indices, right_elements, node, bucket_size, processed);
-  else {
-    node->right_leaf = new kd_leaf(processed, right_elements);
+  if (right_elements > bucket_size) {
+    #pragma omp task if(n >= parallel_build_size)
+    node->right_branch = build(data, right_indices, right_elements, node, bucket_size, first + left_elements);
+  } else {
+    node->right_leaf = new kd_leaf(first + left_elements, right_elements);
     node->is_leaf |= right_bit;
-    processed += right_elements;
   }
 
-  // Return processed node.
+  // Return processed node once the subtrees are complete.
+  #pragma omp taskwait
   return node;
 }
 
@@ -204,7 +214,17 @@ unsigned int kd_tree<T, D, S>::kd_node::split(unsigned int *indices, unsigned in
     return 0;
 
   // Sort the indices (a partial sort was used previously, but it was slower due to the internal use of STL heaps).
-  std::sort(indices, indices + n, comparer);
+  // The (value, index) pairs are sorted rather than the indices to avoid an indirect data access per comparison.
+  // Since the comparisons have the same outcomes, std::sort moves the elements exactly as it would move the
+  // indices, and the resulting order (including that of equal values) is the same.
+  std::vector<kd_sort_key> keys(n);
+  for (unsigned int i=0; i<n; ++i) {
+    keys[i].value = comparer.data[indices[i]][comparer.axis];
+    keys[i].index = indices[i];
+  }
+  std::sort(keys.begin(), keys.end());
+  for (unsigned int i=0; i<n; ++i)
+    indices[i] = keys[i].index;
 
   // Return the index of the median.
   unsigned int median = ((n + 1) >> 1) - 1;
@@ -306,6 +326,44 @@ void kd_tree<T, D, S>::all_in_range(const kd_point &p, T distance, std::vector<k
   }
 }
 
+/**
+ * Find the K nearest neighbours of a given kd_point within a maximum distance and push their indices sorted into a given STL vector.
+ * Equivalent to knn followed by discarding the neighbours farther than \a distance, but done in a single traversal where
+ * the distance bound prunes the tree until K candidates have been found.
+ *
+ * \param p Point whose \a K neighbours should be retrieved.
+ * \param K Maximum number of nearest neighbours to retrieve.
+ * \param distance Euclidean distance margin used to retrieve the neighbours within.
+ * \param output STL vector where the nearest neighbours will be appended in increasing distance.
+ * \param ignore_p_in_tree Assume that \a p is contained in the tree any number of times and ignore them all.
+ */
+template <typename T, const unsigned int D, typename S>
+void kd_tree<T, D, S>::knn_in_range(const kd_point &p, unsigned int K, T distance, std::vector<kd_neighbour> &output, bool ignore_p_in_tree) const {
+
+  // Check if there is any data on the tree and K and the distance are valid.
+  if (root == NULL || num_elements == 0 || K == 0 || distance <= (T) 0)
+    return;
+
+  // Create an object for tree traversal and incremental hyperrectangle-hypersphere intersection calculation.
+  // No candidates are required before discarding regions of space (K = 0), since the distance already bounds the search.
+  kd_search_data search_data(p, data, 0, ignore_p_in_tree);
+  search_data.farthest_distance = distance * distance;
+
+  // Build a K-best container bounded by the distance range.
+  kd_bounded_candidates best_k(K, search_data.farthest_distance);
+
+  // Start an exploration traversal from the root.
+  root->explore(NULL, search_data, best_k);
+
+  // Append the nearest neighbours to the output vector in increasing distance correcting index permutations.
+  while (!best_k.empty()) {
+    kd_neighbour neighbour = best_k.back();
+    neighbour.index = permutation[neighbour.index];
+    output.push_back(neighbour);
+    best_k.pop_back();
+  }
+}
+
 /**
  * Initialize a data searching structure with incremental hyperrectangle intersection calculation.
  *
@@ -113,6 +113,9 @@
 template <typename T, const unsigned int D, typename S = k_vector<vector_distance<T>, vector_distance<T> > >
 class kd_tree {
 public:
+  /// Allow flattening the tree into an index based layout (see FlatKdTree.h).
+  friend class FlatKdTree;
+
   /// Consider compatible feature vectors as D-dimensional points in the space.
   typedef feature_vector<T, D> kd_point;
 
@@ -124,9 +127,10 @@ public:
   ~kd_tree(); ///< Default destructor.
 
   // Basic kd-tree operations.
-  bool build(const kd_point *points, unsigned int num_points, unsigned int bucket_size = 32); ///< Build a kd-tree from a set of input points. Cost: O(n log² n).
+  bool build(const kd_point *points, unsigned int num_points, unsigned int bucket_size = 32, int num_threads = 1); ///< Build a kd-tree from a set of input points. Cost: O(n log² n), subtrees are built in parallel with num_threads OpenMP threads.
   void knn(const kd_point &p, unsigned int K, std::vector<kd_neighbour> &output, T epsilon = (T) 0, bool ignore_p_in_tree = false) const; ///< Get the K nearest neighbours of a point. Estimated average cost: O(log K log n).
   void all_in_range(const kd_point &p, T distance, std::vector<kd_neighbour> &output, bool ignore_p_in_tree = false) const; ///< Get all neighbours within a distance from a point. Estimated average Cost: O(log m log n) depending on the number of results m.
+  void knn_in_range(const kd_point &p, unsigned int K, T distance, std::vector<kd_neighbour> &output, bool ignore_p_in_tree = false) const; ///< Get the K nearest neighbours within a distance from a point in a single traversal. Estimated average cost: O(log K log n).
 
   // Subscript operator for accesing stored data (will fail on non-built kd-trees).
   const kd_point & operator [] (unsigned int index) const;
@@ -168,6 +172,22 @@ protected:
     kd_search_data(const kd_point &p, const kd_point *data, unsigned int K, bool ignore_p_in_tree);
   };
 
+  /// K-best candidates container bounded by a maximum distance. Until K candidates are found, the bound acts as the farthest nearest neighbour.
+  struct kd_bounded_candidates {
+    S best_k; ///< Current K nearest neighbour candidates.
+    kd_neighbour bound; ///< Dummy neighbour holding the squared distance bound.
+
+    /// Create an empty container for \a K candidates within a squared distance.
+    kd_bounded_candidates(unsigned int K, T squared_distance) : best_k(K), bound(-1, squared_distance) {}
+
+    bool empty() const { return best_k.empty(); }
+    unsigned int size() const { return best_k.size(); }
+    const kd_neighbour &front() const { return best_k.full() ? best_k.front() : bound; }
+    const kd_neighbour &back() const { return best_k.back(); }
+    void push_back(const kd_neighbour &elem) { best_k.push_back(elem); }
+    void pop_back() { best_k.pop_back(); }
+  };
+
   /// Kd-tree leaf node.
   struct kd_leaf {
     unsigned int first_index; ///< Index of the first element contained by the leaf node.
@@ -244,11 +264,25 @@ protected:
       }
     };
 
+    /// Axis value and index of an element. Sorted in place of the indices to avoid indirect accesses.
+    struct kd_sort_key {
+      T value; ///< Axis-th value of the element.
+      unsigned int index; ///< Index of the element in the input data.
+
+      /// Compare by value only, like kd_axis_comparer.
+      bool operator < (const kd_sort_key &other) const {
+        return value < other.value;
+      }
+    };
+
     // --- Training-related --- //
 
+    /// Minimum number of elements of a node for its subtrees to be built as parallel tasks.
+    static const unsigned int parallel_build_size = 1 << 15;
+
     /// Build the kd-tree recursively.
     static kd_node *build(const kd_point *data, unsigned int *index, unsigned int n,
-        kd_node *parent, unsigned int bucket_size, unsigned int &processed);
+        kd_node *parent, unsigned int bucket_size, unsigned int first);
 
     /// Find a pivot to split the space in two by a chosen dimension during training.
     unsigned int split(unsigned int *index, unsigned int n, const kd_axis_comparer &comparer);
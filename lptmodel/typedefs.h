@@ -1,5 +1,6 @@
 #ifndef TYPEDEFS_H_
 #define TYPEDEFS_H_
+#include <cmath>
 #include <Eigen/Core>
 #include "json.hpp"
 
@@ -12,6 +13,31 @@ using Vector = Eigen::Matrix<scalar, 3, 1>;
 // Matrix
 using Matrix = Eigen::Matrix<scalar, 3, 3>;
 
+// Symmetric 3x3 matrix, stored as its upper triangle (xx, xy, xz, yy, yz, zz)
+using SymmetricTensor = Eigen::Matrix<scalar, 6, 1>;
+
+inline Matrix symmetricTensorToMatrix(const SymmetricTensor & s)
+{
+	Matrix m;
+	m << s[0], s[1], s[2],
+	     s[1], s[3], s[4],
+	     s[2], s[4], s[5];
+	return m;
+}
+
+inline SymmetricTensor matrixToSymmetricTensor(const Matrix & m)
+{
+	SymmetricTensor s;
+	s << m(0, 0), m(0, 1), m(0, 2), m(1, 1), m(1, 2), m(2, 2);
+	return s;
+}
+
+// Frobenius norm of a symmetric tensor
+inline scalar symmetricTensorNorm(const SymmetricTensor & s)
+{
+	return std::sqrt(s[0]*s[0] + s[3]*s[3] + s[5]*s[5] + 2*(s[1]*s[1] + s[2]*s[2] + s[4]*s[4]));
+}
+
 // Convenience typedef
 using json = nlohmann::json;
 
@@ -0,0 +1,92 @@
+#include <fstream>
+#include <vector>
+#include <iostream>
+#include <cstdlib>
+#include <Eigen/Dense>
+#include "Interpolator.h"
+#include "typedefs.h"
+#include "Stopwatch.h"
+
+#include "EcmoPumpInterpolator.h"
+
+// Compares the neighbor search strategies of the interpolator on an EnSight data set.
+// Usage: benchmark_interpolation <case file> [number of queries]
+struct BenchmarkResult {
+	double time = 0;
+	double meanNumberOfPoints = 0;
+	int numberOfFailures = 0;
+	std::vector<Vector> velocity;
+	std::vector<SymmetricTensor> shear;
+};
+
+BenchmarkResult runBenchmark(EcmoPumpInterpolator & interpolator, const std::vector<Vector> & positions)
+{
+	BenchmarkResult result;
+	result.velocity.resize(positions.size());
+	result.shear.resize(positions.size());
+
+	InterpolationWorkspace workspace;
+	std::vector<unsigned char> found(positions.size());
+
+	// Number of points used by the Shepard weights
+	size_t numberOfPoints = 0;
+	for(const Vector & position : positions)
+		if(interpolator.getInterpolationWeights(position, workspace))
+			numberOfPoints += workspace.weights.size();
+	result.meanNumberOfPoints = (double) numberOfPoints / positions.size();
+
+	Stopwatch stopwatch;
+	interpolator.interpolate(&positions[0], positions.size(), &result.velocity[0], &result.shear[0], &found[0], workspace);
+	result.time = stopwatch.read();
+
+	for(unsigned char f : found)
+		if( ! f)
+			++result.numberOfFailures;
+
+	return result;
+}
+
+int main(int argc, char * argv[])
+{
+	if(argc < 2) {
+		std::cerr << "Usage: " << argv[0] << " <case file> [number of queries]" << std::endl;
+		return EXIT_FAILURE;
+	}
+	int numberOfQueries = argc > 2 ? std::atoi(argv[2]) : 100000;
+
+	EcmoPumpInterpolator interpolator;
+	interpolator.readData(argv[1]);
+
+	// Query points are perturbed data points, which mimics particles moving through the mesh
+	const UnstructuredPointInterpolator::SearchTree & searchTree = interpolator.searchTree();
+	std::vector<Vector> positions;
+	positions.reserve(numberOfQueries);
+	std::srand(0);
+	for(int i = 0; i < numberOfQueries; ++i) {
+		Vector offset = Vector::Random() * interpolator.minSearchRadius();
+		positions.push_back(searchTree.point(std::rand() % searchTree.size()) + offset);
+	}
+
+	interpolator.neighborSearch() = UnstructuredPointInterpolator::NeighborSearch::Bisection;
+	BenchmarkResult bisection = runBenchmark(interpolator, positions);
+
+	interpolator.neighborSearch() = UnstructuredPointInterpolator::NeighborSearch::KNearest;
+	BenchmarkResult kNearest = runBenchmark(interpolator, positions);
+
+	// Difference between the strategies, relative to the velocity magnitude
+	double maxVelocityDifference = 0;
+	for(int i = 0; i < numberOfQueries; ++i) {
+		double norm = std::max(bisection.velocity[i].norm(), std::numeric_limits<float>::epsilon());
+		maxVelocityDifference = std::max(maxVelocityDifference, (double) (kNearest.velocity[i] - bisection.velocity[i]).norm() / norm);
+	}
+
+	std::cout << searchTree.size() << " points, " << numberOfQueries << " queries" << std::endl;
+	std::cout << "Bisection: " << 1e6 * bisection.time / numberOfQueries << " us/query, "
+		<< bisection.meanNumberOfPoints << " points/query, " << bisection.numberOfFailures << " failures" << std::endl;
+	std::cout << "k-nearest: " << 1e6 * kNearest.time / numberOfQueries << " us/query, "
+		<< kNearest.meanNumberOfPoints << " points/query, " << kNearest.numberOfFailures << " failures" << std::endl;
+	std::cout << "Speedup: " << bisection.time / kNearest.time << std::endl;
+	std::cout << "Max relative velocity difference: " << maxVelocityDifference << std::endl;
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,92 @@
+#include <vector>
+#include <iostream>
+#include <cstdlib>
+#include <random>
+#include "kd-tree.h"
+#include "FlatKdTree.h"
+#include "typedefs.h"
+#include "Stopwatch.h"
+
+// Compares the kche kd-tree with the flat search tree used by the interpolators, on random points.
+// Usage: benchmark_search_tree [number of points] [number of queries] [number of neighbors]
+int main(int argc, char * argv[])
+{
+	size_t numberOfPoints = argc > 1 ? std::atol(argv[1]) : 2000000;
+	int numberOfQueries = argc > 2 ? std::atoi(argv[2]) : 1000000;
+	unsigned int K = argc > 3 ? std::atoi(argv[3]) : 5;
+
+	// Points in a unit cube, the search radius contains about 2K points on average
+	std::mt19937 generator(0);
+	std::uniform_real_distribution<scalar> distribution(0, 1);
+	std::vector<feature_vector<scalar, 3>> points(numberOfPoints);
+	for(feature_vector<scalar, 3> & point : points)
+		for(int d = 0; d < 3; ++d)
+			point[d] = distribution(generator);
+	const scalar searchRadius = std::cbrt(2 * K / (4.18879 * numberOfPoints));
+
+	std::vector<Vector> positions(numberOfQueries);
+	for(Vector & position : positions)
+		position = Vector(distribution(generator), distribution(generator), distribution(generator));
+
+	Stopwatch stopwatch;
+	kd_tree<scalar, 3> kcheTree;
+	kcheTree.build(&points[0], points.size());
+	double kcheBuildTime = stopwatch.read();
+
+	stopwatch.reset();
+	FlatKdTree flatTree;
+	flatTree.build(kcheTree);
+	double flattenTime = stopwatch.read();
+
+	// k nearest within the search radius
+	std::vector<vector_distance<scalar>> neighbors;
+	double kcheChecksum = 0, flatChecksum = 0;
+	stopwatch.reset();
+	for(const Vector & position : positions) {
+		feature_vector<scalar, 3> p;
+		p[0] = position[0]; p[1] = position[1]; p[2] = position[2];
+		neighbors.clear();
+		kcheTree.knn_in_range(p, K, searchRadius, neighbors);
+		for(const vector_distance<scalar> & neighbor : neighbors)
+			kcheChecksum += neighbor.squared_distance;
+	}
+	double kcheKnnTime = stopwatch.read();
+
+	stopwatch.reset();
+	for(const Vector & position : positions) {
+		flatTree.knnInRange(position, K, searchRadius, neighbors);
+		for(const vector_distance<scalar> & neighbor : neighbors)
+			flatChecksum += neighbor.squared_distance;
+	}
+	double flatKnnTime = stopwatch.read();
+
+	// All points within the search radius
+	size_t kcheCount = 0, flatCount = 0;
+	stopwatch.reset();
+	for(const Vector & position : positions) {
+		feature_vector<scalar, 3> p;
+		p[0] = position[0]; p[1] = position[1]; p[2] = position[2];
+		neighbors.clear();
+		kcheTree.all_in_range(p, searchRadius, neighbors, false);
+		kcheCount += neighbors.size();
+	}
+	double kcheRangeTime = stopwatch.read();
+
+	stopwatch.reset();
+	for(const Vector & position : positions) {
+		flatTree.allInRange(position, searchRadius, neighbors);
+		flatCount += neighbors.size();
+	}
+	double flatRangeTime = stopwatch.read();
+
+	std::cout << numberOfPoints << " points, " << numberOfQueries << " queries, K = " << K << std::endl;
+	std::cout << "Build: " << kcheBuildTime << " s, flatten: " << flattenTime << " s" << std::endl;
+	std::cout << "k-nearest in range: kd_tree " << 1e6 * kcheKnnTime / numberOfQueries << " us/query, flat "
+		<< 1e6 * flatKnnTime / numberOfQueries << " us/query, speedup " << kcheKnnTime / flatKnnTime << std::endl;
+	std::cout << "All in range: kd_tree " << 1e6 * kcheRangeTime / numberOfQueries << " us/query, flat "
+		<< 1e6 * flatRangeTime / numberOfQueries << " us/query, speedup " << kcheRangeTime / flatRangeTime << std::endl;
+	if(kcheChecksum != flatChecksum || kcheCount != flatCount)
+		std::cout << "Results differ: " << kcheChecksum << " / " << flatChecksum << ", " << kcheCount << " / " << flatCount << std::endl;
+
+	return EXIT_SUCCESS;
+}
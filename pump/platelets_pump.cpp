@@ -27,7 +27,10 @@ int main(int argc, char * argv[])
 	model.fromJSON(j);
 
 	// Create interpolator
-	model.setInterpolator(new EcmoPumpInterpolator());
+	auto interpolator = new EcmoPumpInterpolator();
+	if(j.count("interpolation"))
+		interpolator->fromJSON(j.at("interpolation"));
+	model.setInterpolator(interpolator);
 
 	// Run simulation
 	model.run();